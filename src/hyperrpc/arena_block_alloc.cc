@@ -0,0 +1,118 @@
+/* Copyright (c) 2016, Bin Wei <bin@vip.qq.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of of its contributors may not be used to endorse or 
+ * promote products derived from this software without specific prior 
+ * written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include "hyperrpc/arena_block_alloc.h"
+
+namespace hrpc {
+
+ArenaBlockAlloc::ArenaBlockAlloc()
+{
+  for (auto& size_class : classes_) {
+    size_class.head = nullptr;
+    size_class.cached_bytes = 0;
+  }
+}
+
+ArenaBlockAlloc::~ArenaBlockAlloc()
+{
+  for (auto& size_class : classes_) {
+    while (size_class.head) {
+      FreeBlock* block = size_class.head;
+      size_class.head = block->next;
+      free(block);
+    }
+  }
+}
+
+ArenaBlockAlloc* ArenaBlockAlloc::Local()
+{
+  static thread_local ArenaBlockAlloc alloc;
+  return &alloc;
+}
+
+size_t ArenaBlockAlloc::ClassIndex(size_t size)
+{
+  if (size <= (1UL << kMinClassOrder)) {
+    return 0;
+  }
+  size_t order = 64 - __builtin_clzl(size - 1);
+  if (order > kMaxClassOrder) {
+    return kClassNum;
+  }
+  return order - kMinClassOrder;
+}
+
+void* ArenaBlockAlloc::Alloc(size_t size)
+{
+  size_t index = ClassIndex(size);
+  if (index == kClassNum) {
+    return malloc(size);
+  }
+  SizeClass& size_class = Local()->classes_[index];
+  if (size_class.head) {
+    FreeBlock* block = size_class.head;
+    size_class.head = block->next;
+    size_class.cached_bytes -= (1UL << (index + kMinClassOrder));
+    return block;
+  }
+  // blocks of a class are of the same size whatever size is requested
+  return malloc(1UL << (index + kMinClassOrder));
+}
+
+void ArenaBlockAlloc::Free(void* ptr, size_t size)
+{
+  size_t index = ClassIndex(size);
+  if (index == kClassNum) {
+    free(ptr);
+    return;
+  }
+  SizeClass& size_class = Local()->classes_[index];
+  size_t block_size = 1UL << (index + kMinClassOrder);
+  if (size_class.cached_bytes + block_size > kMaxClassCachedBytes) {
+    free(ptr);
+    return;
+  }
+  // blocks may be freed by another thread, and then cached by it
+  FreeBlock* block = static_cast<FreeBlock*>(ptr);
+  block->next = size_class.head;
+  size_class.head = block;
+  size_class.cached_bytes += block_size;
+}
+
+size_t ArenaBlockAlloc::CachedBytes()
+{
+  size_t bytes = 0;
+  for (const auto& size_class : Local()->classes_) {
+    bytes += size_class.cached_bytes;
+  }
+  return bytes;
+}
+
+} // namespace hrpc
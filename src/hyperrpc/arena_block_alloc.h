@@ -0,0 +1,85 @@
+/* Copyright (c) 2016, Bin Wei <bin@vip.qq.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of of its contributors may not be used to endorse or 
+ * promote products derived from this software without specific prior 
+ * written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _HRPC_ARENA_BLOCK_ALLOC_H
+#define _HRPC_ARENA_BLOCK_ALLOC_H
+
+#include <stddef.h>
+
+namespace hrpc {
+
+/* Per-thread allocator of protobuf Arena blocks by power of 2 size classes
+ *
+ * Freed blocks are cached in free lists of the calling thread, so arenas
+ * of a worker thread get blocks without malloc in steady state. Blocks
+ * larger than the max class go to malloc directly. It matches the
+ * block_alloc/block_dealloc hooks of google::protobuf::ArenaOptions.
+ */
+class ArenaBlockAlloc
+{
+public:
+  static void* Alloc(size_t size);
+  static void Free(void* ptr, size_t size);
+
+  // bytes of blocks cached by the calling thread
+  static size_t CachedBytes();
+
+private:
+  static constexpr size_t kMinClassOrder = 8;
+  static constexpr size_t kMaxClassOrder = 16;
+  static constexpr size_t kClassNum = kMaxClassOrder - kMinClassOrder + 1;
+  // limit of bytes cached by each size class of a thread
+  static constexpr size_t kMaxClassCachedBytes = 512 * 1024;
+
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+  struct SizeClass {
+    FreeBlock* head;
+    size_t cached_bytes;
+  };
+
+  ArenaBlockAlloc();
+  ~ArenaBlockAlloc();
+  // not copyable and movable
+  ArenaBlockAlloc(const ArenaBlockAlloc&) = delete;
+  void operator=(const ArenaBlockAlloc&) = delete;
+  ArenaBlockAlloc(ArenaBlockAlloc&&) = delete;
+  void operator=(ArenaBlockAlloc&&) = delete;
+
+  static ArenaBlockAlloc* Local();
+  // kClassNum if size is beyond the max class
+  static size_t ClassIndex(size_t size);
+
+  SizeClass classes_[kClassNum];
+};
+
+} // namespace hrpc
+
+#endif // _HRPC_ARENA_BLOCK_ALLOC_H
@@ -159,10 +159,19 @@ void CppServiceGenerator::GenerateMethodSignatures(bool is_virtual,
       "    ::hrpc::DoneFunc done);\n");
     if (!is_virtual) {
       printer->Print(sub_vars,
+        "void $name$(\n"
+        "    const $input_type$* request,\n"
+        "    $output_type$* response,\n"
+        "    const ::hrpc::CallOptions& call_opts,\n"
+        "    ::hrpc::DoneFunc done);\n"
         "// sync stub method\n"
         "::hrpc::Result $name$(\n"
         "    const $input_type$& request,\n"
-        "    $output_type$* response);\n");
+        "    $output_type$* response);\n"
+        "::hrpc::Result $name$(\n"
+        "    const $input_type$& request,\n"
+        "    $output_type$* response,\n"
+        "    const ::hrpc::CallOptions& call_opts);\n");
     }
   }
 }
@@ -327,6 +336,15 @@ void CppServiceGenerator::GenerateStubMethods(io::Printer* printer)
       "  hrpc_->CallMethod(descriptor()->method($index$),\n"
       "                    request, response, std::move(done));\n"
       "}\n");
+    printer->Print(sub_vars,
+      "void $classname$_Stub::$name$(\n"
+      "    const $input_type$* request,\n"
+      "    $output_type$* response,\n"
+      "    const ::hrpc::CallOptions& call_opts,\n"
+      "    ::hrpc::DoneFunc done) {\n"
+      "  hrpc_->CallMethod(descriptor()->method($index$),\n"
+      "                    request, response, call_opts, std::move(done));\n"
+      "}\n");
     printer->Print(sub_vars,
       "::hrpc::Result $classname$_Stub::$name$(\n"
       "    const $input_type$& request,\n"
@@ -334,6 +352,14 @@ void CppServiceGenerator::GenerateStubMethods(io::Printer* printer)
       "  return hrpc_->CallMethod(descriptor()->method($index$),\n"
       "                           &request, response, nullptr);\n"
       "}\n");
+    printer->Print(sub_vars,
+      "::hrpc::Result $classname$_Stub::$name$(\n"
+      "    const $input_type$& request,\n"
+      "    $output_type$* response,\n"
+      "    const ::hrpc::CallOptions& call_opts) {\n"
+      "  return hrpc_->CallMethod(descriptor()->method($index$),\n"
+      "                           &request, response, call_opts, nullptr);\n"
+      "}\n");
   }
 }
 
@@ -0,0 +1,128 @@
+/* Copyright (c) 2016, Bin Wei <bin@vip.qq.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of of its contributors may not be used to endorse or 
+ * promote products derived from this software without specific prior 
+ * written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <lz4.h>
+#include <zstd.h>
+#include "hyperrpc/compressor.h"
+#include "hyperrpc/constants.h"
+
+namespace hrpc {
+
+// favor speed as compression is done in worker threads
+static constexpr int kZstdCompressLevel = 1;
+// max ratios of the formats: a LZ4 sequence encodes at most 255 bytes per
+// byte, and a zstd block of 128KB is at least 4 bytes as RLE
+static constexpr size_t kLz4MaxRatio = 255;
+static constexpr size_t kZstdMaxRatio = 128 * 1024 / 4;
+
+// zstd contexts are costly to create, so reuse them within each thread
+struct ZstdContexts
+{
+  ZstdContexts() : cctx(ZSTD_createCCtx()), dctx(ZSTD_createDCtx()) {}
+  ~ZstdContexts() {
+    ZSTD_freeCCtx(cctx);
+    ZSTD_freeDCtx(dctx);
+  }
+  ZSTD_CCtx* cctx;
+  ZSTD_DCtx* dctx;
+};
+
+static ZstdContexts& GetZstdContexts()
+{
+  static thread_local ZstdContexts contexts;
+  return contexts;
+}
+
+size_t Compressor::MaxCompressedSize(uint8_t type, size_t len)
+{
+  if (len > kMaxRawBodySize) return 0;
+  switch (type) {
+  case kLz4:
+    return LZ4_compressBound(static_cast<int>(len));
+  case kZstd:
+    return ZSTD_compressBound(len);
+  default:
+    return 0;
+  }
+}
+
+size_t Compressor::Compress(uint8_t type, const char* src, size_t len,
+                            char* dst, size_t dst_cap)
+{
+  if (len > kMaxRawBodySize) return 0;
+  switch (type) {
+  case kLz4: {
+    int ret = LZ4_compress_default(src, dst, static_cast<int>(len),
+                                   static_cast<int>(dst_cap));
+    return ret > 0 ? ret : 0;
+  }
+  case kZstd: {
+    size_t ret = ZSTD_compressCCtx(GetZstdContexts().cctx, dst, dst_cap,
+                                   src, len, kZstdCompressLevel);
+    return ZSTD_isError(ret) ? 0 : ret;
+  }
+  default:
+    return 0;
+  }
+}
+
+size_t Compressor::MaxDecompressedSize(uint8_t type, size_t len)
+{
+  switch (type) {
+  case kLz4:
+    return len * kLz4MaxRatio;
+  case kZstd:
+    return len * kZstdMaxRatio;
+  default:
+    return 0;
+  }
+}
+
+bool Compressor::Decompress(uint8_t type, const char* src, size_t len,
+                            char* dst, size_t raw_len)
+{
+  if (raw_len > kMaxRawBodySize) return false;
+  switch (type) {
+  case kLz4: {
+    int ret = LZ4_decompress_safe(src, dst, static_cast<int>(len),
+                                  static_cast<int>(raw_len));
+    return ret >= 0 && static_cast<size_t>(ret) == raw_len;
+  }
+  case kZstd: {
+    size_t ret = ZSTD_decompressDCtx(GetZstdContexts().dctx, dst, raw_len,
+                                     src, len);
+    return !ZSTD_isError(ret) && ret == raw_len;
+  }
+  default:
+    return false;
+  }
+}
+
+} // namespace hrpc
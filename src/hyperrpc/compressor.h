@@ -0,0 +1,59 @@
+/* Copyright (c) 2016, Bin Wei <bin@vip.qq.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of of its contributors may not be used to endorse or 
+ * promote products derived from this software without specific prior 
+ * written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _HRPC_COMPRESSOR_H
+#define _HRPC_COMPRESSOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace hrpc {
+
+/* Stateless wrapper of compression libraries, type is value of CompressType
+ */
+class Compressor
+{
+public:
+  // return 0 if type is not supported
+  static size_t MaxCompressedSize(uint8_t type, size_t len);
+  // return size compressed into dst, or 0 if failed
+  static size_t Compress(uint8_t type, const char* src, size_t len,
+                         char* dst, size_t dst_cap);
+  // upper bound of bytes decompressed from len bytes by the format of
+  // type, or 0 if type is not supported
+  static size_t MaxDecompressedSize(uint8_t type, size_t len);
+  // succeed only if exactly raw_len bytes are decompressed into dst
+  static bool Decompress(uint8_t type, const char* src, size_t len,
+                         char* dst, size_t raw_len);
+};
+
+} // namespace hrpc
+
+#endif // _HRPC_COMPRESSOR_H
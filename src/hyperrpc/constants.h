@@ -35,10 +35,35 @@
 namespace hrpc {
 
 static constexpr uint8_t kHyperRpcPacketTag = 'R';
-static constexpr uint8_t kHyperRpcPacketVer = 1;
+// versions accepted, and the one sent by default which is understood by
+// peers not upgraded
+static constexpr uint8_t kHyperRpcPacketVer = 2;
+static constexpr uint8_t kHyperRpcMinPacketVer = 1;
+static constexpr uint8_t kDefaultPacketVer = 1;
 static constexpr size_t kArenaInitBufSize = 1024;
 static constexpr size_t kRpcIdSeqPartBits = 48;
 static constexpr int kMaxResultValue = kInError;
+// limit of decompressed body size against malicious packets
+static constexpr size_t kMaxRawBodySize = 64 * 1024 * 1024;
+// scratch buffer of decompression grown above this is freed after the
+// message, so that a large message does not pin its memory
+static constexpr size_t kMaxKeptDecompressBufSize = 64 * 1024;
+// limit of datagrams built, below max UDP payload
+static constexpr size_t kMaxDatagramSize = 65000;
+// so that messages of kMaxRawBodySize are within 65535 fragments
+static constexpr size_t kMinFragmentSize = 1024;
+// limits of IncomingRpcContext kept for reuse per method, contexts having
+// served large messages are freed to not pin their memory
+static constexpr size_t kMaxFreeContexts = 256;
+static constexpr size_t kMaxReusedMessageSize = 64 * 1024;
+// initial Arena block of a method is sized by this percentile of space
+// used, plus reserve for bookkeeping of the Arena kept in the block
+static constexpr size_t kArenaBlockPercentile = 99;
+static constexpr size_t kArenaBlockReserve = 256;
+// space used by so many RPCs are observed before the block is resized
+static constexpr size_t kMinArenaSamples = 64;
+// the percentile is taken again every so many RPCs, as it takes a scan
+static constexpr size_t kArenaRefreshSamples = 64;
 
 } // namespace hrpc
 
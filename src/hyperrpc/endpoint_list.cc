@@ -37,7 +37,7 @@ constexpr size_t EndpointList::kListCacheSize;
 constexpr size_t EndpointList::kListInHeapInitSize;
 
 EndpointList::EndpointList()
-  : size_(0), list_in_heap_(nullptr)
+  : size_(0), list_in_heap_(nullptr), heap_capacity_(0)
 {
 }
 
@@ -47,7 +47,7 @@ EndpointList::~EndpointList()
 }
 
 EndpointList::EndpointList(const EndpointList& other)
-  : size_(0), list_in_heap_(nullptr)
+  : size_(0), list_in_heap_(nullptr), heap_capacity_(0)
 {
   for (size_t i = 0; i < other.size_ && i < kListCacheSize; i++) {
     list_cache_[i] = other.list_cache_[i];
@@ -60,6 +60,7 @@ EndpointList::EndpointList(const EndpointList& other)
       capacity <<= 1UL;
     }
     list_in_heap_ = new Endpoint[capacity];
+    heap_capacity_ = capacity;
     memcpy(list_in_heap_, other.list_in_heap_,
            sizeof(Endpoint) * list_in_heap_size);
   }
@@ -80,6 +81,8 @@ EndpointList::EndpointList(EndpointList&& other)
   }
   list_in_heap_ = other.list_in_heap_;
   other.list_in_heap_ = nullptr;
+  heap_capacity_ = other.heap_capacity_;
+  other.heap_capacity_ = 0;
   size_ = other.size_;
   other.size_ = 0;
 }
@@ -102,14 +105,15 @@ void EndpointList::PushBack(const Addr& endpoint)
   }
   // append list_in_heap_
   size_t list_in_heap_size = size_ - kListCacheSize;
-  if (list_in_heap_size == 0) {
+  if (heap_capacity_ == 0) {
     // initialize list_in_heap_
     list_in_heap_ = new Endpoint[kListInHeapInitSize];
-  } else if (list_in_heap_size >= kListInHeapInitSize &&
-             (list_in_heap_size & (list_in_heap_size - 1)) == 0) {
+    heap_capacity_ = kListInHeapInitSize;
+  } else if (list_in_heap_size == heap_capacity_) {
     // reallocate to double size
     auto list_in_heap_old = list_in_heap_;
-    list_in_heap_ = new Endpoint[list_in_heap_size << 1];
+    list_in_heap_ = new Endpoint[heap_capacity_ << 1];
+    heap_capacity_ <<= 1;
     memcpy(list_in_heap_, list_in_heap_old,
            sizeof(Endpoint) * list_in_heap_size);
     delete[] list_in_heap_old;
@@ -126,6 +130,12 @@ void EndpointList::Clear()
     delete[] list_in_heap_;
     list_in_heap_ = nullptr;
   }
+  heap_capacity_ = 0;
+  size_ = 0;
+}
+
+void EndpointList::Reset()
+{
   size_ = 0;
 }
 
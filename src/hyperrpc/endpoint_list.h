@@ -47,6 +47,8 @@ public:
 
   void PushBack(const Addr& endpoint);
   void Clear();
+  // like Clear() but keeps memory for endpoints pushed later
+  void Reset();
   Addr GetEndpoint(size_t index) const;
 
   size_t size() const {
@@ -67,6 +69,7 @@ private:
   size_t size_;
   Endpoint list_cache_[kListCacheSize];
   Endpoint* list_in_heap_;
+  size_t heap_capacity_;
 };
 
 } // namespace hrpc
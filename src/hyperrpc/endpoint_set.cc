@@ -0,0 +1,202 @@
+/* Copyright (c) 2016, Bin Wei <bin@vip.qq.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of of its contributors may not be used to endorse or 
+ * promote products derived from this software without specific prior 
+ * written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <algorithm>
+#include "hyperrpc/endpoint_set.h"
+#include "hyperrpc/endpoint_list.h"
+#include "hyperrpc/hash_routing.h"
+
+namespace hrpc {
+
+EndpointSet::EndpointSet(const EndpointList& list, EndpointSetTable* owner)
+  : refs_(0), epoch_(0), rr_cursor_(0), owner_(owner), maglev_(nullptr)
+{
+  endpoints_.reserve(list.size());
+  for (size_t i = 0; i < list.size(); i++) {
+    Addr addr = list.GetEndpoint(i);
+    endpoints_.push_back({addr.ip(), addr.port()});
+  }
+}
+
+EndpointSet::~EndpointSet()
+{
+}
+
+size_t EndpointSet::HashLookup(uint64_t hash)
+{
+  return maglev_index_[maglev().Lookup(hash)];
+}
+
+const MaglevTable& EndpointSet::maglev()
+{
+  if (!maglev_) {
+    // ranks of endpoints in the order of keys, and duplicated endpoints
+    // are in the order of the set which makes no difference
+    std::vector<std::pair<uint64_t, uint16_t>> ranks(endpoints_.size());
+    for (size_t i = 0; i < endpoints_.size(); i++) {
+      ranks[i] = {MaglevTable::Key(GetEndpoint(i)),
+                  static_cast<uint16_t>(i)};
+    }
+    std::sort(ranks.begin(), ranks.end());
+    std::vector<uint64_t> keys(ranks.size());
+    maglev_index_.resize(ranks.size());
+    for (size_t i = 0; i < ranks.size(); i++) {
+      keys[i] = ranks[i].first;
+      maglev_index_[i] = ranks[i].second;
+    }
+    maglev_ = owner_->InternMaglev(keys);
+  }
+  return *maglev_;
+}
+
+bool EndpointSet::Equals(const EndpointList& list) const
+{
+  if (list.size() != endpoints_.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < endpoints_.size(); i++) {
+    Addr addr = list.GetEndpoint(i);
+    if (addr.ip() != endpoints_[i].ip || addr.port() != endpoints_[i].port) {
+      return false;
+    }
+  }
+  return true;
+}
+
+EndpointSetTable::EndpointSetTable()
+  : epoch_(0)
+{
+}
+
+EndpointSetTable::~EndpointSetTable()
+{
+  for (auto& entry : sets_) {
+    delete entry.second;
+  }
+  for (auto& entry : maglevs_) {
+    delete entry.second;
+  }
+}
+
+uint64_t EndpointSetTable::Hash(const EndpointList& list)
+{
+  // FNV-1a over ip and port of each endpoint
+  uint64_t hash = 14695981039346656037UL;
+  for (size_t i = 0; i < list.size(); i++) {
+    Addr addr = list.GetEndpoint(i);
+    hash = (hash ^ addr.ip()) * 1099511628211UL;
+    hash = (hash ^ addr.port()) * 1099511628211UL;
+  }
+  return hash;
+}
+
+uint64_t EndpointSetTable::Hash(const std::vector<uint64_t>& keys)
+{
+  // FNV-1a over keys
+  uint64_t hash = 14695981039346656037UL;
+  for (uint64_t key : keys) {
+    hash = (hash ^ key) * 1099511628211UL;
+  }
+  return hash;
+}
+
+EndpointSet* EndpointSetTable::Intern(const EndpointList& list)
+{
+  uint64_t hash = Hash(list);
+  auto range = sets_.equal_range(hash);
+  EndpointSet* set = nullptr;
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second->Equals(list)) {
+      set = it->second;
+      break;
+    }
+  }
+  if (!set) {
+    set = new EndpointSet(list, this);
+    sets_.emplace(hash, set);
+  }
+  set->epoch_ = epoch_;
+  set->AddRef();
+  return set;
+}
+
+MaglevTable* EndpointSetTable::InternMaglev(
+                                  const std::vector<uint64_t>& keys)
+{
+  uint64_t hash = Hash(keys);
+  auto range = maglevs_.equal_range(hash);
+  MaglevTable* maglev = nullptr;
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second->keys() == keys) {
+      maglev = it->second;
+      break;
+    }
+  }
+  if (!maglev) {
+    maglev = new MaglevTable(keys);
+    maglevs_.emplace(hash, maglev);
+  }
+  maglev->AddRef();
+  return maglev;
+}
+
+void EndpointSetTable::FreeSet(EndpointSet* set)
+{
+  MaglevTable* maglev = set->maglev_;
+  delete set;
+  if (!maglev) {
+    return;
+  }
+  maglev->Release();
+  if (maglev->refs() == 0) {
+    auto range = maglevs_.equal_range(Hash(maglev->keys()));
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second == maglev) {
+        maglevs_.erase(it);
+        break;
+      }
+    }
+    delete maglev;
+  }
+}
+
+void EndpointSetTable::Sweep()
+{
+  for (auto it = sets_.begin(); it != sets_.end(); ) {
+    if (it->second->refs() == 0 && it->second->epoch_ < epoch_) {
+      FreeSet(it->second);
+      it = sets_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  epoch_++;
+}
+
+} // namespace hrpc
@@ -0,0 +1,149 @@
+/* Copyright (c) 2016, Bin Wei <bin@vip.qq.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of of its contributors may not be used to endorse or 
+ * promote products derived from this software without specific prior 
+ * written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _HRPC_ENDPOINT_SET_H
+#define _HRPC_ENDPOINT_SET_H
+
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+#include "hyperrpc/hyperrpc.h"
+
+namespace hrpc {
+
+class EndpointList;
+class EndpointSetTable;
+class MaglevTable;
+
+/* Immutable list of endpoints shared by sessions routed the same
+ *
+ * Sets are interned by EndpointSetTable of a worker thread, and referenced
+ * by its sessions without atomics. Only the round-robin cursor and the
+ * lookup table attached on demand change.
+ */
+class EndpointSet
+{
+public:
+  Addr GetEndpoint(size_t index) const {
+    return {endpoints_[index].ip, endpoints_[index].port};
+  }
+  size_t size() const {
+    return endpoints_.size();
+  }
+  // index of the next endpoint in turn among sessions of the set
+  size_t NextRoundRobin() {
+    return rr_cursor_++ % endpoints_.size();
+  }
+  // index of the endpoint of @hash by consistent hashing
+  size_t HashLookup(uint64_t hash);
+  // table of consistent hashing shared by sets of the same endpoints,
+  // which is attached on the first call
+  const MaglevTable& maglev();
+
+  void AddRef() {
+    refs_++;
+  }
+  void Release() {
+    refs_--;
+  }
+  size_t refs() const {
+    return refs_;
+  }
+
+private:
+  friend class EndpointSetTable;
+
+  struct Endpoint {
+    uint32_t ip;
+    uint16_t port;
+  };
+
+  EndpointSet(const EndpointList& list, EndpointSetTable* owner);
+  ~EndpointSet();
+  // not copyable and movable
+  EndpointSet(const EndpointSet&) = delete;
+  void operator=(const EndpointSet&) = delete;
+  EndpointSet(EndpointSet&&) = delete;
+  void operator=(EndpointSet&&) = delete;
+
+  bool Equals(const EndpointList& list) const;
+
+  std::vector<Endpoint> endpoints_;
+  size_t refs_;
+  uint64_t epoch_; // of the last time it is interned
+  size_t rr_cursor_;
+  EndpointSetTable* owner_;
+  MaglevTable* maglev_; // referenced, nullptr until attached
+  std::vector<uint16_t> maglev_index_; // endpoint index of each rank
+};
+
+/* Per worker thread table of EndpointSet
+ *
+ * Sets no longer referenced are kept for the same routes resolved again,
+ * and freed by Sweep() if they are not interned since the last sweep.
+ * Maglev tables are interned by the sorted endpoints, and freed with the
+ * last set referencing them.
+ */
+class EndpointSetTable
+{
+public:
+  EndpointSetTable();
+  ~EndpointSetTable();
+
+  // the set returned is referenced once for the caller
+  EndpointSet* Intern(const EndpointList& list);
+  void Sweep();
+
+  size_t size() const {
+    return sets_.size();
+  }
+
+private:
+  // not copyable and movable
+  EndpointSetTable(const EndpointSetTable&) = delete;
+  void operator=(const EndpointSetTable&) = delete;
+  EndpointSetTable(EndpointSetTable&&) = delete;
+  void operator=(EndpointSetTable&&) = delete;
+
+  friend class EndpointSet;
+
+  static uint64_t Hash(const EndpointList& list);
+  static uint64_t Hash(const std::vector<uint64_t>& keys);
+  // the table returned is referenced once for the caller
+  MaglevTable* InternMaglev(const std::vector<uint64_t>& keys);
+  void FreeSet(EndpointSet* set);
+
+  std::unordered_multimap<uint64_t, EndpointSet*> sets_;
+  std::unordered_multimap<uint64_t, MaglevTable*> maglevs_;
+  uint64_t epoch_;
+};
+
+} // namespace hrpc
+
+#endif // _HRPC_ENDPOINT_SET_H
@@ -33,6 +33,7 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <time.h>
 #include <ccbase/worker_group.h>
 #include <hyperudp/addr.h>
 #include <hyperudp/buf.h>
@@ -93,6 +94,13 @@ public:
     return hrpc_opt_;
   }
 
+  // milliseconds of monotonic clock, which is the base of RPC deadlines
+  static uint64_t NowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+  }
+
 private:
   Options hrpc_opt_;
 };
@@ -0,0 +1,163 @@
+/* Copyright (c) 2016, Bin Wei <bin@vip.qq.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of of its contributors may not be used to endorse or 
+ * promote products derived from this software without specific prior 
+ * written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include "hyperrpc/fragment_assembler.h"
+#include "hyperrpc/protocol.h"
+
+namespace hrpc {
+
+FragmentAssembler::FragmentAssembler(const Env& env)
+  : env_(env)
+  , pending_bytes_(0)
+{
+}
+
+FragmentAssembler::~FragmentAssembler()
+{
+  for (auto& kv : messages_) {
+    env_.alloc().Free(kv.second.buf, kv.second.total_len);
+  }
+}
+
+bool FragmentAssembler::Init()
+{
+  // a message is dropped by the second sweep after its first fragment, so
+  // it lives for 1x ~ 2x of the reassembly timeout
+  return env_.timerw()->AddPeriodTimer(
+              env_.opt().reassembly_timeout,
+              ccb::BindClosure(this, &FragmentAssembler::OnSweep),
+              &sweep_timer_owner_);
+}
+
+// return the fragment size of the sender, or 0 if the fragment is not at
+// the place given by its index in a message of total_body_len
+static size_t FragmentSize(const RpcMeta& meta, size_t len)
+{
+  // all fragments but the last are of the fragment size
+  uint64_t last_index = meta.frag_count - 1;
+  uint64_t frag_size = len;
+  if (meta.frag_index == last_index) {
+    if (meta.frag_offset % last_index != 0 ||
+        meta.frag_offset + len != meta.total_body_len) {
+      return 0;
+    }
+    frag_size = meta.frag_offset / last_index;
+  }
+  if (frag_size == 0 || meta.frag_offset != meta.frag_index * frag_size ||
+      last_index * frag_size >= meta.total_body_len ||
+      meta.total_body_len > meta.frag_count * frag_size) {
+    return 0;
+  }
+  return frag_size;
+}
+
+bool FragmentAssembler::Add(const RpcMeta& meta, const Addr& addr,
+                            const Buf& fragment, Buf* message)
+{
+  if (meta.frag_count < 2 || meta.frag_index >= meta.frag_count ||
+      meta.total_body_len > kMaxRawBodySize) {
+    DLOG("bad fragment of rpc_id:%lu", meta.rpc_id);
+    return false;
+  }
+  size_t frag_size = FragmentSize(meta, fragment.len());
+  if (frag_size == 0) {
+    DLOG("misplaced fragment of rpc_id:%lu", meta.rpc_id);
+    return false;
+  }
+  MessageKey key{meta.rpc_id,
+                 (static_cast<uint64_t>(addr.ip()) << 32)
+                 | (static_cast<uint64_t>(addr.port()) << 16)
+                 | meta.packet_type};
+  auto it = messages_.find(key);
+  if (it == messages_.end()) {
+    if (pending_bytes_ + meta.total_body_len >
+        env_.opt().max_reassembly_bytes) {
+      WLOG("fragment of rpc_id:%lu dropped for reassembly memory limit",
+           meta.rpc_id);
+      return false;
+    }
+    Message msg;
+    msg.buf = static_cast<char*>(env_.alloc().Alloc(meta.total_body_len));
+    msg.total_len = meta.total_body_len;
+    msg.frag_count = meta.frag_count;
+    msg.frag_size = frag_size;
+    msg.recv_count = 0;
+    msg.is_stale = false;
+    msg.recv_bitmap.assign((meta.frag_count + 63) / 64, 0);
+    it = messages_.emplace(key, std::move(msg)).first;
+    pending_bytes_ += meta.total_body_len;
+  }
+  Message& msg = it->second;
+  if (msg.total_len != meta.total_body_len ||
+      msg.frag_count != meta.frag_count || msg.frag_size != frag_size) {
+    DLOG("inconsistent fragment of rpc_id:%lu", meta.rpc_id);
+    return false;
+  }
+  uint64_t bit = 1UL << (meta.frag_index % 64);
+  if (msg.recv_bitmap[meta.frag_index / 64] & bit) {
+    // duplicated
+    return false;
+  }
+  msg.recv_bitmap[meta.frag_index / 64] |= bit;
+  memcpy(msg.buf + meta.frag_offset, fragment.ptr(), fragment.len());
+  if (++msg.recv_count < msg.frag_count) {
+    return false;
+  }
+  // completed, the buffer is handed over to the caller
+  *message = Buf(msg.buf, msg.total_len);
+  pending_bytes_ -= msg.total_len;
+  messages_.erase(it);
+  return true;
+}
+
+void FragmentAssembler::FreeMessage(const Buf& message)
+{
+  env_.alloc().Free(const_cast<void*>(message.ptr()), message.len());
+}
+
+void FragmentAssembler::OnSweep()
+{
+  for (auto it = messages_.begin(); it != messages_.end(); ) {
+    Message& msg = it->second;
+    if (!msg.is_stale) {
+      msg.is_stale = true;
+      ++it;
+      continue;
+    }
+    DLOG("reassembly timeout with %u/%u fragments received",
+         msg.recv_count, msg.frag_count);
+    env_.alloc().Free(msg.buf, msg.total_len);
+    pending_bytes_ -= msg.total_len;
+    it = messages_.erase(it);
+  }
+}
+
+} // namespace hrpc
@@ -0,0 +1,110 @@
+/* Copyright (c) 2016, Bin Wei <bin@vip.qq.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of of its contributors may not be used to endorse or 
+ * promote products derived from this software without specific prior 
+ * written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _HRPC_FRAGMENT_ASSEMBLER_H
+#define _HRPC_FRAGMENT_ASSEMBLER_H
+
+#include <unordered_map>
+#include <vector>
+#include <ccbase/timer_wheel.h>
+#include "hyperrpc/env.h"
+#include "hyperrpc/rpc_header_codec.h"
+
+namespace hrpc {
+
+/* Reassembles fragmented messages received by a rpc_core
+ *
+ * Each message is identified by (peer address, rpc_id, packet type) and is
+ * assembled in a buffer allocated from Env::alloc(). Messages not completed
+ * within the reassembly timeout are dropped by a periodic sweep, and new
+ * messages are refused while the bytes pending exceed the memory cap.
+ * Fragments must be placed by their index, in the fragment size of the
+ * sender which is told by the first fragment received.
+ */
+class FragmentAssembler
+{
+public:
+  FragmentAssembler(const Env& env);
+  ~FragmentAssembler();
+
+  bool Init();
+  // return true when the message is completed by the fragment, which is
+  // set to @message and must be freed by FreeMessage()
+  bool Add(const RpcMeta& meta, const Addr& addr, const Buf& fragment,
+           Buf* message);
+  void FreeMessage(const Buf& message);
+
+  size_t pending_messages() const {
+    return messages_.size();
+  }
+  size_t pending_bytes() const {
+    return pending_bytes_;
+  }
+
+private:
+  struct MessageKey {
+    uint64_t rpc_id;
+    uint64_t addr_and_type;
+    bool operator==(const MessageKey& other) const {
+      return rpc_id == other.rpc_id && addr_and_type == other.addr_and_type;
+    }
+  };
+  struct MessageKeyHash {
+    size_t operator()(const MessageKey& key) const {
+      return (key.rpc_id ^ key.addr_and_type) * 0x9E3779B97F4A7C15UL;
+    }
+  };
+  struct Message {
+    char* buf;
+    uint32_t total_len;
+    uint16_t frag_count;
+    uint16_t recv_count;
+    uint32_t frag_size;
+    bool is_stale; // seen by the last sweep
+    std::vector<uint64_t> recv_bitmap;
+  };
+
+  void OnSweep();
+
+  // not copyable and movable
+  FragmentAssembler(const FragmentAssembler&) = delete;
+  void operator=(const FragmentAssembler&) = delete;
+  FragmentAssembler(FragmentAssembler&&) = delete;
+  void operator=(FragmentAssembler&&) = delete;
+
+  const Env& env_;
+  std::unordered_map<MessageKey, Message, MessageKeyHash> messages_;
+  size_t pending_bytes_;
+  ccb::TimerOwner sweep_timer_owner_;
+};
+
+} // namespace hrpc
+
+#endif // _HRPC_FRAGMENT_ASSEMBLER_H
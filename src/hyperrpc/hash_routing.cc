@@ -0,0 +1,159 @@
+/* Copyright (c) 2016, Bin Wei <bin@vip.qq.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of of its contributors may not be used to endorse or 
+ * promote products derived from this software without specific prior 
+ * written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+#include "hyperrpc/hash_routing.h"
+
+namespace hrpc {
+
+// finalizer of SplitMix64, spreading keys of few bits over all bits
+static inline uint64_t Mix64(uint64_t x)
+{
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9UL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebUL;
+  return x ^ (x >> 31);
+}
+
+MaglevTable::MaglevTable(const std::vector<uint64_t>& keys)
+  : keys_(keys), refs_(0)
+{
+  size_t endpoint_num = keys.size();
+  const size_t size = (endpoint_num <= kSmallTableEndpoints ?
+                       kSmallTableSize : kLargeTableSize);
+  // each endpoint fills slots in its own permutation of the table, in
+  // the order of keys so that the same endpoints own the same slots
+  std::vector<uint64_t> offsets(endpoint_num);
+  std::vector<uint64_t> skips(endpoint_num);
+  std::vector<uint64_t> next(endpoint_num, 0);
+  for (size_t i = 0; i < endpoint_num; i++) {
+    uint64_t hash = Mix64(keys[i]);
+    offsets[i] = hash % size;
+    skips[i] = Mix64(hash) % (size - 1) + 1;
+  }
+  table_.assign(size, 0);
+  std::vector<bool> taken(size, false);
+  size_t filled = 0;
+  while (endpoint_num > 0 && filled < size) {
+    for (size_t i = 0; i < endpoint_num && filled < size; i++) {
+      size_t slot;
+      do {
+        slot = (offsets[i] + next[i]++ * skips[i]) % size;
+      } while (taken[slot]);
+      taken[slot] = true;
+      table_[slot] = static_cast<uint16_t>(i);
+      filled++;
+    }
+  }
+}
+
+MaglevTable::~MaglevTable()
+{
+}
+
+bool RequestKey::Resolve(
+     const google::protobuf::Descriptor* type,
+     const std::string& path,
+     std::vector<const google::protobuf::FieldDescriptor*>* fields)
+{
+  using google::protobuf::FieldDescriptor;
+  fields->clear();
+  size_t begin = 0;
+  while (type) {
+    size_t end = path.find('.', begin);
+    const FieldDescriptor* field = type->FindFieldByName(
+                                   path.substr(begin, end - begin));
+    if (!field || field->is_repeated()) {
+      break;
+    }
+    fields->push_back(field);
+    if (end == std::string::npos) {
+      switch (field->cpp_type()) {
+      case FieldDescriptor::CPPTYPE_INT32:
+      case FieldDescriptor::CPPTYPE_INT64:
+      case FieldDescriptor::CPPTYPE_UINT32:
+      case FieldDescriptor::CPPTYPE_UINT64:
+      case FieldDescriptor::CPPTYPE_BOOL:
+      case FieldDescriptor::CPPTYPE_ENUM:
+      case FieldDescriptor::CPPTYPE_STRING:
+        return true;
+      default:
+        break;
+      }
+      break;
+    }
+    type = field->message_type();
+    begin = end + 1;
+  }
+  fields->clear();
+  return false;
+}
+
+uint64_t RequestKey::Hash(
+         const std::vector<const google::protobuf::FieldDescriptor*>& fields,
+         const google::protobuf::Message& request)
+{
+  using google::protobuf::FieldDescriptor;
+  // messages not set are read as default instances
+  const google::protobuf::Message* msg = &request;
+  for (size_t i = 0; i + 1 < fields.size(); i++) {
+    msg = &msg->GetReflection()->GetMessage(*msg, fields[i]);
+  }
+  const FieldDescriptor* field = fields.back();
+  const google::protobuf::Reflection* reflection = msg->GetReflection();
+  switch (field->cpp_type()) {
+  case FieldDescriptor::CPPTYPE_INT32:
+    return Mix64(reflection->GetInt32(*msg, field));
+  case FieldDescriptor::CPPTYPE_INT64:
+    return Mix64(reflection->GetInt64(*msg, field));
+  case FieldDescriptor::CPPTYPE_UINT32:
+    return Mix64(reflection->GetUInt32(*msg, field));
+  case FieldDescriptor::CPPTYPE_UINT64:
+    return Mix64(reflection->GetUInt64(*msg, field));
+  case FieldDescriptor::CPPTYPE_BOOL:
+    return Mix64(reflection->GetBool(*msg, field));
+  case FieldDescriptor::CPPTYPE_ENUM:
+    return Mix64(reflection->GetEnumValue(*msg, field));
+  case FieldDescriptor::CPPTYPE_STRING: {
+    std::string scratch;
+    const std::string& value = reflection->GetStringReference(*msg, field,
+                                                              &scratch);
+    // FNV-1a
+    uint64_t hash = 14695981039346656037UL;
+    for (unsigned char c : value) {
+      hash = (hash ^ c) * 1099511628211UL;
+    }
+    return Mix64(hash);
+  }
+  default:
+    return 0;
+  }
+}
+
+} // namespace hrpc
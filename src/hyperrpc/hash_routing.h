@@ -0,0 +1,128 @@
+/* Copyright (c) 2016, Bin Wei <bin@vip.qq.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of of its contributors may not be used to endorse or 
+ * promote products derived from this software without specific prior 
+ * written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _HRPC_HASH_ROUTING_H
+#define _HRPC_HASH_ROUTING_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "hyperrpc/hyperrpc.h"
+
+namespace google {
+namespace protobuf {
+  class Descriptor;
+  class FieldDescriptor;
+} // namespace protobuf
+} // namespace google
+
+namespace hrpc {
+
+/* Maglev lookup table mapping hashes of keys to endpoints
+ *
+ * The table is a function of ip:port of the endpoints regardless of their
+ * order, so that callers with the same endpoints map a key to the same
+ * one, and most keys keep their endpoints when one is added or removed.
+ * It is shared by EndpointSet of the same endpoints in any order. The
+ * table size is one prime up to kSmallTableEndpoints endpoints and another
+ * one above, since keys are remapped mostly when the size changes.
+ */
+class MaglevTable
+{
+public:
+  // @keys of endpoints in ascending order, see Key()
+  explicit MaglevTable(const std::vector<uint64_t>& keys);
+  ~MaglevTable();
+
+  static uint64_t Key(const Addr& addr) {
+    return (static_cast<uint64_t>(addr.ip()) << 16) | addr.port();
+  }
+
+  // rank in keys() of the endpoint of @hash
+  size_t Lookup(uint64_t hash) const {
+    return table_[hash % table_.size()];
+  }
+  size_t size() const {
+    return table_.size();
+  }
+  const std::vector<uint64_t>& keys() const {
+    return keys_;
+  }
+
+  void AddRef() {
+    refs_++;
+  }
+  void Release() {
+    refs_--;
+  }
+  size_t refs() const {
+    return refs_;
+  }
+
+private:
+  static constexpr size_t kSmallTableEndpoints = 64;
+  // prime of about 128 slots per endpoint up to kSmallTableEndpoints
+  static constexpr size_t kSmallTableSize = 8191;
+  // prime above 64 slots per endpoint up to 2048 endpoints, and still
+  // above the max 65536 endpoints of EndpointList
+  static constexpr size_t kLargeTableSize = 131071;
+
+  // not copyable and movable
+  MaglevTable(const MaglevTable&) = delete;
+  void operator=(const MaglevTable&) = delete;
+  MaglevTable(MaglevTable&&) = delete;
+  void operator=(MaglevTable&&) = delete;
+
+  std::vector<uint64_t> keys_;
+  size_t refs_;
+  // ranks of endpoints, below 65536
+  std::vector<uint16_t> table_;
+};
+
+/* Key of a request given by path of singular fields, e.g. "user.id"
+ *
+ * The last field must be an integer, bool, enum or string, and others
+ * must be messages.
+ */
+class RequestKey
+{
+public:
+  // return false if @path is not a valid key of @type
+  static bool Resolve(const google::protobuf::Descriptor* type,
+                      const std::string& path,
+                      std::vector<const google::protobuf::FieldDescriptor*>*
+                          fields);
+  static uint64_t Hash(
+      const std::vector<const google::protobuf::FieldDescriptor*>& fields,
+      const google::protobuf::Message& request);
+};
+
+} // namespace hrpc
+
+#endif // _HRPC_HASH_ROUTING_H
@@ -0,0 +1,106 @@
+/* Copyright (c) 2016, Bin Wei <bin@vip.qq.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of of its contributors may not be used to endorse or 
+ * promote products derived from this software without specific prior 
+ * written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <string.h>
+#include "hyperrpc/histogram.h"
+
+namespace hrpc {
+
+Histogram::Histogram(size_t decay_window)
+  : decay_window_(decay_window)
+  , count_(0)
+{
+  memset(buckets_, 0, sizeof(buckets_));
+}
+
+Histogram::~Histogram()
+{
+}
+
+size_t Histogram::BucketIndex(uint64_t value)
+{
+  constexpr uint64_t sub_bucket_num = 1UL << kSubBucketBits;
+  if (value < sub_bucket_num) {
+    return value;
+  }
+  // highest bit selects the range and the next bits the sub-bucket
+  size_t msb = 63 - __builtin_clzl(value);
+  size_t shift = msb - kSubBucketBits;
+  return ((shift + 1) << kSubBucketBits) +
+         ((value >> shift) & (sub_bucket_num - 1));
+}
+
+uint64_t Histogram::BucketUpperBound(size_t index)
+{
+  constexpr uint64_t sub_bucket_num = 1UL << kSubBucketBits;
+  if (index < sub_bucket_num) {
+    return index;
+  }
+  size_t shift = (index >> kSubBucketBits) - 1;
+  uint64_t sub = index & (sub_bucket_num - 1);
+  return ((sub_bucket_num + sub + 1) << shift) - 1;
+}
+
+void Histogram::Add(uint64_t value)
+{
+  buckets_[BucketIndex(value)]++;
+  if (++count_ >= decay_window_) {
+    Decay();
+  }
+}
+
+uint64_t Histogram::Percentile(double percent) const
+{
+  if (count_ == 0) {
+    return 0;
+  }
+  size_t rank = static_cast<size_t>(count_ * percent / 100);
+  if (rank >= count_) {
+    rank = count_ - 1;
+  }
+  size_t sum = 0;
+  for (size_t i = 0; i < kBucketNum; i++) {
+    sum += buckets_[i];
+    if (sum > rank) {
+      return BucketUpperBound(i);
+    }
+  }
+  return BucketUpperBound(kBucketNum - 1);
+}
+
+void Histogram::Decay()
+{
+  count_ = 0;
+  for (size_t i = 0; i < kBucketNum; i++) {
+    buckets_[i] >>= 1;
+    count_ += buckets_[i];
+  }
+}
+
+} // namespace hrpc
@@ -0,0 +1,77 @@
+/* Copyright (c) 2016, Bin Wei <bin@vip.qq.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of of its contributors may not be used to endorse or 
+ * promote products derived from this software without specific prior 
+ * written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _HRPC_HISTOGRAM_H
+#define _HRPC_HISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace hrpc {
+
+/* Log-linear histogram of non-negative values, e.g. latency in ms
+ *
+ * Each power of 2 range is split into 4 buckets, so percentiles are within
+ * 25% of the real values. Counts are halved once they sum up to the decay
+ * window, so that recent values weigh more.
+ */
+class Histogram
+{
+public:
+  Histogram() : Histogram(kDefaultDecayWindow) {}
+  explicit Histogram(size_t decay_window);
+  ~Histogram();
+
+  void Add(uint64_t value);
+  // upper bound of the bucket holding the @percent percentile, 0 if empty
+  uint64_t Percentile(double percent) const;
+
+  // number of values weighed after decayed
+  size_t count() const {
+    return count_;
+  }
+
+private:
+  static constexpr size_t kDefaultDecayWindow = 4096;
+  static constexpr size_t kSubBucketBits = 2;
+  static constexpr size_t kBucketNum = (64 - kSubBucketBits + 1)
+                                       << kSubBucketBits;
+
+  static size_t BucketIndex(uint64_t value);
+  static uint64_t BucketUpperBound(size_t index);
+  void Decay();
+
+  size_t decay_window_;
+  size_t count_;
+  uint32_t buckets_[kBucketNum];
+};
+
+} // namespace hrpc
+
+#endif // _HRPC_HISTOGRAM_H
@@ -1,9 +1,10 @@
-#include <unordered_map>
+#include <future>
 #include <google/protobuf/descriptor.h>
 #include <ccbase/eventfd.h>
 #include "hyperrpc/hyperrpc.h"
 #include "hyperrpc/env.h"
 #include "hyperrpc/service.h"
+#include "hyperrpc/method_table.h"
 #include "hyperrpc/rpc_core.h"
 
 namespace hrpc {
@@ -14,16 +15,30 @@ public:
   Impl(const Options& opt);
   ~Impl();
 
-  bool InitAsClient(OnServiceRouting& on_svc_routing);
+  bool InitAsClient(OnServiceRouting& on_svc_routing,
+                    OnRouteKey& on_route_key);
   bool InitAsServer(std::vector<Service*>& services);
   bool Start(const Addr& bind_local_addr);
 
   Result CallMethod(const ::google::protobuf::MethodDescriptor* method,
                     const ::google::protobuf::Message* request,
                     ::google::protobuf::Message* response,
+                    const CallOptions& call_opts,
                     DoneFunc done);
+  Result FanOutCall(
+              const ::google::protobuf::MethodDescriptor* method,
+              const std::vector<const ::google::protobuf::Message*>& requests,
+              const std::vector<::google::protobuf::Message*>& responses,
+              std::vector<Result>* results,
+              const CallOptions& call_opts,
+              DoneFunc done);
+  void GetStats(RpcStats* stats) const;
+  void InvalidateRoutes(const std::string& service);
+
 private:
-  Service* OnFindService(const std::string& service_name);
+  // run @call in a worker-thread, and wait for done if it is a sync call
+  template <class CallFunc>
+  Result DispatchCall(CallFunc call, DoneFunc done);
   void OnSendPacket(const Buf& buf, const Addr& addr, void* ctx);
   void OnRecvPacket(const Buf& buf, const Addr& addr);
   void OnSentResult(hudp::Result, void* ctx);
@@ -31,7 +46,8 @@ private:
   Env env_;
   hudp::HyperUdp hyper_udp_;
   OnServiceRouting on_service_routing_;
-  std::unordered_map<std::string, Service*> service_map_;
+  OnRouteKey on_route_key_;
+  std::vector<Service*> services_;
   std::vector<std::unique_ptr<RpcCore>> rpc_core_vec_;
   bool is_initialized_;
 };
@@ -39,7 +55,6 @@ private:
 HyperRpc::Impl::Impl(const Options& opt)
   : env_(opt)
   , hyper_udp_(env_.opt().hudp_options)
-  , service_map_(1024)
   , is_initialized_(false)
 {
 }
@@ -48,17 +63,26 @@ HyperRpc::Impl::~Impl()
 {
 }
 
-bool HyperRpc::Impl::InitAsClient(OnServiceRouting& on_svc_routing)
+bool HyperRpc::Impl::InitAsClient(OnServiceRouting& on_svc_routing,
+                                  OnRouteKey& on_route_key)
 {
   on_service_routing_ = on_svc_routing;
+  on_route_key_ = on_route_key;
   return true;
 }
 
 bool HyperRpc::Impl::InitAsServer(std::vector<Service*>& services)
 {
+  // check method-id collisions before any RpcCore is initialized
+  MethodTable method_table;
   for (Service* svc : services) {
-    service_map_[svc->GetDescriptor()->name()] = svc;
+    if (!method_table.AddService(svc)) {
+      ELOG("method-id collision found in service %s!",
+           svc->GetDescriptor()->name().c_str());
+      return false;
+    }
   }
+  services_ = services;
   return true;
 }
 
@@ -69,15 +93,13 @@ bool HyperRpc::Impl::Start(const Addr& bind_local_addr)
   RpcCore::OnSendPacket on_send_packet {
     ccb::BindClosure(this, &HyperRpc::Impl::OnSendPacket)
   };
-  RpcCore::OnFindService on_find_service {
-    ccb::BindClosure(this, &HyperRpc::Impl::OnFindService)
-  };
   size_t worker_num = env_.opt().hudp_options.worker_num;
   for (size_t i = 0; i < worker_num; i++) {
     rpc_core_vec_.emplace_back(new RpcCore(env_));
     if (!rpc_core_vec_[i]->Init(i, on_send_packet,
-                                   on_find_service,
-                                   on_service_routing_)) {
+                                   services_,
+                                   on_service_routing_,
+                                   on_route_key_)) {
       rpc_core_vec_.clear();
       return false;
     }
@@ -90,21 +112,31 @@ bool HyperRpc::Impl::Start(const Addr& bind_local_addr)
     rpc_core_vec_.clear();
     return false;
   }
+  if (env_.opt().huge_page_pools) {
+    // move per-core memory allocated here to NUMA nodes of worker-threads
+    ccb::WorkerGroup* worker_group = hyper_udp_.GetWorkerGroup();
+    std::vector<std::promise<void>> moved(worker_num);
+    std::vector<std::future<void>> waits;
+    for (size_t i = 0; i < worker_num; i++) {
+      std::promise<void>* promise = &moved[i];
+      waits.push_back(promise->get_future());
+      if (!worker_group->PostTask(i, [this, i, promise] {
+        rpc_core_vec_[i]->MoveToLocalNode();
+        promise->set_value();
+      })) {
+        WLOG("MoveToLocalNode PostTask failed!");
+        promise->set_value();
+      }
+    }
+    for (auto& wait : waits) {
+      wait.wait();
+    }
+  }
   // done
   is_initialized_ = true;
   return true;
 }
 
-Service* HyperRpc::Impl::OnFindService(const std::string& service_name)
-{
-  auto it = service_map_.find(service_name);
-  if (it != service_map_.end()) {
-    return it->second;
-  } else {
-    return nullptr;
-  }
-}
-
 void HyperRpc::Impl::OnSendPacket(const Buf& buf, const Addr& addr, void* ctx)
 {
   hyper_udp_.Send(buf, addr, ctx);
@@ -117,12 +149,14 @@ void HyperRpc::Impl::OnRecvPacket(const Buf& buf, const Addr& addr)
   size_t dst_core_id = rpc_core_vec_[cur_core_id]->OnRecvPacket(buf, addr);
   if (dst_core_id != cur_core_id && dst_core_id < rpc_core_vec_.size()) {
     // cross thread dispatch
+    // time waited in worker-queue is charged to deadlines of requests
+    uint64_t recv_ms = Env::NowMs();
     size_t redirect_buf_len = buf.len();
     void*  redirect_buf_ptr = env_.alloc().Alloc(redirect_buf_len);
     memcpy(static_cast<char*>(redirect_buf_ptr), buf.ptr(), buf.len());
     if (!ccb::Worker::self()->worker_group()->PostTask(dst_core_id, [=] {
       rpc_core_vec_[dst_core_id]->OnRecvPacket(
-                             {redirect_buf_ptr, redirect_buf_len}, addr);
+                      {redirect_buf_ptr, redirect_buf_len}, addr, recv_ms);
       env_.alloc().Free(redirect_buf_ptr, redirect_buf_len);
     })) {
       // worker-queue overflow
@@ -134,16 +168,21 @@ void HyperRpc::Impl::OnRecvPacket(const Buf& buf, const Addr& addr)
 
 void HyperRpc::Impl::OnSentResult(hudp::Result result, void* ctx)
 {
-  if (result == hudp::R_SUCCESS) {
+  bool is_success = (result == hudp::R_SUCCESS);
+  if (is_success && !RpcCore::NeedSendResult(ctx)) {
     // nothing need to do when success
     return;
   }
+  auto on_sent_result = (is_success ? &RpcCore::OnSendPacketSucceeded
+                                    : &RpcCore::OnSendPacketFailed);
   size_t cur_core_id = ccb::Worker::self()->id();
-  size_t dst_core_id = rpc_core_vec_[cur_core_id]->OnSendPacketFailed(ctx);
+  RpcCore* rpc_core = rpc_core_vec_[cur_core_id].get();
+  size_t dst_core_id = (rpc_core->*on_sent_result)(ctx);
   if (dst_core_id != cur_core_id) {
     // cross thread dispatch
     if (!ccb::Worker::self()->worker_group()->PostTask(dst_core_id, [=] {
-      rpc_core_vec_[dst_core_id]->OnSendPacketFailed(ctx);
+      RpcCore* dst_rpc_core = rpc_core_vec_[dst_core_id].get();
+      (dst_rpc_core->*on_sent_result)(ctx);
     })) {
       // worker-queue overflow
       WLOG("OnSentResult PostTask failed because of worker-queue overflow!");
@@ -155,7 +194,54 @@ Result HyperRpc::Impl::CallMethod(
                        const ::google::protobuf::MethodDescriptor* method,
                        const ::google::protobuf::Message* request,
                        ::google::protobuf::Message* response,
+                       const CallOptions& call_opts,
                        DoneFunc done)
+{
+  return DispatchCall([method, request, response, call_opts](
+                          RpcCore* rpc_core, DoneFunc done) {
+    rpc_core->CallMethod(method, request, response, call_opts,
+                         std::move(done));
+  }, std::move(done));
+}
+
+Result HyperRpc::Impl::FanOutCall(
+              const ::google::protobuf::MethodDescriptor* method,
+              const std::vector<const ::google::protobuf::Message*>& requests,
+              const std::vector<::google::protobuf::Message*>& responses,
+              std::vector<Result>* results,
+              const CallOptions& call_opts,
+              DoneFunc done)
+{
+  return DispatchCall([method, requests, responses, results, call_opts](
+                          RpcCore* rpc_core, DoneFunc done) {
+    rpc_core->FanOutCall(method, requests, responses, results, call_opts,
+                         std::move(done));
+  }, std::move(done));
+}
+
+void HyperRpc::Impl::GetStats(RpcStats* stats) const
+{
+  *stats = RpcStats();
+  for (const auto& rpc_core : rpc_core_vec_) {
+    rpc_core->GetStats(stats);
+  }
+}
+
+void HyperRpc::Impl::InvalidateRoutes(const std::string& service)
+{
+  HRPC_ASSERT(is_initialized_);
+  ccb::WorkerGroup* worker_group = hyper_udp_.GetWorkerGroup();
+  for (size_t i = 0; i < rpc_core_vec_.size(); i++) {
+    if (!worker_group->PostTask(i, [this, i, service] {
+      rpc_core_vec_[i]->InvalidateRoutes(service);
+    })) {
+      WLOG("InvalidateRoutes PostTask failed!");
+    }
+  }
+}
+
+template <class CallFunc>
+Result HyperRpc::Impl::DispatchCall(CallFunc call, DoneFunc done)
 {
   HRPC_ASSERT(is_initialized_);
   Result rpc_result = kSuccess;
@@ -169,8 +255,7 @@ Result HyperRpc::Impl::CallMethod(
     }
     // dispatch in current worker-thread
     size_t rpc_core_id = ccb::Worker::self()->id();
-    rpc_core_vec_[rpc_core_id]->CallMethod(method, request, response,
-                                           std::move(done));
+    call(rpc_core_vec_[rpc_core_id].get(), std::move(done));
   } else {
     static thread_local ccb::EventFd evfd;
     ccb::EventFd* pevfd = &evfd;
@@ -182,10 +267,9 @@ Result HyperRpc::Impl::CallMethod(
       };
     }
     // dispatch to a worker-thread of worker-group
-    if (!worker_group->PostTask([this, method, request, response, done] {
+    if (!worker_group->PostTask([this, call, done] {
       size_t rpc_core_id = ccb::Worker::self()->id();
-      rpc_core_vec_[rpc_core_id]->CallMethod(method, request, response,
-                                             std::move(done));
+      call(rpc_core_vec_[rpc_core_id].get(), std::move(done));
     })) {
       // worker-queue overflow
       WLOG("CallMethod PostTask failed because of worker-queue overflow!");
@@ -216,9 +300,10 @@ HyperRpc::~HyperRpc()
 {
 }
 
-bool HyperRpc::InitAsClient(OnServiceRouting on_svc_routing)
+bool HyperRpc::InitAsClient(OnServiceRouting on_svc_routing,
+                            OnRouteKey on_route_key)
 {
-  return pimpl_->InitAsClient(on_svc_routing);
+  return pimpl_->InitAsClient(on_svc_routing, on_route_key);
 }
 
 bool HyperRpc::InitAsServer(std::vector<Service*> services)
@@ -236,7 +321,56 @@ Result HyperRpc::CallMethod(const ::google::protobuf::MethodDescriptor* method,
                             ::google::protobuf::Message* response,
                             ::ccb::ClosureFunc<void(Result)> done)
 {
-  return pimpl_->CallMethod(method, request, response, std::move(done));
+  return pimpl_->CallMethod(method, request, response, CallOptions(),
+                            std::move(done));
+}
+
+Result HyperRpc::CallMethod(const ::google::protobuf::MethodDescriptor* method,
+                            const ::google::protobuf::Message* request,
+                            ::google::protobuf::Message* response,
+                            const CallOptions& call_opts,
+                            ::ccb::ClosureFunc<void(Result)> done)
+{
+  return pimpl_->CallMethod(method, request, response, call_opts,
+                            std::move(done));
+}
+
+Result HyperRpc::CallMethod(const ::google::protobuf::MethodDescriptor* method,
+                            const ::google::protobuf::Message* request,
+                            ::google::protobuf::Message* response,
+                            const CallOptions& call_opts,
+                            RpcCallback* callback)
+{
+  if (!callback) {
+    return pimpl_->CallMethod(method, request, response, call_opts, nullptr);
+  }
+  // a closure of a single pointer is stored inline by DoneFunc
+  return pimpl_->CallMethod(method, request, response, call_opts,
+                            [callback](Result result) {
+                              callback->OnDone(result);
+                            });
+}
+
+Result HyperRpc::FanOutCall(
+              const ::google::protobuf::MethodDescriptor* method,
+              const std::vector<const ::google::protobuf::Message*>& requests,
+              const std::vector<::google::protobuf::Message*>& responses,
+              std::vector<Result>* results,
+              const CallOptions& call_opts,
+              DoneFunc done)
+{
+  return pimpl_->FanOutCall(method, requests, responses, results, call_opts,
+                            std::move(done));
+}
+
+void HyperRpc::GetStats(RpcStats* stats) const
+{
+  pimpl_->GetStats(stats);
+}
+
+void HyperRpc::InvalidateRoutes(const std::string& service)
+{
+  pimpl_->InvalidateRoutes(service);
 }
 
 } // namespace hrpc
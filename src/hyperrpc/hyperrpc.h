@@ -39,6 +39,7 @@
 namespace google {
 namespace protobuf {
   class MethodDescriptor;
+  class ServiceDescriptor;
   class Message;
 } // namespace protobuf
 } // namespace google
@@ -76,10 +77,88 @@ enum Result
   kInError = 5, // other internal errors
 };
 
+/* Payload compression algorithms
+ */
+enum CompressType
+{
+  kNoCompress = 0,
+  kLz4 = 1,  // fast with moderate ratio
+  kZstd = 2, // better ratio at more CPU cost
+};
+
+/* Load balancing policies choosing the endpoint tried first, others are
+ * tried in the routed order after it
+ */
+enum LbPolicy
+{
+  kRoutedOrder = 0,       // the first endpoint routed
+  kRoundRobin = 1,        // endpoints in turn
+  kPowerOfTwoChoices = 2, // the better of two random endpoints
+  kLeastOutstanding = 3,  // the endpoint with fewest calls pending
+};
+
 /* RPC closure type
  */
 using DoneFunc = ::ccb::ClosureFunc<void(Result)>;
 
+/* RPC callback owned by the caller, an alternative of DoneFunc for calls
+ * which must not allocate for closures
+ */
+class RpcCallback
+{
+public:
+  virtual ~RpcCallback() {}
+  // called once in a worker thread when the call is done
+  virtual void OnDone(Result result) = 0;
+};
+
+/* Options of a single RPC call, fields left 0 take defaults of Options
+ */
+struct CallOptions
+{
+  CallOptions()
+    : timeout_ms(0), max_attempts(0), hedge_delay_ms(0), quorum(0) {}
+
+  // rpc timeout, 0 means DefaultRpcTimeout
+  size_t timeout_ms;
+  // max number of endpoints tried, 0 means all endpoints routed
+  size_t max_attempts;
+  // delay before a hedged request is sent, 0 means as set by Hedging
+  size_t hedge_delay_ms;
+  // successful responses to finish a fan-out call, 0 means all of them
+  size_t quorum;
+};
+
+/* Counters of outgoing calls, summed over all worker threads
+ */
+struct RpcStats
+{
+  RpcStats() : retries(0), retries_suppressed(0), session_capacity(0),
+               route_cache_hits(0), route_cache_misses(0) {}
+
+  // requests sent to another endpoint for failover or hedging
+  uint64_t retries;
+  // retries not sent as RetryBudget was exhausted
+  uint64_t retries_suppressed;
+  // sessions of which memory is committed, see SessionShrinkDelay
+  uint64_t session_capacity;
+  // calls routed by RouteCache, and those called OnServiceRouting
+  uint64_t route_cache_hits;
+  uint64_t route_cache_misses;
+};
+
+/* Get the time budget left of the incoming RPC being served
+ *
+ * The caller's deadline is carried in requests, and expired requests are
+ * dropped before dispatching, as well as late responses. It is valid in
+ * service methods and in done callbacks of calls issued there, so that
+ * asynchronous handlers keep it, and calls issued in either inherit the
+ * deadline if it is earlier than their own timeout.
+ *
+ * @return  milliseconds left, 0 if expired, -1 if there is no deadline
+ */
+int64_t RemainingRpcTime();
+
 class OptionsBuilder
 {
 public:
@@ -89,7 +168,9 @@ public:
   /* Build the Options object
    * @num     number of worker threads
    *
-   * Build the Options object as Builder-Pattern
+   * Build the Options object as Builder-Pattern, options that need a
+   * higher packet version than PacketVersion() are rejected by throwing
+   * std::invalid_argument
    *
    * @return  created Options object
    */
@@ -118,9 +199,191 @@ public:
   OptionsBuilder& WorkerNumber(size_t num);
   OptionsBuilder& WorkerQueueSize(size_t num);
 
+  /* Set packet version of outgoing requests
+   * @ver     1 (protobuf RpcHeader) or 2 (fixed layout RpcHeader)
+   *
+   * Responses are always sent in the version of requests, and all versions
+   * are accepted when receiving. Version 1 is sent by default, set version
+   * 2 only after all peers upgraded.
+   *
+   * @return  self reference as Builder-Pattern
+   */
+  OptionsBuilder& PacketVersion(size_t ver);
+
+  /* Set payload compression of all methods
+   * @type       compression algorithm
+   * @threshold  only messages larger than @threshold bytes are compressed
+   *
+   * Compression needs packet version 2 and above, otherwise Build() fails.
+   * Messages that do not get smaller are sent uncompressed.
+   *
+   * @return  self reference as Builder-Pattern
+   */
+  OptionsBuilder& Compression(CompressType type, size_t threshold);
+
+  /* Set payload compression of a method, overriding Compression()
+   * @method     full name of the method, e.g. "package.Service.Method"
+   * @type       compression algorithm, kNoCompress to disable it
+   * @threshold  only messages larger than @threshold bytes are compressed
+   *
+   * @return  self reference as Builder-Pattern
+   */
+  OptionsBuilder& MethodCompression(const std::string& method,
+                                    CompressType type, size_t threshold);
+
+  /* Enable packing of small packets into datagrams
+   * @max_bytes     max size of a datagram, 0 to disable batching
+   * @max_delay_us  max delay of the first packet in a datagram, 0 to
+   *                flush at the end of the current task
+   *
+   * Packets to the same peer are coalesced until @max_bytes is reached or
+   * @max_delay_us expires, which is rounded up to the 1ms timer tick.
+   * Receivers of batched datagrams must be upgraded before enabling it.
+   *
+   * @return  self reference as Builder-Pattern
+   */
+  OptionsBuilder& PacketBatching(size_t max_bytes, size_t max_delay_us);
+
+  /* Enable fragmentation of large messages
+   * @size    max body bytes of each fragment, 0 to disable fragmentation
+   *
+   * Messages with body larger than @size are sent as sequenced fragments,
+   * which needs packet version 2 and above, otherwise Build() fails.
+   * Receivers of fragments must be upgraded before enabling it.
+   *
+   * @return  self reference as Builder-Pattern
+   */
+  OptionsBuilder& FragmentSize(size_t size);
+
+  /* Set limits of reassembling fragmented messages
+   * @timeout_ms  incomplete messages are dropped after @timeout_ms
+   * @max_bytes   max total size of messages being reassembled by each
+   *              worker thread, which also bounds the size of messages
+   *              decompressed
+   *
+   * @return  self reference as Builder-Pattern
+   */
+  OptionsBuilder& Reassembly(size_t timeout_ms, size_t max_bytes);
+
+  /* Set bounds of the initial Arena block of incoming RPCs
+   * @min_size  block size of methods before enough RPCs are observed
+   * @max_size  block size is at most this, equal to @min_size to disable
+   *            adaptive sizing
+   *
+   * Within the bounds, the block of each method is sized by a high
+   * percentile of Arena space its RPCs used, so that most of them are
+   * served without allocating more blocks. It only applies to messages
+   * with cc_enable_arenas.
+   *
+   * @return  self reference as Builder-Pattern
+   */
+  OptionsBuilder& ArenaBlockSize(size_t min_size, size_t max_size);
+
+  /* Cache endpoints resolved by OnServiceRouting in each worker thread
+   * @ttl_ms           endpoints are reused for this long, 0 to disable
+   *                   caching
+   * @negative_ttl_ms  failures of routing are reused for this long, 0 to
+   *                   not cache them
+   *
+   * Routes are cached per method, and per key of the request as well if
+   * OnRouteKey is given to HyperRpc::InitAsClient(). They can be dropped
+   * before expired by HyperRpc::InvalidateRoutes().
+   *
+   * @return  self reference as Builder-Pattern
+   */
+  OptionsBuilder& RouteCache(size_t ttl_ms, size_t negative_ttl_ms);
+
   OptionsBuilder& MaxRpcSessions(size_t num);
   OptionsBuilder& DefaultRpcTimeout(size_t ms);
 
+  /* Back session pools of worker threads with 2MB huge pages
+   * @enable  falls back to transparent huge pages if no huge page is
+   *          reserved
+   *
+   * Pools are faulted in when allocated, and moved to NUMA nodes of their
+   * worker threads by HyperRpc::Start().
+   *
+   * @return  self reference as Builder-Pattern
+   */
+  OptionsBuilder& HugePagePools(bool enable);
+
+  /* Set delay of releasing memory of session pools
+   * @ms  session pools grow by segments up to MaxRpcSessions, and a
+   *      segment is released after it has been unused for this long, 0 to
+   *      keep segments once committed
+   *
+   * @return  self reference as Builder-Pattern
+   */
+  OptionsBuilder& SessionShrinkDelay(size_t ms);
+
+  /* Enable hedged requests
+   * @delay_ms    delay before the request is also sent to the next
+   *              endpoint, 0 to disable hedging unless @percentile is set
+   * @percentile  if not 0, the delay is this percentile of latencies
+   *              observed of the method, and @delay_ms is used only until
+   *              enough latencies are observed
+   *
+   * A hedged request is sent at most once per call, if no response has
+   * arrived after the delay, and the first response wins. It costs extra
+   * load on servers, so percentiles such as 95 are recommended.
+   *
+   * @return  self reference as Builder-Pattern
+   */
+  OptionsBuilder& Hedging(size_t delay_ms, size_t percentile);
+
+  /* Limit retries, including failovers and hedged requests, per service
+   * @percent  retries of each core may use at most this percentage of its
+   *           first attempts, 0 to disable the limit
+   * @burst    max retries allowed in a row, which are available from start
+   *
+   * Calls fail fast with kTimeout if no attempt is in flight and the
+   * budget is exhausted. See HyperRpc::GetStats() for counters.
+   *
+   * @return  self reference as Builder-Pattern
+   */
+  OptionsBuilder& RetryBudget(size_t percent, size_t burst);
+
+  /* Set load balancing policy of all services
+   * @policy  how the endpoint tried first is chosen among those routed
+   *
+   * Policies other than kRoutedOrder keep statistics of endpoints in each
+   * worker thread: calls outstanding, EWMA of latency and error rate.
+   * kPowerOfTwoChoices weighs all of them, so that slow or failing
+   * endpoints are avoided. Failover goes on in the routed order.
+   *
+   * @return  self reference as Builder-Pattern
+   */
+  OptionsBuilder& LoadBalancing(LbPolicy policy);
+
+  /* Set load balancing policy of a service, overriding LoadBalancing()
+   * @service  full name of the service, e.g. "package.Service"
+   * @policy   see LoadBalancing()
+   *
+   * @return  self reference as Builder-Pattern
+   */
+  OptionsBuilder& ServiceLoadBalancing(const std::string& service,
+                                       LbPolicy policy);
+
+  /* Route calls of a method by consistent hashing of a request field
+   * @method       full name of the method, e.g. "package.Service.Method"
+   * @key_path     singular field of the request, or of its sub-messages
+   *               like "user.id", which is an integer, enum or string
+   * @load_factor  calls outstanding to an endpoint are at most this times
+   *               of the average, otherwise the next endpoint is tried
+   *               first, 0 to not bound loads or at least 1
+   *
+   * OnServiceRouting should return all replicas of the method, and the
+   * key picks one by a Maglev table of them, which is built once for the
+   * same endpoints routed in any order. It overrides LoadBalancing() of
+   * the method, and failover goes on in the routed order after the
+   * endpoint picked.
+   *
+   * @return  self reference as Builder-Pattern
+   */
+  OptionsBuilder& MethodHashRouting(const std::string& method,
+                                    const std::string& key_path,
+                                    double load_factor);
+
   ::hudp::OptionsBuilder& hudp_options() {
     return hudp_opt_builder_;
   }
@@ -152,19 +415,74 @@ public:
                                 const std::string& method,
                                 const ::google::protobuf::Message& request,
                                 RouteInfoBuilder* out)>;
+  // requests of the same key share cached routes of a method
+  using OnRouteKey = ::ccb::ClosureFunc<
+                     uint64_t(const std::string& service,
+                              const std::string& method,
+                              const ::google::protobuf::Message& request)>;
   HyperRpc();
   HyperRpc(const Options& opt);
   virtual ~HyperRpc();
 
-  bool InitAsClient(OnServiceRouting on_svc_routing);
+  bool InitAsClient(OnServiceRouting on_svc_routing,
+                    OnRouteKey on_route_key = nullptr);
   bool InitAsServer(std::vector<Service*> services);
   bool Start(const Addr& bind_local_addr);
 
-  // this method is called by generated service stub
+  // these methods are called by generated service stub
+  Result CallMethod(const ::google::protobuf::MethodDescriptor* method,
+                    const ::google::protobuf::Message* request,
+                    ::google::protobuf::Message* response,
+                    DoneFunc done);
   Result CallMethod(const ::google::protobuf::MethodDescriptor* method,
                     const ::google::protobuf::Message* request,
                     ::google::protobuf::Message* response,
+                    const CallOptions& call_opts,
                     DoneFunc done);
+  // @callback must be valid until its OnDone() is called, or nullptr to
+  // wait for the result as sync call; calls from threads other than the
+  // workers still allocate the task posted to a worker
+  Result CallMethod(const ::google::protobuf::MethodDescriptor* method,
+                    const ::google::protobuf::Message* request,
+                    ::google::protobuf::Message* response,
+                    const CallOptions& call_opts,
+                    RpcCallback* callback);
+
+  /* Call a method on many endpoints and gather the responses
+   * @requests   a request sent to all shards, or one request per shard
+   * @responses  response of each shard, whose size is the number of shards
+   * @results    set to result of each shard
+   * @call_opts  see CallOptions, max_attempts and hedging are ignored
+   * @done       called once, or nullptr to wait for it as sync call
+   *
+   * Shard i is sent to the i-th endpoint routed by the first request,
+   * without failover. The call is done with kSuccess once the quorum of
+   * shards succeeded, or with the result that made the quorum unreachable,
+   * or with kTimeout. Responses of shards still pending then are dropped,
+   * and their results are left as kTimeout.
+   *
+   * A request sent to all shards is serialized only once.
+   *
+   * @return  result of sync call, or kSuccess for async call
+   */
+  Result FanOutCall(
+              const ::google::protobuf::MethodDescriptor* method,
+              const std::vector<const ::google::protobuf::Message*>& requests,
+              const std::vector<::google::protobuf::Message*>& responses,
+              std::vector<Result>* results,
+              const CallOptions& call_opts,
+              DoneFunc done);
+
+  // which may be called from any thread after Start()
+  void GetStats(RpcStats* stats) const;
+
+  /* Drop cached routes of methods of @service, or all if it is empty
+   * @service  full name of the service, e.g. "package.Service"
+   *
+   * It is done by worker threads asynchronously, and calls issued
+   * afterwards may still use routes cached.
+   */
+  void InvalidateRoutes(const std::string& service);
 
 private:
   // not copyable and movable
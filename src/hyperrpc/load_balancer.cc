@@ -0,0 +1,161 @@
+/* Copyright (c) 2016, Bin Wei <bin@vip.qq.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of of its contributors may not be used to endorse or 
+ * promote products derived from this software without specific prior 
+ * written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <math.h>
+#include "hyperrpc/load_balancer.h"
+
+namespace hrpc {
+
+LoadBalancer::LoadBalancer(const Env& env)
+  : env_(env)
+{
+}
+
+LoadBalancer::~LoadBalancer()
+{
+}
+
+size_t LoadBalancer::Pick(uint8_t policy, EndpointSet* endpoints)
+{
+  size_t size = endpoints->size();
+  if (size <= 1) {
+    return 0;
+  }
+  switch (policy) {
+  case kRoundRobin:
+    return endpoints->NextRoundRobin();
+  case kPowerOfTwoChoices: {
+    // two distinct endpoints at random
+    size_t first = env_.Rand() % size;
+    size_t second = env_.Rand() % (size - 1);
+    if (second >= first) second++;
+    return Cost(endpoints->GetEndpoint(first)) <=
+           Cost(endpoints->GetEndpoint(second)) ? first : second;
+  }
+  case kLeastOutstanding:
+    return PickLeastOutstanding(*endpoints);
+  default:
+    return 0;
+  }
+}
+
+size_t LoadBalancer::PickByHash(EndpointSet* endpoints, uint64_t hash,
+                                double load_factor)
+{
+  size_t size = endpoints->size();
+  if (size <= 1) {
+    return 0;
+  }
+  size_t index = endpoints->HashLookup(hash);
+  // an idle endpoint is always within the bound, which saves the scan
+  if (load_factor == 0 || Outstanding(endpoints->GetEndpoint(index)) == 0) {
+    return index;
+  }
+  // the call picking is counted, so that some endpoint is within it
+  size_t total = 1;
+  for (size_t i = 0; i < size; i++) {
+    total += Outstanding(endpoints->GetEndpoint(i));
+  }
+  size_t capacity = static_cast<size_t>(ceil(load_factor * total / size));
+  for (size_t i = 0; i < size; i++) {
+    size_t next = (index + i) % size;
+    if (Outstanding(endpoints->GetEndpoint(next)) < capacity) {
+      return next;
+    }
+  }
+  return index;
+}
+
+double LoadBalancer::Cost(const Addr& endpoint) const
+{
+  const EndpointStats* stats = Find(endpoint);
+  if (!stats) {
+    return 0;
+  }
+  // expected latency of a call queued after those outstanding
+  return (stats->rtt_ms + 1) * (stats->outstanding + 1) *
+         (1 + kErrorPenalty * stats->error_rate);
+}
+
+size_t LoadBalancer::PickLeastOutstanding(const EndpointSet& endpoints) const
+{
+  // ties are broken by starting at random
+  size_t size = endpoints.size();
+  size_t start = env_.Rand() % size;
+  size_t best = start;
+  size_t best_outstanding = SIZE_MAX;
+  for (size_t i = 0; i < size; i++) {
+    size_t index = (start + i) % size;
+    size_t outstanding = Outstanding(endpoints.GetEndpoint(index));
+    if (outstanding < best_outstanding) {
+      best = index;
+      best_outstanding = outstanding;
+      if (outstanding == 0) break;
+    }
+  }
+  return best;
+}
+
+LoadBalancer::EndpointStats* LoadBalancer::OnSent(const Addr& endpoint)
+{
+  if (stats_.size() >= kMaxEndpoints) {
+    Purge();
+  }
+  EndpointStats* stats = &stats_[Key(endpoint)];
+  stats->outstanding++;
+  return stats;
+}
+
+void LoadBalancer::OnDone(EndpointStats* stats, uint64_t rtt_ms,
+                          bool failed)
+{
+  stats->outstanding--;
+  stats->error_rate = stats->error_rate * (1 - kDecay) +
+                      (failed ? kDecay : 0);
+  if (failed) {
+    return;
+  }
+  // the first latency is taken as is
+  stats->rtt_ms = (stats->rtt_ms == 0 ? rtt_ms :
+                   stats->rtt_ms * (1 - kDecay) + rtt_ms * kDecay);
+}
+
+void LoadBalancer::Purge()
+{
+  // stats of calls outstanding are referenced by them
+  for (auto it = stats_.begin(); it != stats_.end(); ) {
+    if (it->second.outstanding == 0) {
+      it = stats_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+} // namespace hrpc
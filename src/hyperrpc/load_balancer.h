@@ -0,0 +1,115 @@
+/* Copyright (c) 2016, Bin Wei <bin@vip.qq.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of of its contributors may not be used to endorse or 
+ * promote products derived from this software without specific prior 
+ * written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _HRPC_LOAD_BALANCER_H
+#define _HRPC_LOAD_BALANCER_H
+
+#include <stdint.h>
+#include <unordered_map>
+#include "hyperrpc/hyperrpc.h"
+#include "hyperrpc/env.h"
+#include "hyperrpc/endpoint_set.h"
+
+namespace hrpc {
+
+/* Per worker thread statistics of endpoints called, and policies choosing
+ * the endpoint tried first by them
+ *
+ * Latency and error rate are exponentially weighted moving averages of
+ * calls done. Endpoints never called have no latency and no error, so
+ * that they are tried soon after being routed.
+ */
+class LoadBalancer
+{
+public:
+  struct EndpointStats {
+    EndpointStats() : outstanding(0), rtt_ms(0), error_rate(0) {}
+    size_t outstanding;
+    double rtt_ms;
+    double error_rate;
+  };
+
+  explicit LoadBalancer(const Env& env);
+  ~LoadBalancer();
+
+  // index of the endpoint tried first in @endpoints, by @policy of LbPolicy
+  size_t Pick(uint8_t policy, EndpointSet* endpoints);
+  // index of the endpoint of @hash by consistent hashing, if its calls
+  // outstanding exceed @load_factor times of the average, the next one
+  // not exceeding it is picked instead, 0 to not bound loads
+  size_t PickByHash(EndpointSet* endpoints, uint64_t hash,
+                    double load_factor);
+  // a call is sent to @endpoint, the stats returned stays valid until the
+  // call is done
+  EndpointStats* OnSent(const Addr& endpoint);
+  // @rtt_ms is ignored if @failed
+  void OnDone(EndpointStats* stats, uint64_t rtt_ms, bool failed);
+
+  // nullptr if the endpoint has not been called
+  const EndpointStats* Find(const Addr& endpoint) const {
+    auto it = stats_.find(Key(endpoint));
+    return it != stats_.end() ? &it->second : nullptr;
+  }
+  size_t size() const {
+    return stats_.size();
+  }
+
+private:
+  // weight of the latest call in moving averages
+  static constexpr double kDecay = 0.2;
+  // cost of an endpoint always failing is this times of a healthy one
+  static constexpr double kErrorPenalty = 10;
+  // stats of endpoints having no call outstanding are dropped when the
+  // table grows beyond this
+  static constexpr size_t kMaxEndpoints = 65536;
+
+  static uint64_t Key(const Addr& endpoint) {
+    return (static_cast<uint64_t>(endpoint.ip()) << 16) | endpoint.port();
+  }
+  size_t Outstanding(const Addr& endpoint) const {
+    const EndpointStats* stats = Find(endpoint);
+    return stats ? stats->outstanding : 0;
+  }
+  double Cost(const Addr& endpoint) const;
+  size_t PickLeastOutstanding(const EndpointSet& endpoints) const;
+  void Purge();
+
+  // not copyable and movable
+  LoadBalancer(const LoadBalancer&) = delete;
+  void operator=(const LoadBalancer&) = delete;
+  LoadBalancer(LoadBalancer&&) = delete;
+  void operator=(LoadBalancer&&) = delete;
+
+  const Env& env_;
+  std::unordered_map<uint64_t, EndpointStats> stats_;
+};
+
+} // namespace hrpc
+
+#endif // _HRPC_LOAD_BALANCER_H
@@ -0,0 +1,179 @@
+/* Copyright (c) 2016, Bin Wei <bin@vip.qq.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of of its contributors may not be used to endorse or 
+ * promote products derived from this software without specific prior 
+ * written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <tuple>
+#include <google/protobuf/descriptor.h>
+#include "hyperrpc/method_table.h"
+#include "hyperrpc/rpc_context.h"
+#include "hyperrpc/service.h"
+
+namespace hrpc {
+
+static constexpr size_t kMethodTableInitCapacity = 64;
+
+MethodTable::MethodTable(const Options* opt)
+  : opt_(opt)
+{
+  Rehash(kMethodTableInitCapacity);
+}
+
+MethodTable::~MethodTable()
+{
+  for (const MethodEntry& entry : entries_) {
+    for (IncomingRpcContext* ctx : entry.free_contexts) {
+      delete ctx;
+    }
+  }
+}
+
+static inline uint32_t Fnv1a(uint32_t hash, const std::string& str)
+{
+  for (unsigned char c : str) {
+    hash ^= c;
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+uint32_t MethodTable::MethodId(const std::string& service_name,
+                               const std::string& method_name)
+{
+  uint32_t hash = 2166136261U;
+  hash = Fnv1a(hash, service_name);
+  hash = (hash ^ '.') * 16777619U;
+  return Fnv1a(hash, method_name);
+}
+
+uint32_t MethodTable::MethodId(
+                      const google::protobuf::MethodDescriptor* method)
+{
+  return MethodId(method->service()->name(), method->name());
+}
+
+bool MethodTable::AddService(Service* service)
+{
+  auto service_desc = service->GetDescriptor();
+  if (!service_desc) return false;
+  for (int i = 0; i < service_desc->method_count(); i++) {
+    auto method = service_desc->method(i);
+    const MethodEntry* found = Find(MethodId(method));
+    if (found && found->method->full_name() != method->full_name()) {
+      // method-id collision, cannot be told apart on wire
+      return false;
+    }
+    MethodEntry* entry = Find(method);
+    if (!entry) entry = Insert(method);
+    entry->service = service;
+    entry->request_prototype = &service->GetRequestPrototype(method);
+    entry->response_prototype = &service->GetResponsePrototype(method);
+  }
+  return true;
+}
+
+MethodEntry* MethodTable::FindOrAdd(
+             const google::protobuf::MethodDescriptor* method)
+{
+  MethodEntry* entry = Find(method);
+  if (!entry) entry = Insert(method);
+  return entry;
+}
+
+MethodEntry* MethodTable::Insert(
+             const google::protobuf::MethodDescriptor* method)
+{
+  // keep load factor of index below 1/2
+  if ((entries_.size() + 1) * 2 > index_mask_ + 1) {
+    Rehash((index_mask_ + 1) * 2);
+  }
+  CompressOption compress_opt;
+  RetryBudget* retry_budget = nullptr;
+  uint8_t lb_policy = kRoutedOrder;
+  std::vector<const google::protobuf::FieldDescriptor*> hash_key;
+  double hash_load_factor = 0;
+  if (opt_) {
+    auto it = opt_->method_compression.find(method->full_name());
+    compress_opt = (it != opt_->method_compression.end() ?
+                    it->second : opt_->compression);
+    if (opt_->retry_budget_percent > 0) {
+      retry_budget = &retry_budgets_.emplace(
+                          std::piecewise_construct,
+                          std::forward_as_tuple(method->service()),
+                          std::forward_as_tuple(opt_->retry_budget_percent,
+                                                opt_->retry_budget_burst))
+                          .first->second;
+    }
+    auto lb_it = opt_->service_lb_policy.find(method->service()->full_name());
+    lb_policy = (lb_it != opt_->service_lb_policy.end() ?
+                 lb_it->second : opt_->lb_policy);
+    auto hash_it = opt_->method_hash_routing.find(method->full_name());
+    if (hash_it != opt_->method_hash_routing.end() &&
+        RequestKey::Resolve(method->input_type(), hash_it->second.key_path,
+                            &hash_key)) {
+      hash_load_factor = hash_it->second.load_factor;
+    }
+  }
+  entries_.push_back({MethodId(method), method,
+                      compress_opt.type, compress_opt.threshold,
+                      retry_budget, lb_policy, std::move(hash_key),
+                      hash_load_factor, nullptr, nullptr, nullptr});
+  MethodEntry* entry = &entries_.back();
+  size_t i = entry->method_id & index_mask_;
+  while (id_index_[i] && id_index_[i]->method_id != entry->method_id) {
+    i = (i + 1) & index_mask_;
+  }
+  // an entry of the same id is kept only for outgoing calls
+  if (!id_index_[i]) id_index_[i] = entry;
+  i = HashPtr(method) & index_mask_;
+  while (desc_index_[i]) {
+    i = (i + 1) & index_mask_;
+  }
+  desc_index_[i] = entry;
+  return entry;
+}
+
+void MethodTable::Rehash(size_t capacity)
+{
+  index_mask_ = capacity - 1;
+  id_index_.assign(capacity, nullptr);
+  desc_index_.assign(capacity, nullptr);
+  for (MethodEntry& entry : entries_) {
+    size_t i = entry.method_id & index_mask_;
+    while (id_index_[i] && id_index_[i]->method_id != entry.method_id) {
+      i = (i + 1) & index_mask_;
+    }
+    if (!id_index_[i]) id_index_[i] = &entry;
+    i = HashPtr(entry.method) & index_mask_;
+    while (desc_index_[i]) {
+      i = (i + 1) & index_mask_;
+    }
+    desc_index_[i] = &entry;
+  }
+}
+
+} // namespace hrpc
@@ -0,0 +1,147 @@
+/* Copyright (c) 2016, Bin Wei <bin@vip.qq.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of of its contributors may not be used to endorse or 
+ * promote products derived from this software without specific prior 
+ * written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _HRPC_METHOD_TABLE_H
+#define _HRPC_METHOD_TABLE_H
+
+#include <deque>
+#include <unordered_map>
+#include <vector>
+#include "hyperrpc/hyperrpc.h"
+#include "hyperrpc/hash_routing.h"
+#include "hyperrpc/histogram.h"
+#include "hyperrpc/retry_budget.h"
+
+namespace hrpc {
+
+class IncomingRpcContext;
+
+/* Per-method information resolved once and shared by all RPCs of a core,
+ * with runtime state of the method updated by the core owning the table
+ */
+struct MethodEntry
+{
+  uint32_t method_id;
+  const google::protobuf::MethodDescriptor* method;
+  // compression of messages sent, resolved from Options
+  uint8_t compress_type;
+  size_t compress_threshold;
+  // shared by methods of the service, nullptr if retries are unlimited
+  RetryBudget* retry_budget;
+  // value of LbPolicy, resolved from Options by service
+  uint8_t lb_policy;
+  // key of consistent hashing, empty if it is not used
+  std::vector<const google::protobuf::FieldDescriptor*> hash_key;
+  double hash_load_factor;
+  // fields below are only set for methods served locally
+  Service* service;
+  const google::protobuf::Message* request_prototype;
+  const google::protobuf::Message* response_prototype;
+  // latency in ms of calls issued by the core, and hedging delay derived
+  // from it, both updated by RpcSessionManager
+  Histogram latency_ms;
+  size_t hedge_delay_ms;
+  // contexts of incoming RPCs kept for reuse by RpcCore, owned by the table
+  std::vector<IncomingRpcContext*> free_contexts;
+  // Arena space used by incoming RPCs and the initial block size derived
+  // from it, both updated by RpcCore
+  Histogram arena_used;
+  size_t arena_block_size;
+};
+
+/* Flat lookup table of MethodEntry, indexed by both method-id (for incoming
+ * packets) and MethodDescriptor (for outgoing calls)
+ *
+ * Method-id is a 32bit FNV-1a hash of "ServiceName.MethodName", which is
+ * stable among processes and carried in RpcHeader instead of the names.
+ * Collisions between methods served locally are detected when adding them,
+ * and names carried by version 1 requests are checked against the method
+ * found by method-id.
+ */
+class MethodTable
+{
+public:
+  // compression, retry budget and load balancing of methods are resolved
+  // from @opt if given
+  explicit MethodTable(const Options* opt = nullptr);
+  ~MethodTable();
+
+  static uint32_t MethodId(const std::string& service_name,
+                           const std::string& method_name);
+  static uint32_t MethodId(const google::protobuf::MethodDescriptor* method);
+
+  // return false if any method-id collides with another method
+  bool AddService(Service* service);
+  // entries are mutable for the core owning the table
+  MethodEntry* FindOrAdd(const google::protobuf::MethodDescriptor* method);
+
+  MethodEntry* Find(uint32_t method_id) {
+    for (size_t i = method_id & index_mask_; ; i = (i + 1) & index_mask_) {
+      MethodEntry* entry = id_index_[i];
+      if (!entry || entry->method_id == method_id) return entry;
+    }
+  }
+  MethodEntry* Find(const google::protobuf::MethodDescriptor* method) {
+    for (size_t i = HashPtr(method) & index_mask_; ;
+         i = (i + 1) & index_mask_) {
+      MethodEntry* entry = desc_index_[i];
+      if (!entry || entry->method == method) return entry;
+    }
+  }
+
+  size_t size() const {
+    return entries_.size();
+  }
+
+private:
+  static size_t HashPtr(const void* ptr) {
+    return (reinterpret_cast<uintptr_t>(ptr) >> 4) * 0x9E3779B97F4A7C15UL
+                                                   >> 32;
+  }
+  MethodEntry* Insert(const google::protobuf::MethodDescriptor* method);
+  void Rehash(size_t capacity);
+
+  // not copyable and movable
+  MethodTable(const MethodTable&) = delete;
+  void operator=(const MethodTable&) = delete;
+  MethodTable(MethodTable&&) = delete;
+  void operator=(MethodTable&&) = delete;
+
+  const Options* opt_;
+  std::deque<MethodEntry> entries_; // stable addresses
+  std::unordered_map<const google::protobuf::ServiceDescriptor*,
+                     RetryBudget> retry_budgets_;
+  std::vector<MethodEntry*> id_index_;
+  std::vector<MethodEntry*> desc_index_;
+  size_t index_mask_;
+};
+
+} // namespace hrpc
+
+#endif // _HRPC_METHOD_TABLE_H
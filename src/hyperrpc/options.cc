@@ -29,9 +29,12 @@
  */
 #include <limits>
 #include <gflags/gflags.h>
+#include <google/protobuf/descriptor.h>
 #include <hyperudp/options.h>
 #include <hyperudp/module_registry.h>
 #include "hyperrpc/hyperrpc.h"
+#include "hyperrpc/constants.h"
+#include "hyperrpc/hash_routing.h"
 
 namespace hrpc {
 
@@ -52,16 +55,25 @@ namespace hrpc {
 // WorkerGroup options
 GFLAGS_DEFINE_U64(worker_num, "number of worker threads");
 GFLAGS_DEFINE_U64(worker_queue_size, "size of queue consumed by worker");
+// RpcCore options
+GFLAGS_DEFINE_U64(packet_version, "packet version of outgoing requests");
+GFLAGS_DEFINE_U64(fragment_size, "max body bytes of each fragment");
 // RpcSessionManager options
 GFLAGS_DEFINE_U64(max_rpc_sessions, "max number of pending RPC sessions");
 GFLAGS_DEFINE_U64(default_rpc_timeout, "default RPC session timeout (ms)");
+GFLAGS_DEFINE_BOOL(huge_page_pools, "back session pools with huge pages");
 
 OptionsBuilder::OptionsBuilder()
   : hrpc_opt_(new Options)
 {
+  // RpcCore options
+  PacketVersion(kDefaultPacketVer);
+  Reassembly(1000, 64 * 1024 * 1024);
+  ArenaBlockSize(kArenaInitBufSize, 64 * 1024);
   // RpcSessionManager options
   MaxRpcSessions(1000000);
   DefaultRpcTimeout(2500);
+  SessionShrinkDelay(10000);
 }
 
 OptionsBuilder::~OptionsBuilder()
@@ -72,8 +84,23 @@ Options OptionsBuilder::Build()
 {
   GFLAGS_MAY_OVERRIDE(worker_num, WorkerNumber);
   GFLAGS_MAY_OVERRIDE(worker_queue_size, WorkerQueueSize);
+  GFLAGS_MAY_OVERRIDE(packet_version, PacketVersion);
+  GFLAGS_MAY_OVERRIDE(fragment_size, FragmentSize);
   GFLAGS_MAY_OVERRIDE(max_rpc_sessions, MaxRpcSessions);
   GFLAGS_MAY_OVERRIDE(default_rpc_timeout, DefaultRpcTimeout);
+  GFLAGS_MAY_OVERRIDE(huge_page_pools, HugePagePools);
+  if (hrpc_opt_->packet_version < 2) {
+    bool compressed = (hrpc_opt_->compression.type != kNoCompress);
+    for (const auto& entry : hrpc_opt_->method_compression) {
+      compressed = compressed || entry.second.type != kNoCompress;
+    }
+    if (compressed) {
+      throw std::invalid_argument("Compression needs packet version 2!");
+    }
+    if (hrpc_opt_->fragment_size) {
+      throw std::invalid_argument("Fragmentation needs packet version 2!");
+    }
+  }
   hrpc_opt_->hudp_options = hudp_opt_builder_.Build();
   return *hrpc_opt_;
 }
@@ -101,6 +128,108 @@ OptionsBuilder& OptionsBuilder::WorkerQueueSize(size_t num)
   return *this;
 }
 
+// RpcCore options
+
+OptionsBuilder& OptionsBuilder::PacketVersion(size_t ver)
+{
+  if (ver < kHyperRpcMinPacketVer || ver > kHyperRpcPacketVer) {
+    throw std::invalid_argument("Invalid packet version!");
+  }
+  hrpc_opt_->packet_version = ver;
+  return *this;
+}
+
+static CompressOption MakeCompressOption(CompressType type, size_t threshold)
+{
+  if (type != kNoCompress && type != kLz4 && type != kZstd) {
+    throw std::invalid_argument("Invalid compression type!");
+  }
+  if (threshold > kMaxRawBodySize) {
+    throw std::invalid_argument("Invalid compression threshold!");
+  }
+  CompressOption compress_opt;
+  compress_opt.type = type;
+  compress_opt.threshold = threshold;
+  return compress_opt;
+}
+
+OptionsBuilder& OptionsBuilder::Compression(CompressType type,
+                                            size_t threshold)
+{
+  hrpc_opt_->compression = MakeCompressOption(type, threshold);
+  return *this;
+}
+
+OptionsBuilder& OptionsBuilder::MethodCompression(const std::string& method,
+                                                  CompressType type,
+                                                  size_t threshold)
+{
+  hrpc_opt_->method_compression[method] = MakeCompressOption(type,
+                                                             threshold);
+  return *this;
+}
+
+OptionsBuilder& OptionsBuilder::PacketBatching(size_t max_bytes,
+                                               size_t max_delay_us)
+{
+  if (max_bytes > kMaxDatagramSize) {
+    throw std::invalid_argument("Invalid batch size!");
+  }
+  if (max_delay_us > std::numeric_limits<uint32_t>::max()) {
+    throw std::invalid_argument("Invalid batch delay!");
+  }
+  hrpc_opt_->batch_max_bytes = max_bytes;
+  hrpc_opt_->batch_max_delay_us = max_delay_us;
+  return *this;
+}
+
+OptionsBuilder& OptionsBuilder::FragmentSize(size_t size)
+{
+  if (size != 0 && (size < kMinFragmentSize || size > kMaxDatagramSize)) {
+    throw std::invalid_argument("Invalid fragment size!");
+  }
+  hrpc_opt_->fragment_size = size;
+  return *this;
+}
+
+OptionsBuilder& OptionsBuilder::Reassembly(size_t timeout_ms,
+                                           size_t max_bytes)
+{
+  if (timeout_ms > std::numeric_limits<uint32_t>::max() || timeout_ms <= 0) {
+    throw std::invalid_argument("Invalid timeout value!");
+  }
+  if (max_bytes == 0) {
+    throw std::invalid_argument("Invalid reassembly memory limit!");
+  }
+  hrpc_opt_->reassembly_timeout = timeout_ms;
+  hrpc_opt_->max_reassembly_bytes = max_bytes;
+  return *this;
+}
+
+OptionsBuilder& OptionsBuilder::ArenaBlockSize(size_t min_size,
+                                               size_t max_size)
+{
+  if (min_size == 0 || min_size > max_size ||
+      max_size > std::numeric_limits<uint32_t>::max()) {
+    throw std::invalid_argument("Invalid arena block size!");
+  }
+  hrpc_opt_->arena_block_min = min_size;
+  hrpc_opt_->arena_block_max = max_size;
+  return *this;
+}
+
+OptionsBuilder& OptionsBuilder::RouteCache(size_t ttl_ms,
+                                           size_t negative_ttl_ms)
+{
+  if (ttl_ms > std::numeric_limits<uint32_t>::max() ||
+      negative_ttl_ms > std::numeric_limits<uint32_t>::max()) {
+    throw std::invalid_argument("Invalid ttl value!");
+  }
+  hrpc_opt_->route_cache_ttl = ttl_ms;
+  hrpc_opt_->route_cache_negative_ttl = negative_ttl_ms;
+  return *this;
+}
+
 // RpcSessionManager options
 
 OptionsBuilder& OptionsBuilder::MaxRpcSessions(size_t num)
@@ -121,4 +250,90 @@ OptionsBuilder& OptionsBuilder::DefaultRpcTimeout(size_t ms)
   return *this;
 }
 
+OptionsBuilder& OptionsBuilder::HugePagePools(bool enable)
+{
+  hrpc_opt_->huge_page_pools = enable;
+  return *this;
+}
+
+OptionsBuilder& OptionsBuilder::SessionShrinkDelay(size_t ms)
+{
+  if (ms > std::numeric_limits<uint32_t>::max()) {
+    throw std::invalid_argument("Invalid delay value!");
+  }
+  hrpc_opt_->session_shrink_delay = ms;
+  return *this;
+}
+
+OptionsBuilder& OptionsBuilder::Hedging(size_t delay_ms, size_t percentile)
+{
+  if (delay_ms > std::numeric_limits<uint32_t>::max()) {
+    throw std::invalid_argument("Invalid delay value!");
+  }
+  if (percentile >= 100) {
+    throw std::invalid_argument("Invalid percentile value!");
+  }
+  hrpc_opt_->hedge_delay_ms = delay_ms;
+  hrpc_opt_->hedge_percentile = percentile;
+  return *this;
+}
+
+OptionsBuilder& OptionsBuilder::RetryBudget(size_t percent, size_t burst)
+{
+  if (percent > 100) {
+    throw std::invalid_argument("Invalid percent value!");
+  }
+  if (percent > 0 && burst == 0) {
+    throw std::invalid_argument("Invalid burst value!");
+  }
+  hrpc_opt_->retry_budget_percent = percent;
+  hrpc_opt_->retry_budget_burst = burst;
+  return *this;
+}
+
+static uint8_t CheckLbPolicy(LbPolicy policy)
+{
+  if (policy != kRoutedOrder && policy != kRoundRobin &&
+      policy != kPowerOfTwoChoices && policy != kLeastOutstanding) {
+    throw std::invalid_argument("Invalid load balancing policy!");
+  }
+  return static_cast<uint8_t>(policy);
+}
+
+OptionsBuilder& OptionsBuilder::LoadBalancing(LbPolicy policy)
+{
+  hrpc_opt_->lb_policy = CheckLbPolicy(policy);
+  return *this;
+}
+
+OptionsBuilder& OptionsBuilder::ServiceLoadBalancing(
+                                const std::string& service,
+                                LbPolicy policy)
+{
+  hrpc_opt_->service_lb_policy[service] = CheckLbPolicy(policy);
+  return *this;
+}
+
+OptionsBuilder& OptionsBuilder::MethodHashRouting(const std::string& method,
+                                                  const std::string& key_path,
+                                                  double load_factor)
+{
+  auto method_desc = google::protobuf::DescriptorPool::generated_pool()
+                     ->FindMethodByName(method);
+  if (!method_desc) {
+    throw std::invalid_argument("Invalid method name!");
+  }
+  std::vector<const google::protobuf::FieldDescriptor*> fields;
+  if (!RequestKey::Resolve(method_desc->input_type(), key_path, &fields)) {
+    throw std::invalid_argument("Invalid key path!");
+  }
+  if (load_factor != 0 && !(load_factor >= 1)) {
+    throw std::invalid_argument("Invalid load factor!");
+  }
+  HashRoutingOption& hash_opt = hrpc_opt_->method_hash_routing[method];
+  hash_opt.key_path = key_path;
+  hash_opt.load_factor = load_factor;
+  return *this;
+}
+
 } // namespace hrpc
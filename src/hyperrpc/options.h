@@ -30,11 +30,29 @@
 #ifndef _HRPC_OPTIONS_H
 #define _HRPC_OPTIONS_H
 
+#include <map>
+#include <string>
 #include <hyperudp/options.h>
 #include "hyperrpc/hyperrpc.h"
 
 namespace hrpc {
 
+/* Payload compression setting, type is value of CompressType
+ */
+struct CompressOption
+{
+  uint8_t type = 0;
+  size_t threshold = 0;
+};
+
+/* Consistent hashing of a method, see OptionsBuilder::MethodHashRouting
+ */
+struct HashRoutingOption
+{
+  std::string key_path;
+  double load_factor = 0;
+};
+
 class Options
 {
 public:
@@ -46,9 +64,42 @@ public:
   // HyperUdp options
   hudp::Options hudp_options;
 
+  // RpcCore options
+  size_t packet_version = 0;
+  CompressOption compression;
+  // full method name => compression overriding the one above
+  std::map<std::string, CompressOption> method_compression;
+  // packet batching is disabled if batch_max_bytes is 0
+  size_t batch_max_bytes = 0;
+  size_t batch_max_delay_us = 0;
+  // messages are not fragmented if fragment_size is 0
+  size_t fragment_size = 0;
+  size_t reassembly_timeout = 0;
+  size_t max_reassembly_bytes = 0;
+  // bounds of initial Arena block of incoming RPCs
+  size_t arena_block_min = 0;
+  size_t arena_block_max = 0;
+  // routes are not cached if route_cache_ttl is 0
+  size_t route_cache_ttl = 0;
+  size_t route_cache_negative_ttl = 0;
+
   // RpcSessionManager options
   size_t max_rpc_sessions = 0;
+  bool huge_page_pools = false;
+  // segments of session pools are kept if session_shrink_delay is 0
+  size_t session_shrink_delay = 0;
   size_t default_rpc_timeout = 0;
+  // requests are not hedged if both are 0
+  size_t hedge_delay_ms = 0;
+  size_t hedge_percentile = 0;
+  // retries are not limited if retry_budget_percent is 0
+  size_t retry_budget_percent = 0;
+  size_t retry_budget_burst = 0;
+  // value of LbPolicy, and full service name => policy overriding it
+  uint8_t lb_policy = 0;
+  std::map<std::string, uint8_t> service_lb_policy;
+  // full method name => consistent hashing overriding load balancing
+  std::map<std::string, HashRoutingOption> method_hash_routing;
 };
 
 } // namespace hrpc
@@ -0,0 +1,181 @@
+/* Copyright (c) 2016, Bin Wei <bin@vip.qq.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of of its contributors may not be used to endorse or 
+ * promote products derived from this software without specific prior 
+ * written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include "hyperrpc/packet_batcher.h"
+#include "hyperrpc/constants.h"
+
+namespace hrpc {
+
+constexpr uint64_t PacketBatcher::kBatchContextFlag;
+constexpr size_t PacketBatcher::kSweepTicks;
+
+PacketBatcher::PacketBatcher(const Env& env)
+  : env_(env)
+  , max_bytes_(env.opt().batch_max_bytes)
+  // timer-wheel ticks in milliseconds
+  , max_delay_ticks_((env.opt().batch_max_delay_us + 999) / 1000)
+  , batch_ctx_base_(kBatchContextFlag)
+  , batch_ctx_seq_(0)
+{
+}
+
+PacketBatcher::~PacketBatcher()
+{
+  for (auto& kv : batches_) {
+    if (kv.second.buf) {
+      env_.alloc().Free(kv.second.buf, max_bytes_);
+    }
+  }
+}
+
+bool PacketBatcher::Init(size_t rpc_core_id, OnFlush on_flush)
+{
+  on_flush_ = on_flush;
+  // batch context carries rpc_core_id the same way as rpc_id
+  batch_ctx_base_ = kBatchContextFlag
+                  | ((rpc_core_id + 1) << kRpcIdSeqPartBits);
+  if (!enabled()) {
+    return true;
+  }
+  return env_.timerw()->AddPeriodTimer(
+              kSweepTicks,
+              ccb::BindClosure(this, &PacketBatcher::OnSweep),
+              &sweep_timer_owner_);
+}
+
+static inline uint64_t BatchKey(const Addr& addr, size_t dst_core)
+{
+  return (static_cast<uint64_t>(addr.ip()) << 32)
+       | (static_cast<uint64_t>(addr.port()) << 16)
+       | (dst_core & 0xffff);
+}
+
+void PacketBatcher::Add(const Buf& pkt, const Addr& addr, void* ctx,
+                        size_t dst_core)
+{
+  if (pkt.len() > max_bytes_) {
+    // too large to be batched
+    on_flush_(pkt, addr, ctx);
+    return;
+  }
+  Batch& batch = batches_[BatchKey(addr, dst_core)];
+  if (batch.len + pkt.len() > max_bytes_) {
+    // the delay of next batch starts from its first packet
+    batch.timer_owner.Cancel();
+    FlushBatch(&batch);
+  }
+  if (batch.count == 0) {
+    batch.addr = addr;
+    batch.buf = static_cast<char*>(env_.alloc().Alloc(max_bytes_));
+    if (max_delay_ticks_ > 0) {
+      if (!batch.timer_owner.has_timer()) {
+        env_.timerw()->AddTimer(
+             max_delay_ticks_,
+             ccb::BindClosure(this, &PacketBatcher::FlushBatch, &batch),
+             &batch.timer_owner);
+      } else {
+        env_.timerw()->ResetTimer(batch.timer_owner, max_delay_ticks_);
+      }
+    } else if (!batch.pending) {
+      batch.pending = true;
+      pending_batches_.push_back(&batch);
+    }
+  }
+  memcpy(batch.buf + batch.len, pkt.ptr(), pkt.len());
+  batch.len += pkt.len();
+  batch.count++;
+  if (ctx) {
+    batch.rpc_ids.push_back(reinterpret_cast<uint64_t>(ctx));
+  }
+}
+
+void PacketBatcher::Flush()
+{
+  // more batches may get pending while flushing
+  while (!pending_batches_.empty()) {
+    std::vector<Batch*> batches;
+    batches.swap(pending_batches_);
+    for (Batch* batch : batches) {
+      batch->pending = false;
+      FlushBatch(batch);
+    }
+  }
+}
+
+void PacketBatcher::FlushBatch(Batch* batch)
+{
+  if (batch->count == 0) {
+    return;
+  }
+  void* ctx = nullptr;
+  if (batch->count == 1 && !batch->rpc_ids.empty()) {
+    ctx = reinterpret_cast<void*>(batch->rpc_ids[0]);
+  } else if (!batch->rpc_ids.empty()) {
+    uint64_t batch_ctx = batch_ctx_base_ | (batch_ctx_seq_++
+                       & ((1UL << kRpcIdSeqPartBits) - 1));
+    sent_batches_[batch_ctx].swap(batch->rpc_ids);
+    ctx = reinterpret_cast<void*>(batch_ctx);
+  }
+  batch->rpc_ids.clear();
+  // reset the batch first as packets may be added while flushing
+  Buf datagram{batch->buf, batch->len};
+  Addr addr = batch->addr;
+  batch->buf = nullptr;
+  batch->len = 0;
+  batch->count = 0;
+  on_flush_(datagram, addr, ctx);
+  env_.alloc().Free(const_cast<void*>(datagram.ptr()), max_bytes_);
+}
+
+void PacketBatcher::OnSweep()
+{
+  // batches flushed have no timers pending, and are safe to drop here
+  for (auto it = batches_.begin(); it != batches_.end(); ) {
+    if (it->second.count == 0 && !it->second.pending) {
+      it = batches_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+std::vector<uint64_t> PacketBatcher::TakeBatch(void* batch_ctx)
+{
+  std::vector<uint64_t> rpc_ids;
+  auto it = sent_batches_.find(reinterpret_cast<uint64_t>(batch_ctx));
+  if (it != sent_batches_.end()) {
+    rpc_ids.swap(it->second);
+    sent_batches_.erase(it);
+  }
+  return rpc_ids;
+}
+
+} // namespace hrpc
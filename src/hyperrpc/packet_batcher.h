@@ -0,0 +1,120 @@
+/* Copyright (c) 2016, Bin Wei <bin@vip.qq.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of of its contributors may not be used to endorse or 
+ * promote products derived from this software without specific prior 
+ * written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _HRPC_PACKET_BATCHER_H
+#define _HRPC_PACKET_BATCHER_H
+
+#include <unordered_map>
+#include <vector>
+#include <ccbase/timer_wheel.h>
+#include "hyperrpc/env.h"
+
+namespace hrpc {
+
+/* Coalesces packets to the same destination into one datagram
+ *
+ * Packets are self-delimiting by RpcPacketHeader, so a datagram is simply
+ * their concatenation. Requests and responses of each destination rpc_core
+ * are batched apart, thus a datagram received can be dispatched as a whole.
+ * A batch is flushed when the next packet does not fit in max_bytes, when
+ * max_delay expires or by Flush().
+ *
+ * Send contexts of packets batched are kept by the batcher and looked up by
+ * the batch context handed to HyperUdp, see TakeBatch().
+ *
+ * Batches of destinations are dropped by a periodic sweep once flushed,
+ * so that idle destinations are not kept.
+ */
+class PacketBatcher
+{
+public:
+  using OnFlush = ccb::ClosureFunc<void(const Buf&, const Addr&, void*)>;
+
+  PacketBatcher(const Env& env);
+  ~PacketBatcher();
+
+  bool Init(size_t rpc_core_id, OnFlush on_flush);
+  bool enabled() const {
+    return max_bytes_ > 0;
+  }
+  // ctx is nullptr or a rpc_id, dst_core is 0 for requests or rpc_core_id
+  // plus 1 of responses
+  void Add(const Buf& pkt, const Addr& addr, void* ctx, size_t dst_core);
+  void Flush();
+
+  static bool IsBatchContext(void* ctx) {
+    return reinterpret_cast<uint64_t>(ctx) & kBatchContextFlag;
+  }
+  // send contexts of packets in the batch, which is forgotten then
+  std::vector<uint64_t> TakeBatch(void* batch_ctx);
+  // number of destinations with batches kept
+  size_t batch_num() const {
+    return batches_.size();
+  }
+
+private:
+  static constexpr uint64_t kBatchContextFlag = 1UL << 63;
+  static constexpr size_t kSweepTicks = 1000;
+
+  struct Batch {
+    Batch() : buf(nullptr), len(0), count(0), pending(false) {}
+    Addr addr;
+    char* buf;
+    size_t len;
+    size_t count;
+    bool pending; // in pending_batches_
+    std::vector<uint64_t> rpc_ids;
+    ccb::TimerOwner timer_owner;
+  };
+
+  void FlushBatch(Batch* batch);
+  void OnSweep();
+
+  // not copyable and movable
+  PacketBatcher(const PacketBatcher&) = delete;
+  void operator=(const PacketBatcher&) = delete;
+  PacketBatcher(PacketBatcher&&) = delete;
+  void operator=(PacketBatcher&&) = delete;
+
+  const Env& env_;
+  size_t max_bytes_;
+  size_t max_delay_ticks_;
+  OnFlush on_flush_;
+  uint64_t batch_ctx_base_;
+  uint64_t batch_ctx_seq_;
+  std::unordered_map<uint64_t, Batch> batches_;
+  std::vector<Batch*> pending_batches_;
+  std::unordered_map<uint64_t, std::vector<uint64_t>> sent_batches_;
+  ccb::TimerOwner sweep_timer_owner_;
+};
+
+} // namespace hrpc
+
+#endif // _HRPC_PACKET_BATCHER_H
@@ -0,0 +1,111 @@
+/* Copyright (c) 2016, Bin Wei <bin@vip.qq.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of of its contributors may not be used to endorse or 
+ * promote products derived from this software without specific prior 
+ * written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#include "hyperrpc/pool_memory.h"
+
+namespace hrpc {
+
+PoolMemory::PoolMemory()
+  : ptr_(nullptr)
+  , len_(0)
+  , mapped_len_(0)
+  , huge_page_(false)
+{
+}
+
+PoolMemory::~PoolMemory()
+{
+  Unmap();
+}
+
+bool PoolMemory::Map(size_t len, bool huge_page)
+{
+  Unmap();
+  if (len == 0) {
+    return true;
+  }
+  void* ptr = MAP_FAILED;
+  size_t mapped_len = len;
+  if (huge_page) {
+    // fails if no huge page is reserved, see /proc/sys/vm/nr_hugepages
+    mapped_len = (len + kHugePageSize - 1) & ~(kHugePageSize - 1);
+    ptr = mmap(nullptr, mapped_len, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE,
+               -1, 0);
+    huge_page_ = (ptr != MAP_FAILED);
+  }
+  if (ptr == MAP_FAILED) {
+    mapped_len = len;
+    ptr = mmap(nullptr, mapped_len, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | (huge_page ? 0 : MAP_POPULATE),
+               -1, 0);
+    if (ptr == MAP_FAILED) {
+      return false;
+    }
+    if (huge_page) {
+      // advise before faulting in, so that pages are merged at once
+      madvise(ptr, mapped_len, MADV_HUGEPAGE);
+      long page_size = sysconf(_SC_PAGESIZE);
+      for (size_t off = 0; off < mapped_len; off += page_size) {
+        static_cast<volatile char*>(ptr)[off] = 0;
+      }
+    }
+  }
+  ptr_ = ptr;
+  len_ = len;
+  mapped_len_ = mapped_len;
+  return true;
+}
+
+void PoolMemory::Unmap()
+{
+  if (ptr_) {
+    munmap(ptr_, mapped_len_);
+    ptr_ = nullptr;
+    len_ = 0;
+    mapped_len_ = 0;
+    huge_page_ = false;
+  }
+}
+
+bool PoolMemory::MoveToLocalNode()
+{
+  if (!ptr_) {
+    return true;
+  }
+  // fails without NUMA support, in which case nothing is to be moved
+  return syscall(SYS_mbind, ptr_, mapped_len_, MPOL_LOCAL,
+                 nullptr, 0UL, MPOL_MF_MOVE) == 0;
+}
+
+} // namespace hrpc
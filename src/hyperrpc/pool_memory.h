@@ -0,0 +1,133 @@
+/* Copyright (c) 2016, Bin Wei <bin@vip.qq.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of of its contributors may not be used to endorse or 
+ * promote products derived from this software without specific prior 
+ * written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _HRPC_POOL_MEMORY_H
+#define _HRPC_POOL_MEMORY_H
+
+#include <stddef.h>
+#include <new>
+
+namespace hrpc {
+
+/* Memory of large per-core tables mapped out of the heap
+ *
+ * With huge_page, it is backed by 2MB huge pages if any is reserved, or
+ * else by normal pages advised to be merged into transparent huge pages.
+ * All pages are faulted in when mapped, so that they cost nothing later.
+ */
+class PoolMemory
+{
+public:
+  static constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+
+  PoolMemory();
+  ~PoolMemory();
+
+  bool Map(size_t len, bool huge_page);
+  void Unmap();
+  // migrate pages to the NUMA node of the calling thread
+  bool MoveToLocalNode();
+
+  void* ptr() const {
+    return ptr_;
+  }
+  size_t len() const {
+    return len_;
+  }
+  // whether it is backed by reserved huge pages
+  bool huge_page() const {
+    return huge_page_;
+  }
+
+private:
+  // not copyable and movable
+  PoolMemory(const PoolMemory&) = delete;
+  void operator=(const PoolMemory&) = delete;
+  PoolMemory(PoolMemory&&) = delete;
+  void operator=(PoolMemory&&) = delete;
+
+  void* ptr_;
+  size_t len_;
+  size_t mapped_len_;
+  bool huge_page_;
+};
+
+/* Fixed size array of T in PoolMemory
+ */
+template <class T>
+class PoolArray
+{
+public:
+  PoolArray() : size_(0) {}
+  ~PoolArray() {
+    Reset();
+  }
+
+  bool Init(size_t size, bool huge_page) {
+    Reset();
+    if (!mem_.Map(size * sizeof(T), huge_page)) {
+      return false;
+    }
+    T* array = get();
+    for (size_t i = 0; i < size; i++) {
+      new (&array[i]) T();
+    }
+    size_ = size;
+    return true;
+  }
+  void Reset() {
+    T* array = get();
+    for (size_t i = 0; i < size_; i++) {
+      array[i].~T();
+    }
+    size_ = 0;
+    mem_.Unmap();
+  }
+
+  T& operator[](size_t i) const {
+    return get()[i];
+  }
+  T* get() const {
+    return static_cast<T*>(mem_.ptr());
+  }
+  size_t size() const {
+    return size_;
+  }
+  PoolMemory& memory() {
+    return mem_;
+  }
+
+private:
+  PoolMemory mem_;
+  size_t size_;
+};
+
+} // namespace hrpc
+
+#endif // _HRPC_POOL_MEMORY_H
@@ -30,6 +30,8 @@
 #ifndef _HRPC_PROTOCOL_H
 #define _HRPC_PROTOCOL_H
 
+#include <stdint.h>
+
 namespace hrpc {
 
 struct RpcPacketHeader
@@ -40,6 +42,65 @@ struct RpcPacketHeader
   uint32_t rpc_body_len;
 };
 
+enum RpcPacketType : uint8_t
+{
+  kRequestPacket = 0,
+  kResponsePacket = 1,
+};
+
+/* RpcHeader of packet version 2 (little-endian)
+ *
+ * Extension fields, if any, follow in the order of their flag bits and are
+ * included in rpc_header_len. Unknown trailing bytes are ignored.
+ */
+struct RpcHeaderV2
+{
+  uint8_t packet_type;
+  uint8_t rpc_result;
+  uint16_t flags;
+  uint32_t method_id;
+  uint64_t rpc_id;
+};
+
+/* Flags of RpcHeaderV2, new extension fields must use higher bits so that
+ * old receivers can ignore them as trailing bytes
+ */
+enum RpcHeaderFlag : uint16_t
+{
+  kCompressedFlag = 0x0001, // followed by RpcCompressExt
+  kFragmentFlag = 0x0002,   // followed by RpcFragmentExt
+  kDeadlineFlag = 0x0004,   // followed by RpcDeadlineExt
+};
+
+/* Extension of kCompressedFlag, the body is compressed by compress_type
+ * (value of CompressType) and raw_body_len is its size before compression
+ */
+struct RpcCompressExt
+{
+  uint8_t compress_type;
+  uint8_t reserved[3];
+  uint32_t raw_body_len;
+};
+
+/* Extension of kFragmentFlag, the body is a slice of the message body
+ * starting at frag_offset, and all fragments share the same RpcHeaderV2
+ */
+struct RpcFragmentExt
+{
+  uint32_t total_body_len;
+  uint32_t frag_offset;
+  uint16_t frag_index;
+  uint16_t frag_count;
+};
+
+/* Extension of kDeadlineFlag, the time budget left by caller when the
+ * request is sent, which is relative as clocks of hosts differ
+ */
+struct RpcDeadlineExt
+{
+  uint32_t timeout_ms;
+};
+
 } // namespace hrpc
 
 #endif // _HRPC_PROTOCOL_H
@@ -0,0 +1,73 @@
+/* Copyright (c) 2016, Bin Wei <bin@vip.qq.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of of its contributors may not be used to endorse or 
+ * promote products derived from this software without specific prior 
+ * written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _HRPC_RETRY_BUDGET_H
+#define _HRPC_RETRY_BUDGET_H
+
+#include <stddef.h>
+#include <algorithm>
+
+namespace hrpc {
+
+/* Token bucket limiting retries to a percentage of first attempts
+ *
+ * Each first attempt deposits percent/100 of a token and each retry takes
+ * one, so retries are at most the percentage of first attempts in the long
+ * run, while bursts are bounded by max_retries. The bucket starts full.
+ */
+class RetryBudget
+{
+public:
+  RetryBudget(size_t percent, size_t max_retries);
+  ~RetryBudget();
+
+  void OnFirstAttempt() {
+    tokens_ = std::min(tokens_ + percent_, max_tokens_);
+  }
+  // return false if the budget is exhausted
+  bool TryRetry() {
+    if (tokens_ < kTokenUnit) {
+      return false;
+    }
+    tokens_ -= kTokenUnit;
+    return true;
+  }
+
+private:
+  // tokens are counted in 1/100 to keep percentages exact
+  static constexpr size_t kTokenUnit = 100;
+
+  size_t percent_;
+  size_t max_tokens_;
+  size_t tokens_;
+};
+
+} // namespace hrpc
+
+#endif // _HRPC_RETRY_BUDGET_H
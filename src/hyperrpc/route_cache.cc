@@ -0,0 +1,116 @@
+/* Copyright (c) 2016, Bin Wei <bin@vip.qq.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of of its contributors may not be used to endorse or 
+ * promote products derived from this software without specific prior 
+ * written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <google/protobuf/descriptor.h>
+#include "hyperrpc/route_cache.h"
+
+namespace hrpc {
+
+RouteCache::RouteCache()
+{
+}
+
+RouteCache::~RouteCache()
+{
+  Clear();
+}
+
+bool RouteCache::Find(const google::protobuf::MethodDescriptor* method,
+                      uint64_t key, uint64_t now_ms,
+                      EndpointSet** endpoints) const
+{
+  auto it = entries_.find({method, key});
+  if (it == entries_.end() || it->second.expire_ms <= now_ms) {
+    return false;
+  }
+  *endpoints = it->second.endpoints;
+  return true;
+}
+
+void RouteCache::Add(const google::protobuf::MethodDescriptor* method,
+                     uint64_t key, EndpointSet* endpoints,
+                     uint64_t expire_ms, uint64_t now_ms)
+{
+  if (entries_.size() >= kMaxEntries) {
+    for (auto it = entries_.begin(); it != entries_.end(); ) {
+      if (it->second.expire_ms <= now_ms) {
+        it = Erase(it);
+      } else {
+        ++it;
+      }
+    }
+    if (entries_.size() >= kMaxEntries) {
+      Clear();
+    }
+  }
+  if (endpoints) {
+    endpoints->AddRef();
+  }
+  auto result = entries_.insert({{method, key}, {endpoints, expire_ms}});
+  if (!result.second) {
+    Entry& entry = result.first->second;
+    if (entry.endpoints) {
+      entry.endpoints->Release();
+    }
+    entry.endpoints = endpoints;
+    entry.expire_ms = expire_ms;
+  }
+}
+
+void RouteCache::Invalidate(const std::string& service)
+{
+  if (service.empty()) {
+    Clear();
+    return;
+  }
+  for (auto it = entries_.begin(); it != entries_.end(); ) {
+    if (it->first.method->service()->full_name() == service) {
+      it = Erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+RouteCache::EntryMap::iterator RouteCache::Erase(EntryMap::iterator it)
+{
+  if (it->second.endpoints) {
+    it->second.endpoints->Release();
+  }
+  return entries_.erase(it);
+}
+
+void RouteCache::Clear()
+{
+  for (auto it = entries_.begin(); it != entries_.end(); ) {
+    it = Erase(it);
+  }
+}
+
+} // namespace hrpc
@@ -0,0 +1,105 @@
+/* Copyright (c) 2016, Bin Wei <bin@vip.qq.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of of its contributors may not be used to endorse or 
+ * promote products derived from this software without specific prior 
+ * written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _HRPC_ROUTE_CACHE_H
+#define _HRPC_ROUTE_CACHE_H
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include "hyperrpc/hyperrpc.h"
+#include "hyperrpc/endpoint_set.h"
+
+namespace hrpc {
+
+/* Per worker thread cache of endpoints resolved by OnServiceRouting
+ *
+ * Entries are keyed by method and an optional key of the request. They
+ * reference endpoint sets interned by RpcSessionManager of the same thread,
+ * so that hits are not interned again, and nullptr stands for a cached
+ * failure of routing.
+ */
+class RouteCache
+{
+public:
+  RouteCache();
+  ~RouteCache();
+
+  // return false if not cached or expired
+  bool Find(const google::protobuf::MethodDescriptor* method, uint64_t key,
+            uint64_t now_ms, EndpointSet** endpoints) const;
+  // @endpoints is referenced by the entry if not nullptr
+  void Add(const google::protobuf::MethodDescriptor* method, uint64_t key,
+           EndpointSet* endpoints, uint64_t expire_ms, uint64_t now_ms);
+  // remove entries of methods of @service by full name, or all if it is
+  // empty
+  void Invalidate(const std::string& service);
+
+  size_t size() const {
+    return entries_.size();
+  }
+
+private:
+  // expired entries are purged when the limit is reached
+  static constexpr size_t kMaxEntries = 65536;
+
+  struct Key {
+    const google::protobuf::MethodDescriptor* method;
+    uint64_t key;
+    bool operator==(const Key& other) const {
+      return method == other.method && key == other.key;
+    }
+  };
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      return std::hash<const void*>()(key.method) ^
+             (key.key * 0x9e3779b97f4a7c15UL);
+    }
+  };
+  struct Entry {
+    EndpointSet* endpoints;
+    uint64_t expire_ms;
+  };
+  using EntryMap = std::unordered_map<Key, Entry, KeyHash>;
+
+  EntryMap::iterator Erase(EntryMap::iterator it);
+  void Clear();
+
+  // not copyable and movable
+  RouteCache(const RouteCache&) = delete;
+  void operator=(const RouteCache&) = delete;
+  RouteCache(RouteCache&&) = delete;
+  void operator=(RouteCache&&) = delete;
+
+  EntryMap entries_;
+};
+
+} // namespace hrpc
+
+#endif // _HRPC_ROUTE_CACHE_H
@@ -28,32 +28,44 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "hyperrpc/rpc_context.h"
+#include "hyperrpc/arena_block_alloc.h"
 
 namespace hrpc {
 
+thread_local uint64_t RpcDeadlineScope::tls_deadline_ms_ = 0;
+
 static google::protobuf::ArenaOptions BuildArenaOptions(char* init_block,
                                                         size_t block_size)
 {
   google::protobuf::ArenaOptions options;
   options.initial_block = init_block;
   options.initial_block_size = block_size;
+  // blocks beyond the initial one are cached by the worker thread
+  options.block_alloc = &ArenaBlockAlloc::Alloc;
+  options.block_dealloc = &ArenaBlockAlloc::Free;
   return options;
 }
 
 IncomingRpcContext::IncomingRpcContext(
-                        const google::protobuf::MethodDescriptor* method,
+                        MethodEntry* method,
                         uint64_t rpc_id,
-                        const Addr& addr)
+                        const Addr& addr,
+                        uint8_t pkt_ver)
   : method_(method)
   , request_(nullptr)
   , response_(nullptr)
   , rpc_id_(rpc_id)
   , addr_(addr)
+  , pkt_ver_(pkt_ver)
+  , request_len_(0)
+  , deadline_ms_(0)
 {
 }
 
 IncomingRpcContext::~IncomingRpcContext()
 {
+  delete request_;
+  delete response_;
 }
 
 void IncomingRpcContext::Init(const google::protobuf::Message& req_prot,
@@ -63,24 +75,61 @@ void IncomingRpcContext::Init(const google::protobuf::Message& req_prot,
   response_ = resp_prot.New();
 }
 
+void IncomingRpcContext::Recycle()
+{
+  request_len_ = 0;
+  deadline_ms_ = 0;
+  request_->Clear();
+  response_->Clear();
+}
+
+void IncomingRpcContext::Reuse(uint64_t rpc_id, const Addr& addr,
+                               uint8_t pkt_ver)
+{
+  rpc_id_ = rpc_id;
+  addr_ = addr;
+  pkt_ver_ = pkt_ver;
+}
+
 ArenaIncomingRpcContext::ArenaIncomingRpcContext(
-                           const google::protobuf::MethodDescriptor* method,
+                           MethodEntry* method,
                            uint64_t rpc_id,
-                           const Addr& addr)
-  : IncomingRpcContext(method, rpc_id, addr)
-  , arena_(BuildArenaOptions(arena_buf_, sizeof(arena_buf_)))
+                           const Addr& addr,
+                           uint8_t pkt_ver,
+                           size_t block_size)
+  : IncomingRpcContext(method, rpc_id, addr, pkt_ver)
+  , arena_buf_(new char[block_size])
+  , arena_buf_size_(block_size)
+  , arena_(BuildArenaOptions(arena_buf_.get(), arena_buf_size_))
+  , req_prot_(nullptr)
+  , resp_prot_(nullptr)
 {
 }
 
 ArenaIncomingRpcContext::~ArenaIncomingRpcContext()
 {
+  // messages are owned by the arena
+  request_ = nullptr;
+  response_ = nullptr;
 }
 
 void ArenaIncomingRpcContext::Init(const google::protobuf::Message& req_prot,
                                    const google::protobuf::Message& resp_prot)
 {
+  req_prot_ = &req_prot;
+  resp_prot_ = &resp_prot;
   request_ = req_prot.New(&arena_);
   response_ = resp_prot.New(&arena_);
 }
 
+void ArenaIncomingRpcContext::Recycle()
+{
+  request_len_ = 0;
+  deadline_ms_ = 0;
+  // blocks beyond the initial one are freed
+  arena_.Reset();
+  request_ = req_prot_->New(&arena_);
+  response_ = resp_prot_->New(&arena_);
+}
+
 } // namespace hrpc
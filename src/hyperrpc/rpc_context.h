@@ -30,25 +30,75 @@
 #ifndef _HRPC_RPC_CONTEXT_H
 #define _HRPC_RPC_CONTEXT_H
 
+#include <memory>
 #include <google/protobuf/arena.h>
 #include <google/protobuf/message.h>
 #include "hyperrpc/hyperrpc.h"
 #include "hyperrpc/constants.h"
+#include "hyperrpc/method_table.h"
 
 namespace hrpc {
 
+/* Deadline of the incoming RPC which the work running in current thread is
+ * done for, which is set while its service method is called and restored
+ * in done callbacks of calls issued by it, see RemainingRpcTime()
+ */
+class RpcDeadlineScope
+{
+public:
+  explicit RpcDeadlineScope(uint64_t deadline_ms)
+    : saved_deadline_ms_(tls_deadline_ms_) {
+    tls_deadline_ms_ = deadline_ms;
+  }
+  ~RpcDeadlineScope() {
+    tls_deadline_ms_ = saved_deadline_ms_;
+  }
+
+  // in Env::NowMs(), 0 means no deadline
+  static uint64_t deadline_ms() {
+    return tls_deadline_ms_;
+  }
+
+private:
+  static thread_local uint64_t tls_deadline_ms_;
+
+  // not copyable and movable
+  RpcDeadlineScope(const RpcDeadlineScope&) = delete;
+  void operator=(const RpcDeadlineScope&) = delete;
+  RpcDeadlineScope(RpcDeadlineScope&&) = delete;
+  void operator=(RpcDeadlineScope&&) = delete;
+
+  uint64_t saved_deadline_ms_;
+};
+
 class IncomingRpcContext
 {
 public:
-  IncomingRpcContext(const google::protobuf::MethodDescriptor* method,
+  IncomingRpcContext(MethodEntry* method,
                      uint64_t rpc_id,
-                     const Addr& addr);
+                     const Addr& addr,
+                     uint8_t pkt_ver = kHyperRpcPacketVer);
   virtual ~IncomingRpcContext();
 
   virtual void Init(const google::protobuf::Message& req_prot,
                     const google::protobuf::Message& resp_prot);
+  // called when returned to the free list, messages are cleared rather
+  // than allocated again for another RPC of the same method
+  virtual void Recycle();
+  // prepare for another RPC of the same method after Recycle()
+  void Reuse(uint64_t rpc_id, const Addr& addr, uint8_t pkt_ver);
+  // both are 0 if messages are not allocated in an Arena
+  virtual size_t ArenaSpaceUsed() const {
+    return 0;
+  }
+  virtual size_t ArenaBlockSize() const {
+    return 0;
+  }
 
   const google::protobuf::MethodDescriptor* method() const {
+    return method_->method;
+  }
+  MethodEntry* method_entry() const {
     return method_;
   }
   google::protobuf::Message* request() const {
@@ -63,29 +113,63 @@ public:
   const Addr& addr() const {
     return addr_;
   }
+  uint8_t pkt_ver() const {
+    return pkt_ver_;
+  }
+  // size of serialized request
+  size_t request_len() const {
+    return request_len_;
+  }
+  void set_request_len(size_t len) {
+    request_len_ = len;
+  }
+  // deadline of the caller in Env::NowMs(), 0 if there is none
+  uint64_t deadline_ms() const {
+    return deadline_ms_;
+  }
+  void set_deadline_ms(uint64_t deadline_ms) {
+    deadline_ms_ = deadline_ms;
+  }
 
 protected:
-  const google::protobuf::MethodDescriptor* method_;
+  MethodEntry* method_;
   google::protobuf::Message* request_;
   google::protobuf::Message* response_;
   uint64_t rpc_id_;
   Addr addr_;
+  uint8_t pkt_ver_;
+  size_t request_len_;
+  uint64_t deadline_ms_;
 };
 
 class ArenaIncomingRpcContext : public IncomingRpcContext
 {
 public:
-  ArenaIncomingRpcContext(const google::protobuf::MethodDescriptor* method,
+  ArenaIncomingRpcContext(MethodEntry* method,
                           uint64_t rpc_id,
-                          const Addr& addr);
+                          const Addr& addr,
+                          uint8_t pkt_ver = kHyperRpcPacketVer,
+                          size_t block_size = kArenaInitBufSize);
   virtual ~ArenaIncomingRpcContext();
 
   virtual void Init(const google::protobuf::Message& req_prot,
                     const google::protobuf::Message& resp_prot) override;
+  // the arena is reset and messages are created in it again
+  virtual void Recycle() override;
+  virtual size_t ArenaSpaceUsed() const override {
+    return arena_.SpaceUsed();
+  }
+  virtual size_t ArenaBlockSize() const override {
+    return arena_buf_size_;
+  }
 
 protected:
-  char arena_buf_[kArenaInitBufSize];
+  // initial block of the arena, sized per method by RpcCore
+  std::unique_ptr<char[]> arena_buf_;
+  size_t arena_buf_size_;
   google::protobuf::Arena arena_;
+  const google::protobuf::Message* req_prot_;
+  const google::protobuf::Message* resp_prot_;
 };
 
 class OutgoingRpcContext
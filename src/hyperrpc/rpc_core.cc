@@ -1,19 +1,37 @@
 #include <assert.h>
-#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <string.h>
+#include <algorithm>
 #include <google/protobuf/descriptor.pb.h>
 #include "hyperrpc/rpc_core.h"
 #include "hyperrpc/service.h"
 #include "hyperrpc/protocol.h"
 #include "hyperrpc/constants.h"
+#include "hyperrpc/compressor.h"
 #include "hyperrpc/rpc_context.h"
 #include "hyperrpc/route_info_builder.h"
-#include "hyperrpc/rpc_message.pb.h"
 
 namespace hrpc {
 
+int64_t RemainingRpcTime()
+{
+  uint64_t deadline_ms = RpcDeadlineScope::deadline_ms();
+  if (!deadline_ms) {
+    return -1;
+  }
+  uint64_t now_ms = Env::NowMs();
+  return now_ms < deadline_ms ? deadline_ms - now_ms : 0;
+}
+
 RpcCore::RpcCore(const Env& env)
   : env_(env)
   , rpc_sess_mgr_(env)
+  , method_table_(&env.opt())
+  , batcher_(env)
+  , fragment_assembler_(env)
+  , task_depth_(0)
+  , decompress_buf_size_(0)
+  , route_cache_hits_(0)
+  , route_cache_misses_(0)
 {
 }
 
@@ -23,21 +41,35 @@ RpcCore::~RpcCore()
 
 static size_t CalcSessionPoolSize(const Options& opt)
 {
-  size_t size_per_core = opt.max_rpc_sessions / opt.hudp_options.worker_num;
-  size_per_core = size_per_core * 10 / 9;
-  return size_per_core;
+  // sessions are allocated from a free list, so no room is reserved
+  return opt.max_rpc_sessions / opt.hudp_options.worker_num;
 }
 
 bool RpcCore::Init(size_t rpc_core_id, OnSendPacket on_send_pkt,
-                                   OnFindService on_find_svc,
-                                   OnServiceRouting on_svc_routing)
+                                   const std::vector<Service*>& services,
+                                   OnServiceRouting on_svc_routing,
+                                   OnRouteKey on_route_key)
 {
   rpc_core_id_ = rpc_core_id;
   on_send_packet_ = on_send_pkt;
-  on_find_service_ = on_find_svc;
   on_service_routing_ = on_svc_routing;
+  on_route_key_ = on_route_key;
+  if (!batcher_.Init(rpc_core_id, on_send_pkt)) {
+    ELOG("PacketBatcher init failed!");
+    return false;
+  }
+  if (!fragment_assembler_.Init()) {
+    ELOG("FragmentAssembler init failed!");
+    return false;
+  }
+  for (Service* svc : services) {
+    // method-id collisions have been checked by InitAsServer()
+    HRPC_ASSERT(method_table_.AddService(svc));
+  }
   if (!rpc_sess_mgr_.Init(CalcSessionPoolSize(env_.opt()), rpc_core_id,
-                     ccb::BindClosure(this, &RpcCore::OnOutgoingRpcSend))) {
+                     ccb::BindClosure(this, &RpcCore::OnOutgoingRpcEncode),
+                     ccb::BindClosure(this, &RpcCore::OnOutgoingRpcSend),
+                     ccb::BindClosure(this, &RpcCore::OnOutgoingRpcClone))) {
     ELOG("RpcSessionManager init failed!");
     return false;
   }
@@ -47,28 +79,132 @@ bool RpcCore::Init(size_t rpc_core_id, OnSendPacket on_send_pkt,
 void RpcCore::CallMethod(const ::google::protobuf::MethodDescriptor* method,
                          const ::google::protobuf::Message* request,
                          ::google::protobuf::Message* response,
+                         const CallOptions& call_opts,
                          ::ccb::ClosureFunc<void(Result)> done)
+{
+  TaskScope task_scope(this);
+  EndpointSet* endpoints;
+  CallOptions sess_opts = call_opts;
+  Result result = PrepareCall(method, *request, &endpoints, &sess_opts);
+  if (result != kSuccess) {
+    done(result);
+    return;
+  }
+  rpc_sess_mgr_.AddSession(method_table_.FindOrAdd(method), request, response,
+                           endpoints, sess_opts, std::move(done));
+  endpoints->Release();
+}
+
+void RpcCore::FanOutCall(
+              const ::google::protobuf::MethodDescriptor* method,
+              const std::vector<const ::google::protobuf::Message*>& requests,
+              const std::vector<::google::protobuf::Message*>& responses,
+              std::vector<Result>* results,
+              const CallOptions& call_opts,
+              ::ccb::ClosureFunc<void(Result)> done)
+{
+  TaskScope task_scope(this);
+  if (requests.empty()) {
+    done(kInError);
+    return;
+  }
+  // shards are routed once by the first request
+  EndpointSet* endpoints;
+  CallOptions sess_opts = call_opts;
+  Result result = PrepareCall(method, *requests[0], &endpoints, &sess_opts);
+  if (result != kSuccess) {
+    results->assign(responses.size(), result);
+    done(result);
+    return;
+  }
+  EndpointList route_buf;
+  for (size_t i = 0; i < endpoints->size(); i++) {
+    route_buf.PushBack(endpoints->GetEndpoint(i));
+  }
+  endpoints->Release();
+  rpc_sess_mgr_.AddFanOutSession(method_table_.FindOrAdd(method),
+                                 requests, responses, results,
+                                 route_buf, sess_opts, std::move(done));
+}
+
+Result RpcCore::ResolveRoute(const ::google::protobuf::MethodDescriptor* method,
+                             const ::google::protobuf::Message& request,
+                             EndpointSet** endpoints)
 {
   const std::string& service_name = method->service()->name();
   const std::string& method_name = method->name();
+  size_t ttl = env_.opt().route_cache_ttl;
+  uint64_t now_ms = env_.timerw()->GetCurrentTick();
+  uint64_t key = 0;
+  if (ttl) {
+    if (on_route_key_) {
+      key = on_route_key_(service_name, method_name, request);
+    }
+    if (route_cache_.Find(method, key, now_ms, endpoints)) {
+      route_cache_hits_.fetch_add(1, std::memory_order_relaxed);
+      // nullptr is a failure cached
+      if (!*endpoints) {
+        return kNoRoute;
+      }
+      (*endpoints)->AddRef();
+      return kSuccess;
+    }
+    route_cache_misses_.fetch_add(1, std::memory_order_relaxed);
+  }
   // resolve endpoints of service.method
-  EndpointList endpoints;
-  RouteInfoBuilderImpl builder(&endpoints);
+  route_endpoints_.Reset();
+  RouteInfoBuilderImpl builder(&route_endpoints_);
   if (!on_service_routing_ ||
-      !on_service_routing_(service_name, method_name, *request, &builder) ||
-      endpoints.empty()) {
+      !on_service_routing_(service_name, method_name, request, &builder)) {
+    route_endpoints_.Reset();
+  }
+  *endpoints = (route_endpoints_.empty() ? nullptr :
+                rpc_sess_mgr_.InternEndpoints(route_endpoints_));
+  if (ttl) {
+    size_t entry_ttl = (*endpoints ? ttl :
+                        env_.opt().route_cache_negative_ttl);
+    if (entry_ttl) {
+      route_cache_.Add(method, key, *endpoints, now_ms + entry_ttl, now_ms);
+    }
+  }
+  return *endpoints ? kSuccess : kNoRoute;
+}
+
+Result RpcCore::PrepareCall(const ::google::protobuf::MethodDescriptor* method,
+                            const ::google::protobuf::Message& request,
+                            EndpointSet** endpoints,
+                            CallOptions* call_opts)
+{
+  const std::string& service_name = method->service()->name();
+  const std::string& method_name = method->name();
+  if (ResolveRoute(method, request, endpoints) != kSuccess) {
     WLOG("cannot resolve endpoints for %s.%s", service_name.c_str(),
                                                method_name.c_str());
-    done(kNoRoute);
-    return;
+    return kNoRoute;
+  }
+  if (!call_opts->timeout_ms) {
+    call_opts->timeout_ms = env_.opt().default_rpc_timeout;
+  }
+  uint64_t deadline_ms = RpcDeadlineScope::deadline_ms();
+  if (deadline_ms) {
+    // inherit deadline of the incoming RPC being served
+    uint64_t now_ms = Env::NowMs();
+    if (now_ms >= deadline_ms) {
+      DLOG("no time left for %s.%s", service_name.c_str(),
+                                     method_name.c_str());
+      (*endpoints)->Release();
+      return kTimeout;
+    }
+    call_opts->timeout_ms = std::min<size_t>(call_opts->timeout_ms,
+                                             deadline_ms - now_ms);
   }
-  rpc_sess_mgr_.AddSession(method, request, response,
-                           endpoints, std::move(done));
+  return kSuccess;
 }
 
 inline bool RpcCore::GetCoreIdFromRpcId(uint64_t rpc_id, size_t* rpc_core_id)
 {
-  size_t rpc_core_id_plus_1 = rpc_id >> kRpcIdSeqPartBits;
+  // batch contexts carry rpc_core_id in the same bits
+  size_t rpc_core_id_plus_1 = (rpc_id & ~(1UL << 63)) >> kRpcIdSeqPartBits;
   if (rpc_core_id_plus_1 == 0 ||
       rpc_core_id_plus_1 > env_.opt().hudp_options.worker_num) {
     return false;
@@ -77,153 +213,558 @@ inline bool RpcCore::GetCoreIdFromRpcId(uint64_t rpc_id, size_t* rpc_core_id)
   return true;
 }
 
-size_t RpcCore::OnRecvPacket(const Buf& buf, const Addr& addr)
+size_t RpcCore::OnRecvPacket(const Buf& buf, const Addr& addr,
+                             uint64_t recv_ms)
+{
+  TaskScope task_scope(this);
+  size_t cur_rpc_core_id = rpc_core_id_;
+  // a datagram may carry several packets batched by peer, which are either
+  // requests or responses of the same rpc_core
+  const char* pkt_ptr = buf.char_ptr();
+  size_t left_len = buf.len();
+  do {
+    size_t pkt_len = 0;
+    size_t dst_rpc_core_id = OnRecvOnePacket(pkt_ptr, left_len, addr,
+                                             recv_ms, &pkt_len);
+    if (dst_rpc_core_id != cur_rpc_core_id) {
+      if (pkt_ptr == buf.char_ptr()) {
+        // redirect the whole datagram
+        return dst_rpc_core_id;
+      }
+      ILOG("packets of different rpc_core in one datagram!");
+    }
+    if (pkt_len == 0) {
+      break;
+    }
+    pkt_ptr += pkt_len;
+    left_len -= pkt_len;
+  } while (left_len > 0);
+  return cur_rpc_core_id;
+}
+
+size_t RpcCore::OnRecvOnePacket(const char* buf, size_t len,
+                                const Addr& addr, uint64_t recv_ms,
+                                size_t* pkt_len)
 {
   size_t cur_rpc_core_id = rpc_core_id_;
   // parse RpcPakcetHeader
-  if (buf.len() <= sizeof(RpcPacketHeader)) {
+  if (len <= sizeof(RpcPacketHeader)) {
     ILOG("packet len too short!");
     return cur_rpc_core_id;
   }
-  auto pkt_header = static_cast<const RpcPacketHeader*>(buf.ptr());
+  auto pkt_header = reinterpret_cast<const RpcPacketHeader*>(buf);
   if (pkt_header->hrpc_pkt_tag != kHyperRpcPacketTag) {
     ILOG("bad packet tag!");
     return cur_rpc_core_id;
   }
-  if (pkt_header->hrpc_pkt_ver != kHyperRpcPacketVer) {
+  uint8_t pkt_ver = pkt_header->hrpc_pkt_ver;
+  if (pkt_ver < kHyperRpcMinPacketVer || pkt_ver > kHyperRpcPacketVer) {
     ILOG("packet ver dismatch!");
     return cur_rpc_core_id;
   }
   size_t rpc_header_len = ntohs(pkt_header->rpc_header_len);
   size_t rpc_body_len = ntohl(pkt_header->rpc_body_len);
-  if (buf.len() != sizeof(RpcPacketHeader) + rpc_header_len + rpc_body_len) {
+  if (len < sizeof(RpcPacketHeader) + rpc_header_len + rpc_body_len) {
     ILOG("bad packet len!");
     return cur_rpc_core_id;
   }
-  const void* rpc_header_ptr = buf.char_ptr() + sizeof(RpcPacketHeader);
-  const void* rpc_body_ptr = static_cast<const char*>(rpc_header_ptr)
-                           + rpc_header_len;
+  *pkt_len = sizeof(RpcPacketHeader) + rpc_header_len + rpc_body_len;
+  const char* rpc_header_ptr = buf + sizeof(RpcPacketHeader);
+  const char* rpc_body_ptr = rpc_header_ptr + rpc_header_len;
   // parse RpcHeader
-  static thread_local RpcHeader rpc_header;
-  if (!rpc_header.ParseFromArray(rpc_header_ptr, rpc_header_len)) {
+  RpcMeta meta;
+  if (!RpcHeaderCodec::Decode(pkt_ver, rpc_header_ptr, rpc_header_len,
+                              &meta)) {
     ILOG("parse RpcHeader failed!");
     return cur_rpc_core_id;
   }
-  if (rpc_header.packet_type() == RpcHeader::REQUEST) {
-    // process REQUEST message in current thread
-    OnRecvRequestMessage(rpc_header, {rpc_body_ptr, rpc_body_len}, addr);
-  } else {
-    // process RESPONSE message in thread the rpc_id belongs
-    size_t rpc_core_id_plus_1 = rpc_header.rpc_id() >> kRpcIdSeqPartBits;
-    if (rpc_core_id_plus_1 == 0 ||
-        rpc_core_id_plus_1 > env_.opt().hudp_options.worker_num) {
-      ILOG("invalid rpc_core_id_plus_1:%lu!", rpc_core_id_plus_1);
+  // find the rpc_core which should process it
+  size_t dst_rpc_core_id = cur_rpc_core_id;
+  if (meta.packet_type == kResponsePacket) {
+    // RESPONSE is processed in thread the rpc_id belongs
+    if (!GetCoreIdFromRpcId(meta.rpc_id, &dst_rpc_core_id)) {
+      ILOG("invalid rpc_core_id in rpc_id:%lu!", meta.rpc_id);
       return cur_rpc_core_id;
     }
-    size_t dst_rpc_core_id = rpc_core_id_plus_1 - 1;
-    if (dst_rpc_core_id != cur_rpc_core_id) { // need redirect
-      DLOG("OnRecvPacket redirect to rpc_core_id:%lu", dst_rpc_core_id);
-      return dst_rpc_core_id;
+  } else if (meta.flags & kFragmentFlag) {
+    // fragments of REQUEST are gathered in thread decided by the message
+    dst_rpc_core_id = ((meta.rpc_id ^ addr.ip() ^ addr.port())
+                       * 0x9E3779B97F4A7C15UL >> 32)
+                    % env_.opt().hudp_options.worker_num;
+  }
+  if (dst_rpc_core_id != cur_rpc_core_id) { // need redirect
+    DLOG("OnRecvPacket redirect to rpc_core_id:%lu", dst_rpc_core_id);
+    return dst_rpc_core_id;
+  }
+  Buf body{rpc_body_ptr, rpc_body_len};
+  if (!(meta.flags & kFragmentFlag)) {
+    OnRecvMessage(pkt_ver, meta, body, addr, recv_ms);
+  } else if (fragment_assembler_.Add(meta, addr, body, &body)) {
+    // body is the whole message reassembled now
+    OnRecvMessage(pkt_ver, meta, body, addr, recv_ms);
+    fragment_assembler_.FreeMessage(body);
+  }
+  return cur_rpc_core_id;
+}
+
+void RpcCore::OnRecvMessage(uint8_t pkt_ver, const RpcMeta& meta,
+                            const Buf& body, const Addr& addr,
+                            uint64_t recv_ms)
+{
+  uint64_t deadline_ms = 0;
+  if (meta.packet_type == kRequestPacket && (meta.flags & kDeadlineFlag)) {
+    // time waited since received is charged to the budget
+    uint64_t now_ms = Env::NowMs();
+    deadline_ms = (recv_ms ? recv_ms : now_ms) + meta.timeout_ms;
+    if (now_ms >= deadline_ms) {
+      DRET("expired request of rpc_id:%lu dropped", meta.rpc_id);
     }
-    OnRecvResponseMessage(rpc_header, {rpc_body_ptr, rpc_body_len}, addr);
   }
-  return 0;
+  Buf raw_body = body;
+  if (!DecompressBody(meta, &raw_body)) {
+    IRET("decompress body of rpc_id:%lu failed!", meta.rpc_id);
+  }
+  if (meta.packet_type == kRequestPacket) {
+    OnRecvRequestMessage(pkt_ver, meta, raw_body, addr, deadline_ms);
+  } else {
+    OnRecvResponseMessage(meta, raw_body, addr);
+  }
+  if (decompress_buf_size_ > kMaxKeptDecompressBufSize) {
+    decompress_buf_.reset();
+    decompress_buf_size_ = 0;
+  }
 }
 
-void RpcCore::OnRecvRequestMessage(const RpcHeader& header,
-                                   const Buf& body, const Addr& addr)
+bool RpcCore::DecompressBody(const RpcMeta& meta, Buf* body)
 {
-  Service* service = on_find_service_(header.service_name());
-  if (!service) IRET("service requested not found locally!");
-  auto service_desc = service->GetDescriptor();
-  if (!service_desc) IRET("get service descriptor failed!");
-  auto method_desc = service_desc->FindMethodByName(header.method_name());
-  if (!method_desc) IRET("get method descriptor failed!");
-  auto& request_prot = service->GetRequestPrototype(method_desc);
-  auto& response_prot = service->GetResponsePrototype(method_desc);
+  if (!(meta.flags & kCompressedFlag)) {
+    return true;
+  }
+  // raw_body_len is told by the peer, so it is checked against what the
+  // body could be decompressed to before any memory is taken
+  if (meta.raw_body_len > kMaxRawBodySize ||
+      meta.raw_body_len > env_.opt().max_reassembly_bytes ||
+      meta.raw_body_len > Compressor::MaxDecompressedSize(meta.compress_type,
+                                                          body->len())) {
+    return false;
+  }
+  if (decompress_buf_size_ < meta.raw_body_len) {
+    decompress_buf_.reset(new char[meta.raw_body_len]);
+    decompress_buf_size_ = meta.raw_body_len;
+  }
+  if (!Compressor::Decompress(meta.compress_type, body->char_ptr(),
+                              body->len(), decompress_buf_.get(),
+                              meta.raw_body_len)) {
+    return false;
+  }
+  *body = Buf(decompress_buf_.get(), meta.raw_body_len);
+  return true;
+}
 
-  IncomingRpcContext* ctx;
-  if (!request_prot.GetDescriptor()->file()->options().cc_enable_arenas()) {
-    // if message is not arena enabled using Arena will be even slower
-    ctx = new IncomingRpcContext(method_desc, header.rpc_id(), addr);
-  } else {
-    ctx = new ArenaIncomingRpcContext(method_desc, header.rpc_id(), addr);
+void RpcCore::OnRecvRequestMessage(uint8_t pkt_ver, const RpcMeta& meta,
+                                   const Buf& body, const Addr& addr,
+                                   uint64_t deadline_ms)
+{
+  MethodEntry* method = method_table_.Find(meta.method_id);
+  if (!method || !method->service)
+    IRET("method requested not found locally!");
+  // names carried by version 1 tell apart methods of the same method-id
+  if (meta.service_name && meta.method_name &&
+      (*meta.service_name != method->method->service()->name() ||
+       *meta.method_name != method->method->name())) {
+    IRET("method %s.%s requested not found locally!",
+         meta.service_name->c_str(), meta.method_name->c_str());
   }
-  ctx->Init(request_prot, response_prot);
 
-  if (!ctx->request()->ParseFromArray(body.ptr(), body.len()))
+  IncomingRpcContext* ctx = AcquireIncomingContext(method, meta.rpc_id,
+                                                   addr, pkt_ver);
+  ctx->set_request_len(body.len());
+  if (!ctx->request()->ParseFromArray(body.ptr(), body.len())) {
+    ReleaseIncomingContext(ctx);
     IRET("parse Request message failed!");
+  }
 
-  // dispatch incoming rpc within receiving worker-thread
-  service->CallMethod(method_desc, ctx->request(), ctx->response(),
-               ccb::BindClosure(this, &RpcCore::OnIncomingRpcDone, ctx));
+  // dispatch incoming rpc within receiving worker-thread, with deadline
+  // exposed to the service method and calls issued there
+  ctx->set_deadline_ms(deadline_ms);
+  RpcDeadlineScope deadline_scope(ctx->deadline_ms());
+  // the closure only captures two pointers so that DoneFunc stores it
+  // inline, which is checked by RpcCoreTest.InlineDoneFunc
+  method->service->CallMethod(method->method,
+               ctx->request(), ctx->response(),
+               [this, ctx](Result result) { OnIncomingRpcDone(ctx, result); });
 }
 
-void RpcCore::OnRecvResponseMessage(const RpcHeader& header,
+void RpcCore::OnRecvResponseMessage(const RpcMeta& meta,
                                     const Buf& body, const Addr& addr)
 {
-  if (header.rpc_result() < 0 || header.rpc_result() > kMaxResultValue) {
+  if (meta.rpc_result < 0 || meta.rpc_result > kMaxResultValue) {
     ILOG("invalid rpc_result value!");
     return;
   }
-  Result rpc_result = static_cast<Result>(header.rpc_result());
-  rpc_sess_mgr_.OnRecvResponse(header.service_name(), header.method_name(),
-                               header.rpc_id(), rpc_result, body);
+  Result rpc_result = static_cast<Result>(meta.rpc_result);
+  rpc_sess_mgr_.OnRecvResponse(meta.method_id, meta.rpc_id,
+                               rpc_result, body);
 }
 
-void RpcCore::OnIncomingRpcDone(const IncomingRpcContext* ctx, Result result)
+IncomingRpcContext* RpcCore::AcquireIncomingContext(MethodEntry* method,
+                                                    uint64_t rpc_id,
+                                                    const Addr& addr,
+                                                    uint8_t pkt_ver)
 {
-  static thread_local RpcHeader rpc_header;
-  rpc_header.set_packet_type(RpcHeader::RESPONSE);
-  rpc_header.set_service_name(ctx->method()->service()->name());
-  rpc_header.set_method_name(ctx->method()->name());
-  rpc_header.set_rpc_id(ctx->rpc_id());
-  rpc_header.set_rpc_result(result);
-  SendMessage(rpc_header, *ctx->response(), ctx->addr(), nullptr);
-  delete ctx;
+  IncomingRpcContext* ctx;
+  if (!method->free_contexts.empty()) {
+    ctx = method->free_contexts.back();
+    method->free_contexts.pop_back();
+    ctx->Reuse(rpc_id, addr, pkt_ver);
+    return ctx;
+  }
+  if (!method->request_prototype->GetDescriptor()->file()
+                                 ->options().cc_enable_arenas()) {
+    // if message is not arena enabled using Arena will be even slower
+    ctx = new IncomingRpcContext(method, rpc_id, addr, pkt_ver);
+  } else {
+    ctx = new ArenaIncomingRpcContext(method, rpc_id, addr, pkt_ver,
+                                      ArenaBlockSize(method));
+  }
+  ctx->Init(*method->request_prototype, *method->response_prototype);
+  return ctx;
 }
 
-void RpcCore::OnOutgoingRpcSend(
-                          const google::protobuf::MethodDescriptor* method,
-                          const google::protobuf::Message& request,
-                          uint64_t rpc_id, const Addr& addr)
+void RpcCore::ReleaseIncomingContext(IncomingRpcContext* ctx)
 {
-  static thread_local RpcHeader rpc_header;
-  rpc_header.set_packet_type(RpcHeader::REQUEST);
-  rpc_header.set_service_name(method->service()->name());
-  rpc_header.set_method_name(method->name());
-  rpc_header.set_rpc_id(rpc_id);
-  SendMessage(rpc_header, request, addr, reinterpret_cast<void*>(rpc_id));
+  MethodEntry* method = ctx->method_entry();
+  size_t space_used = ctx->ArenaSpaceUsed();
+  if (space_used) {
+    UpdateArenaUsage(method, space_used);
+  }
+  // size of response has been cached when it is serialized, and contexts
+  // with outdated arena block are replaced
+  if (method->free_contexts.size() >= kMaxFreeContexts ||
+      ctx->request_len() > kMaxReusedMessageSize ||
+      static_cast<size_t>(ctx->response()->GetCachedSize())
+                                           > kMaxReusedMessageSize ||
+      (ctx->ArenaBlockSize() &&
+       ctx->ArenaBlockSize() != ArenaBlockSize(method))) {
+    delete ctx;
+    return;
+  }
+  // memory of the RPC is released before the context is kept idle
+  ctx->Recycle();
+  method->free_contexts.push_back(ctx);
 }
 
-void RpcCore::SendMessage(const RpcHeader& header,
-                          const google::protobuf::Message& body,
-                          const Addr& addr,
-                          void* ctx)
+size_t RpcCore::ArenaBlockSize(const MethodEntry* method) const
 {
-  size_t rpc_header_len = header.ByteSizeLong();
+  if (method->arena_block_size) {
+    return method->arena_block_size;
+  }
+  return env_.opt().arena_block_min;
+}
+
+void RpcCore::UpdateArenaUsage(MethodEntry* method, size_t space_used)
+{
+  size_t min_size = env_.opt().arena_block_min;
+  size_t max_size = env_.opt().arena_block_max;
+  if (min_size == max_size) {
+    return;
+  }
+  method->arena_used.Add(space_used);
+  size_t count = method->arena_used.count();
+  // the percentile is refreshed periodically as it takes a full scan
+  if (count >= kMinArenaSamples && count % kArenaRefreshSamples == 0) {
+    size_t size = method->arena_used.Percentile(kArenaBlockPercentile)
+                  + kArenaBlockReserve;
+    // doubled from min_size to not replace contexts on small changes
+    size_t block_size = min_size;
+    while (block_size < size && block_size < max_size) {
+      block_size <<= 1;
+    }
+    method->arena_block_size = std::min(block_size, max_size);
+  }
+}
+
+void RpcCore::OnIncomingRpcDone(IncomingRpcContext* ctx, Result result)
+{
+  // the caller has given up after its deadline, which is no later than
+  // the one taken at receiving
+  if (ctx->deadline_ms() && Env::NowMs() >= ctx->deadline_ms()) {
+    DLOG("response dropped after deadline of rpc_id:%lu", ctx->rpc_id());
+    ReleaseIncomingContext(ctx);
+    return;
+  }
+  RpcMeta meta;
+  meta.packet_type = kResponsePacket;
+  meta.rpc_result = result;
+  meta.flags = 0;
+  meta.method_id = ctx->method_entry()->method_id;
+  meta.service_name = &ctx->method()->service()->name();
+  meta.method_name = &ctx->method()->name();
+  meta.rpc_id = ctx->rpc_id();
+  // reply in the packet version of request
+  SendMessage(ctx->pkt_ver(), meta, *ctx->response(), ctx->method_entry(),
+              ctx->addr(), nullptr);
+  ReleaseIncomingContext(ctx);
+}
+
+Buf RpcCore::OnOutgoingRpcEncode(const MethodEntry* method,
+                                 const google::protobuf::Message& request,
+                                 uint64_t rpc_id,
+                                 uint32_t timeout_ms)
+{
+  RpcMeta meta;
+  meta.packet_type = kRequestPacket;
+  meta.rpc_result = 0;
+  meta.flags = kDeadlineFlag;
+  meta.timeout_ms = timeout_ms;
+  meta.method_id = method->method_id;
+  meta.service_name = &method->method->service()->name();
+  meta.method_name = &method->method->name();
+  meta.rpc_id = rpc_id;
+  return BuildPacket(env_.opt().packet_version, meta, request, method);
+}
+
+void RpcCore::OnOutgoingRpcSend(const Buf& pkt, uint64_t rpc_id,
+                                uint32_t timeout_ms, const Addr& addr)
+{
+  // the budget left may have changed since encoded
+  PatchRequestTimeout(pkt, timeout_ms);
+  SendPacket(pkt, addr, reinterpret_cast<void*>(rpc_id), 0);
+}
+
+Buf RpcCore::OnOutgoingRpcClone(const Buf& pkt, uint64_t rpc_id)
+{
+  auto pkt_header = reinterpret_cast<const RpcPacketHeader*>(pkt.ptr());
+  uint8_t pkt_ver = pkt_header->hrpc_pkt_ver;
+  if (pkt_ver < 2) {
+    // version 1 header is varint encoded, so encode it again
+    size_t rpc_header_len = ntohs(pkt_header->rpc_header_len);
+    const char* rpc_header_ptr = pkt.char_ptr() + sizeof(RpcPacketHeader);
+    RpcMeta meta;
+    HRPC_ASSERT(RpcHeaderCodec::Decode(pkt_ver, rpc_header_ptr,
+                                       rpc_header_len, &meta));
+    meta.rpc_id = rpc_id;
+    size_t rpc_body_len = pkt.len() - sizeof(RpcPacketHeader)
+                        - rpc_header_len;
+    char* rpc_body_ptr;
+    Buf clone = AllocPacket(pkt_ver, meta, rpc_body_len, &rpc_body_ptr);
+    memcpy(rpc_body_ptr, rpc_header_ptr + rpc_header_len, rpc_body_len);
+    return clone;
+  }
+  // rpc_id is patched in place for each fragment if it is a train
+  char* clone_ptr = static_cast<char*>(env_.alloc().Alloc(pkt.len()));
+  memcpy(clone_ptr, pkt.ptr(), pkt.len());
+  char* pkt_ptr = clone_ptr;
+  size_t left_len = pkt.len();
+  while (left_len > 0) {
+    pkt_header = reinterpret_cast<const RpcPacketHeader*>(pkt_ptr);
+    size_t pkt_len = PacketLength({pkt_ptr, left_len});
+    HRPC_ASSERT(RpcHeaderCodec::PatchRpcId(pkt_ver,
+                                pkt_ptr + sizeof(RpcPacketHeader),
+                                ntohs(pkt_header->rpc_header_len), rpc_id));
+    pkt_ptr += pkt_len;
+    left_len -= pkt_len;
+  }
+  return {clone_ptr, pkt.len()};
+}
+
+void RpcCore::PatchRequestTimeout(const Buf& pkt, uint32_t timeout_ms)
+{
+  // patch each fragment if it is a train
+  char* pkt_ptr = const_cast<char*>(pkt.char_ptr());
+  size_t left_len = pkt.len();
+  while (left_len > 0) {
+    auto pkt_header = reinterpret_cast<const RpcPacketHeader*>(pkt_ptr);
+    size_t pkt_len = PacketLength({pkt_ptr, left_len});
+    RpcHeaderCodec::PatchTimeout(pkt_header->hrpc_pkt_ver,
+                                 pkt_ptr + sizeof(RpcPacketHeader),
+                                 ntohs(pkt_header->rpc_header_len),
+                                 timeout_ms);
+    pkt_ptr += pkt_len;
+    left_len -= pkt_len;
+  }
+}
+
+void RpcCore::SendPacket(const Buf& pkt, const Addr& addr, void* ctx,
+                         size_t dst_core)
+{
+  size_t pkt_len = PacketLength(pkt);
+  if (pkt_len < pkt.len()) {
+    SendFragments(pkt, addr, ctx);
+    return;
+  }
+  if (!batcher_.enabled()) {
+    on_send_packet_(pkt, addr, ctx);
+    return;
+  }
+  batcher_.Add(pkt, addr, ctx, dst_core);
+  if (task_depth_ == 0 && env_.opt().batch_max_delay_us == 0) {
+    // not within any task, e.g. triggered by timers
+    batcher_.Flush();
+  }
+}
+
+void RpcCore::SendFragments(const Buf& train, const Addr& addr, void* ctx)
+{
+  // fragments are sent apart without batching, so that each datagram can
+  // be redirected to the rpc_core reassembling it
+  const char* pkt_ptr = train.char_ptr();
+  size_t left_len = train.len();
+  while (left_len > 0) {
+    size_t pkt_len = PacketLength({pkt_ptr, left_len});
+    left_len -= pkt_len;
+    // only the last fragment reports failure, so that a message fails
+    // over to the next endpoint at most once
+    on_send_packet_({pkt_ptr, pkt_len}, addr, left_len > 0 ? nullptr : ctx);
+    pkt_ptr += pkt_len;
+  }
+}
+
+inline size_t RpcCore::PacketLength(const Buf& pkt)
+{
+  auto pkt_header = static_cast<const RpcPacketHeader*>(pkt.ptr());
+  return sizeof(RpcPacketHeader) + ntohs(pkt_header->rpc_header_len)
+                                 + ntohl(pkt_header->rpc_body_len);
+}
+
+void RpcCore::OnTaskEnd()
+{
+  if (batcher_.enabled() && env_.opt().batch_max_delay_us == 0) {
+    batcher_.Flush();
+  }
+}
+
+Buf RpcCore::BuildPacket(uint8_t pkt_ver, const RpcMeta& meta,
+                         const google::protobuf::Message& body,
+                         const MethodEntry* method)
+{
+  char* rpc_body_ptr;
   size_t rpc_body_len = body.ByteSizeLong();
+  bool need_compress = (method->compress_type != kNoCompress &&
+                        rpc_body_len > method->compress_threshold);
+  bool need_fragment = (env_.opt().fragment_size > 0 &&
+                        rpc_body_len > env_.opt().fragment_size);
+  if (pkt_ver < 2 || (!need_compress && !need_fragment)) {
+    // serialize body in place, the body size has been cached above
+    Buf pkt = AllocPacket(pkt_ver, meta, rpc_body_len, &rpc_body_ptr);
+    body.SerializeWithCachedSizesToArray(
+         reinterpret_cast<uint8_t*>(rpc_body_ptr));
+    return pkt;
+  }
+  // go via scratch buffers as the packet size is unknown until then
+  if (serialize_buf_.size() < rpc_body_len) {
+    serialize_buf_.resize(rpc_body_len);
+  }
+  body.SerializeWithCachedSizesToArray(
+       reinterpret_cast<uint8_t*>(serialize_buf_.data()));
+  RpcMeta body_meta = meta;
+  const char* body_ptr = serialize_buf_.data();
+  size_t body_len = rpc_body_len;
+  if (need_compress) {
+    size_t max_len = Compressor::MaxCompressedSize(method->compress_type,
+                                                   rpc_body_len);
+    if (compress_buf_.size() < max_len) {
+      compress_buf_.resize(max_len);
+    }
+    size_t compressed_len = Compressor::Compress(method->compress_type,
+                                                 serialize_buf_.data(),
+                                                 rpc_body_len,
+                                                 compress_buf_.data(),
+                                                 max_len);
+    // send it as is if not compressible
+    if (compressed_len > 0 && compressed_len < rpc_body_len) {
+      body_meta.flags |= kCompressedFlag;
+      body_meta.compress_type = method->compress_type;
+      body_meta.raw_body_len = static_cast<uint32_t>(rpc_body_len);
+      body_ptr = compress_buf_.data();
+      body_len = compressed_len;
+    }
+  }
+  if (env_.opt().fragment_size > 0 && body_len > env_.opt().fragment_size) {
+    return BuildFragments(pkt_ver, body_meta, body_ptr, body_len);
+  }
+  Buf pkt = AllocPacket(pkt_ver, body_meta, body_len, &rpc_body_ptr);
+  memcpy(rpc_body_ptr, body_ptr, body_len);
+  return pkt;
+}
+
+Buf RpcCore::BuildFragments(uint8_t pkt_ver, const RpcMeta& meta,
+                            const char* body_ptr, size_t body_len)
+{
+  size_t frag_size = env_.opt().fragment_size;
+  size_t frag_count = (body_len + frag_size - 1) / frag_size;
+  RpcMeta frag_meta = meta;
+  frag_meta.flags |= kFragmentFlag;
+  frag_meta.total_body_len = static_cast<uint32_t>(body_len);
+  frag_meta.frag_count = static_cast<uint16_t>(frag_count);
+  // all fragments have the same header size
+  size_t rpc_header_len = RpcHeaderCodec::EncodedSize(pkt_ver, frag_meta);
+  size_t train_size = (sizeof(RpcPacketHeader) + rpc_header_len)
+                    * frag_count + body_len;
+  char* train_buffer = static_cast<char*>(env_.alloc().Alloc(train_size));
+  char* pkt_ptr = train_buffer;
+  for (size_t i = 0; i < frag_count; i++) {
+    size_t offset = i * frag_size;
+    size_t len = std::min(frag_size, body_len - offset);
+    frag_meta.frag_index = static_cast<uint16_t>(i);
+    frag_meta.frag_offset = static_cast<uint32_t>(offset);
+    auto pkt_header = reinterpret_cast<RpcPacketHeader*>(pkt_ptr);
+    pkt_header->hrpc_pkt_tag = kHyperRpcPacketTag;
+    pkt_header->hrpc_pkt_ver = pkt_ver;
+    pkt_header->rpc_header_len = htons(static_cast<uint16_t>(rpc_header_len));
+    pkt_header->rpc_body_len = htonl(static_cast<uint32_t>(len));
+    pkt_ptr += sizeof(RpcPacketHeader);
+    pkt_ptr += RpcHeaderCodec::Encode(pkt_ver, frag_meta, pkt_ptr);
+    memcpy(pkt_ptr, body_ptr + offset, len);
+    pkt_ptr += len;
+  }
+  return {train_buffer, train_size};
+}
+
+Buf RpcCore::AllocPacket(uint8_t pkt_ver, const RpcMeta& meta,
+                         size_t rpc_body_len, char** rpc_body_ptr)
+{
+  size_t rpc_header_len = RpcHeaderCodec::EncodedSize(pkt_ver, meta);
   size_t pkt_size = sizeof(RpcPacketHeader) + rpc_header_len + rpc_body_len;
-  char pkt_buffer[pkt_size];
+  char* pkt_buffer = static_cast<char*>(env_.alloc().Alloc(pkt_size));
   // set RpcPacketHeader
   auto pkt_header = reinterpret_cast<RpcPacketHeader*>(pkt_buffer);
   pkt_header->hrpc_pkt_tag = kHyperRpcPacketTag;
-  pkt_header->hrpc_pkt_ver = kHyperRpcPacketVer;
+  pkt_header->hrpc_pkt_ver = pkt_ver;
   pkt_header->rpc_header_len = htons(static_cast<uint16_t>(rpc_header_len));
   pkt_header->rpc_body_len = htonl(static_cast<uint32_t>(rpc_body_len));
-  // set RpcHeader & body
-  google::protobuf::io::ArrayOutputStream out(
-      pkt_buffer + sizeof(RpcPacketHeader), rpc_header_len + rpc_body_len);
-  HRPC_ASSERT(header.SerializeToZeroCopyStream(&out));
-  HRPC_ASSERT(body.SerializeToZeroCopyStream(&out));
-  // send to network
-  on_send_packet_({pkt_buffer, pkt_size}, addr, ctx);
+  // set RpcHeader in place, leave body to the caller
+  char* rpc_header_ptr = pkt_buffer + sizeof(RpcPacketHeader);
+  HRPC_ASSERT(RpcHeaderCodec::Encode(pkt_ver, meta, rpc_header_ptr)
+              == rpc_header_len);
+  *rpc_body_ptr = rpc_header_ptr + rpc_header_len;
+  return {pkt_buffer, pkt_size};
+}
+
+void RpcCore::FreePacket(const Buf& pkt)
+{
+  env_.alloc().Free(const_cast<void*>(pkt.ptr()), pkt.len());
+}
+
+void RpcCore::SendMessage(uint8_t pkt_ver, const RpcMeta& meta,
+                          const google::protobuf::Message& body,
+                          const MethodEntry* method,
+                          const Addr& addr,
+                          void* ctx)
+{
+  Buf pkt = BuildPacket(pkt_ver, meta, body, method);
+  // send to network, responses are batched by rpc_core of the peer
+  size_t dst_core = (meta.packet_type == kResponsePacket ?
+                     (meta.rpc_id >> kRpcIdSeqPartBits) & 0xffff : 0);
+  SendPacket(pkt, addr, ctx, dst_core);
+  FreePacket(pkt);
 }
 
 size_t RpcCore::OnSendPacketFailed(void* ctx)
 {
+  TaskScope task_scope(this);
   size_t cur_rpc_core_id = rpc_core_id_;
-  if (ctx) { // non-zero means outgoing rpc-id
+  if (ctx) { // non-zero means outgoing rpc-id or batch context
     uint64_t rpc_id = reinterpret_cast<uint64_t>(ctx);
     size_t dst_rpc_core_id;
     if (!GetCoreIdFromRpcId(rpc_id, &dst_rpc_core_id)) {
@@ -234,7 +775,31 @@ size_t RpcCore::OnSendPacketFailed(void* ctx)
       DLOG("OnSendPacketFailed redirect to rpc_core_id:%lu", dst_rpc_core_id);
       return dst_rpc_core_id;
     }
-    rpc_sess_mgr_.OnSendRequestFailed(rpc_id);
+    if (PacketBatcher::IsBatchContext(ctx)) {
+      for (uint64_t batched_rpc_id : batcher_.TakeBatch(ctx)) {
+        rpc_sess_mgr_.OnSendRequestFailed(batched_rpc_id);
+      }
+    } else {
+      rpc_sess_mgr_.OnSendRequestFailed(rpc_id);
+    }
+  }
+  return cur_rpc_core_id;
+}
+
+size_t RpcCore::OnSendPacketSucceeded(void* ctx)
+{
+  size_t cur_rpc_core_id = rpc_core_id_;
+  if (PacketBatcher::IsBatchContext(ctx)) {
+    size_t dst_rpc_core_id;
+    if (!GetCoreIdFromRpcId(reinterpret_cast<uint64_t>(ctx),
+                            &dst_rpc_core_id)) {
+      ILOG("OnSendPacketSucceeded found bad batch context!");
+      return cur_rpc_core_id;
+    }
+    if (dst_rpc_core_id != cur_rpc_core_id) {
+      return dst_rpc_core_id;
+    }
+    batcher_.TakeBatch(ctx);
   }
   return cur_rpc_core_id;
 }
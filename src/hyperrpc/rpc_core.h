@@ -30,46 +30,147 @@
 #ifndef _HRPC_RPC_CORE_H
 #define _HRPC_RPC_CORE_H
 
+#include <atomic>
+#include <memory>
+#include <vector>
 #include "hyperrpc/env.h"
+#include "hyperrpc/method_table.h"
+#include "hyperrpc/fragment_assembler.h"
+#include "hyperrpc/packet_batcher.h"
+#include "hyperrpc/rpc_header_codec.h"
 #include "hyperrpc/rpc_session_manager.h"
+#include "hyperrpc/route_cache.h"
 
 namespace hrpc {
 
 class Service;
-class RpcHeader;
 class IncomingRpcContext;
 
 class RpcCore
 {
 public:
   using OnSendPacket = ccb::ClosureFunc<void(const Buf&, const Addr&, void*)>;
-  using OnFindService = ccb::ClosureFunc<Service*(const std::string&)>;
   using OnServiceRouting = HyperRpc::OnServiceRouting;
+  using OnRouteKey = HyperRpc::OnRouteKey;
 
   RpcCore(const Env& env);
   ~RpcCore();
 
   bool Init(size_t rpc_core_id, OnSendPacket on_send_pkt,
-                                OnFindService on_find_svc,
-                                OnServiceRouting on_svc_routing);
+                                const std::vector<Service*>& services,
+                                OnServiceRouting on_svc_routing,
+                                OnRouteKey on_route_key = nullptr);
   void CallMethod(const google::protobuf::MethodDescriptor* method,
                   const google::protobuf::Message* request,
                   google::protobuf::Message* response,
+                  ccb::ClosureFunc<void(Result)> done) {
+    CallMethod(method, request, response, CallOptions(), std::move(done));
+  }
+  void CallMethod(const google::protobuf::MethodDescriptor* method,
+                  const google::protobuf::Message* request,
+                  google::protobuf::Message* response,
+                  const CallOptions& call_opts,
                   ccb::ClosureFunc<void(Result)> done);
-  size_t OnRecvPacket(const Buf& buf, const Addr& addr);
+  void FanOutCall(const google::protobuf::MethodDescriptor* method,
+                  const std::vector<const google::protobuf::Message*>& requests,
+                  const std::vector<google::protobuf::Message*>& responses,
+                  std::vector<Result>* results,
+                  const CallOptions& call_opts,
+                  ccb::ClosureFunc<void(Result)> done);
+  // return rpc_core_id which should process the packet, recv_ms is when
+  // the packet was received if it has been waiting in queue
+  size_t OnRecvPacket(const Buf& buf, const Addr& addr, uint64_t recv_ms = 0);
   size_t OnSendPacketFailed(void* ctx);
+  // only needed for contexts of batched datagrams
+  size_t OnSendPacketSucceeded(void* ctx);
+  static bool NeedSendResult(void* ctx) {
+    return PacketBatcher::IsBatchContext(ctx);
+  }
+  // add counters to @stats, which is safe to call from any thread
+  void GetStats(RpcStats* stats) const {
+    rpc_sess_mgr_.GetStats(stats);
+    stats->route_cache_hits += route_cache_hits_.load(
+                               std::memory_order_relaxed);
+    stats->route_cache_misses += route_cache_misses_.load(
+                                 std::memory_order_relaxed);
+  }
+  // drop cached routes of @service, or all if it is empty
+  void InvalidateRoutes(const std::string& service) {
+    route_cache_.Invalidate(service);
+  }
+  // called in the worker-thread owning the core once it is started
+  void MoveToLocalNode() {
+    rpc_sess_mgr_.MoveToLocalNode();
+  }
 
 private:
-  void OnRecvRequestMessage(const RpcHeader& header,
-                            const Buf& body, const Addr& addr);
-  void OnRecvResponseMessage(const RpcHeader& header,
+  // packets batched within tasks are flushed when the outermost one ends
+  struct TaskScope {
+    TaskScope(RpcCore* rpc_core) : rpc_core(rpc_core) {
+      rpc_core->task_depth_++;
+    }
+    ~TaskScope() {
+      if (--rpc_core->task_depth_ == 0) rpc_core->OnTaskEnd();
+    }
+    RpcCore* rpc_core;
+  };
+
+  size_t OnRecvOnePacket(const char* buf, size_t len, const Addr& addr,
+                         uint64_t recv_ms, size_t* pkt_len);
+  void OnRecvMessage(uint8_t pkt_ver, const RpcMeta& meta,
+                     const Buf& body, const Addr& addr, uint64_t recv_ms);
+  void OnRecvRequestMessage(uint8_t pkt_ver, const RpcMeta& meta,
+                            const Buf& body, const Addr& addr,
+                            uint64_t deadline_ms);
+  void OnRecvResponseMessage(const RpcMeta& meta,
                              const Buf& body, const Addr& addr);
-  void OnIncomingRpcDone(const IncomingRpcContext* ctx, Result result);
-  void OnOutgoingRpcSend(const google::protobuf::MethodDescriptor* method,
-                         const google::protobuf::Message& request,
-                         uint64_t rpc_id, const Addr& addr);
-  void SendMessage(const RpcHeader& header,
+  void OnIncomingRpcDone(IncomingRpcContext* ctx, Result result);
+  // contexts are taken from and returned to free list of the method
+  IncomingRpcContext* AcquireIncomingContext(MethodEntry* method,
+                                             uint64_t rpc_id,
+                                             const Addr& addr,
+                                             uint8_t pkt_ver);
+  void ReleaseIncomingContext(IncomingRpcContext* ctx);
+  size_t ArenaBlockSize(const MethodEntry* method) const;
+  void UpdateArenaUsage(MethodEntry* method, size_t space_used);
+  Buf OnOutgoingRpcEncode(const MethodEntry* method,
+                          const google::protobuf::Message& request,
+                          uint64_t rpc_id,
+                          uint32_t timeout_ms);
+  void OnOutgoingRpcSend(const Buf& pkt, uint64_t rpc_id,
+                         uint32_t timeout_ms, const Addr& addr);
+  Buf OnOutgoingRpcClone(const Buf& pkt, uint64_t rpc_id);
+  void PatchRequestTimeout(const Buf& pkt, uint32_t timeout_ms);
+  // resolve endpoints and timeout of an outgoing call, *endpoints is
+  // referenced for the caller if it succeeds
+  Result PrepareCall(const google::protobuf::MethodDescriptor* method,
+                     const google::protobuf::Message& request,
+                     EndpointSet** endpoints,
+                     CallOptions* call_opts);
+  Result ResolveRoute(const google::protobuf::MethodDescriptor* method,
+                      const google::protobuf::Message& request,
+                      EndpointSet** endpoints);
+  // pkt may be a train of fragments built by BuildPacket()
+  void SendPacket(const Buf& pkt, const Addr& addr, void* ctx,
+                  size_t dst_core);
+  void SendFragments(const Buf& train, const Addr& addr, void* ctx);
+  static size_t PacketLength(const Buf& pkt);
+  void OnTaskEnd();
+  // packet built is allocated from Env::alloc() and freed by FreePacket(),
+  // large messages are built as a train of fragment packets
+  Buf BuildPacket(uint8_t pkt_ver, const RpcMeta& meta,
+                  const google::protobuf::Message& body,
+                  const MethodEntry* method);
+  Buf BuildFragments(uint8_t pkt_ver, const RpcMeta& meta,
+                     const char* body_ptr, size_t body_len);
+  Buf AllocPacket(uint8_t pkt_ver, const RpcMeta& meta,
+                  size_t rpc_body_len, char** rpc_body_ptr);
+  void FreePacket(const Buf& pkt);
+  // body is pointed to the scratch buffer if decompressed
+  bool DecompressBody(const RpcMeta& meta, Buf* body);
+  void SendMessage(uint8_t pkt_ver, const RpcMeta& meta,
                    const google::protobuf::Message& body,
+                   const MethodEntry* method,
                    const Addr& addr,
                    void* ctx);
   bool GetCoreIdFromRpcId(uint64_t rpc_id, size_t* rpc_core_id);
@@ -83,9 +184,25 @@ private:
   const Env& env_;
   size_t rpc_core_id_;
   RpcSessionManager rpc_sess_mgr_;
+  MethodTable method_table_;
   OnSendPacket on_send_packet_;
-  OnFindService on_find_service_;
   OnServiceRouting on_service_routing_;
+  OnRouteKey on_route_key_;
+  RouteCache route_cache_;
+  PacketBatcher batcher_;
+  FragmentAssembler fragment_assembler_;
+  size_t task_depth_;
+  // scratch buffers of compression, grown on demand
+  std::vector<char> serialize_buf_;
+  std::vector<char> compress_buf_;
+  // not zero-filled when grown, as it is fully written by decompression
+  std::unique_ptr<char[]> decompress_buf_;
+  size_t decompress_buf_size_;
+  // endpoints routed by OnServiceRouting, which are interned at once
+  EndpointList route_endpoints_;
+  // written by the owner thread only
+  std::atomic<uint64_t> route_cache_hits_;
+  std::atomic<uint64_t> route_cache_misses_;
 };
 
 } // namespace hrpc
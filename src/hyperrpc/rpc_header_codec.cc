@@ -0,0 +1,253 @@
+/* Copyright (c) 2016, Bin Wei <bin@vip.qq.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of of its contributors may not be used to endorse or 
+ * promote products derived from this software without specific prior 
+ * written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <endian.h>
+#include <stddef.h>
+#include <string.h>
+#include "hyperrpc/rpc_header_codec.h"
+#include "hyperrpc/method_table.h"
+#include "hyperrpc/rpc_message.pb.h"
+
+namespace hrpc {
+
+// wire tag of RpcHeader.timeout_ms, which is fixed32 of the largest field
+// number and thus serialized at last
+static constexpr uint8_t kV1TimeoutTag = (7 << 3) | 5;
+
+static RpcHeader* BuildRpcHeaderV1(const RpcMeta& meta)
+{
+  static thread_local RpcHeader rpc_header;
+  rpc_header.set_packet_type(meta.packet_type == kRequestPacket ?
+                             RpcHeader::REQUEST : RpcHeader::RESPONSE);
+  rpc_header.set_method_id(meta.method_id);
+  if (meta.service_name && meta.method_name) {
+    rpc_header.set_service_name(*meta.service_name);
+    rpc_header.set_method_name(*meta.method_name);
+  } else {
+    rpc_header.clear_service_name();
+    rpc_header.clear_method_name();
+  }
+  rpc_header.set_rpc_id(meta.rpc_id);
+  if (meta.packet_type == kResponsePacket) {
+    rpc_header.set_rpc_result(meta.rpc_result);
+  } else {
+    rpc_header.clear_rpc_result();
+  }
+  if (meta.flags & kDeadlineFlag) {
+    rpc_header.set_timeout_ms(meta.timeout_ms);
+  } else {
+    rpc_header.clear_timeout_ms();
+  }
+  return &rpc_header;
+}
+
+size_t RpcHeaderCodec::EncodedSize(uint8_t pkt_ver, const RpcMeta& meta)
+{
+  if (pkt_ver == 1) {
+    return BuildRpcHeaderV1(meta)->ByteSizeLong();
+  }
+  size_t len = sizeof(RpcHeaderV2);
+  if (meta.flags & kCompressedFlag) len += sizeof(RpcCompressExt);
+  if (meta.flags & kFragmentFlag) len += sizeof(RpcFragmentExt);
+  if (meta.flags & kDeadlineFlag) len += sizeof(RpcDeadlineExt);
+  return len;
+}
+
+size_t RpcHeaderCodec::Encode(uint8_t pkt_ver, const RpcMeta& meta,
+                              char* buf)
+{
+  if (pkt_ver == 1) {
+    RpcHeader* rpc_header = BuildRpcHeaderV1(meta);
+    size_t len = rpc_header->ByteSizeLong();
+    rpc_header->SerializeWithCachedSizesToArray(
+                reinterpret_cast<uint8_t*>(buf));
+    return len;
+  }
+  RpcHeaderV2 header;
+  header.packet_type = meta.packet_type;
+  header.rpc_result = static_cast<uint8_t>(meta.rpc_result);
+  header.flags = htole16(meta.flags);
+  header.method_id = htole32(meta.method_id);
+  header.rpc_id = htole64(meta.rpc_id);
+  memcpy(buf, &header, sizeof(header));
+  size_t len = sizeof(header);
+  if (meta.flags & kCompressedFlag) {
+    RpcCompressExt ext;
+    ext.compress_type = meta.compress_type;
+    memset(ext.reserved, 0, sizeof(ext.reserved));
+    ext.raw_body_len = htole32(meta.raw_body_len);
+    memcpy(buf + len, &ext, sizeof(ext));
+    len += sizeof(ext);
+  }
+  if (meta.flags & kFragmentFlag) {
+    RpcFragmentExt ext;
+    ext.total_body_len = htole32(meta.total_body_len);
+    ext.frag_offset = htole32(meta.frag_offset);
+    ext.frag_index = htole16(meta.frag_index);
+    ext.frag_count = htole16(meta.frag_count);
+    memcpy(buf + len, &ext, sizeof(ext));
+    len += sizeof(ext);
+  }
+  if (meta.flags & kDeadlineFlag) {
+    RpcDeadlineExt ext;
+    ext.timeout_ms = htole32(meta.timeout_ms);
+    memcpy(buf + len, &ext, sizeof(ext));
+    len += sizeof(ext);
+  }
+  return len;
+}
+
+bool RpcHeaderCodec::Decode(uint8_t pkt_ver, const void* buf, size_t len,
+                            RpcMeta* meta)
+{
+  if (pkt_ver == 1) {
+    static thread_local RpcHeader rpc_header;
+    if (!rpc_header.ParseFromArray(buf, len)) {
+      return false;
+    }
+    meta->packet_type = (rpc_header.packet_type() == RpcHeader::REQUEST ?
+                         kRequestPacket : kResponsePacket);
+    meta->rpc_result = rpc_header.rpc_result();
+    // version 1 carries deadline only
+    meta->flags = 0;
+    if (rpc_header.has_timeout_ms()) {
+      meta->flags |= kDeadlineFlag;
+      meta->timeout_ms = rpc_header.timeout_ms();
+    }
+    // names are valid until the next header decoded by the thread
+    meta->service_name = (rpc_header.has_service_name() ?
+                          &rpc_header.service_name() : nullptr);
+    meta->method_name = (rpc_header.has_method_name() ?
+                         &rpc_header.method_name() : nullptr);
+    if (rpc_header.has_method_id()) {
+      meta->method_id = rpc_header.method_id();
+    } else {
+      // legacy peers send names only
+      meta->method_id = MethodTable::MethodId(rpc_header.service_name(),
+                                              rpc_header.method_name());
+    }
+    meta->rpc_id = rpc_header.rpc_id();
+    return true;
+  }
+  if (len < sizeof(RpcHeaderV2)) {
+    return false;
+  }
+  RpcHeaderV2 header;
+  memcpy(&header, buf, sizeof(header));
+  meta->packet_type = header.packet_type;
+  meta->rpc_result = header.rpc_result;
+  meta->flags = le16toh(header.flags);
+  meta->method_id = le32toh(header.method_id);
+  meta->rpc_id = le64toh(header.rpc_id);
+  meta->service_name = nullptr;
+  meta->method_name = nullptr;
+  const char* ext_ptr = static_cast<const char*>(buf) + sizeof(header);
+  len -= sizeof(header);
+  if (meta->flags & kCompressedFlag) {
+    RpcCompressExt ext;
+    if (len < sizeof(ext)) {
+      return false;
+    }
+    memcpy(&ext, ext_ptr, sizeof(ext));
+    meta->compress_type = ext.compress_type;
+    meta->raw_body_len = le32toh(ext.raw_body_len);
+    ext_ptr += sizeof(ext);
+    len -= sizeof(ext);
+  }
+  if (meta->flags & kFragmentFlag) {
+    RpcFragmentExt ext;
+    if (len < sizeof(ext)) {
+      return false;
+    }
+    memcpy(&ext, ext_ptr, sizeof(ext));
+    meta->total_body_len = le32toh(ext.total_body_len);
+    meta->frag_offset = le32toh(ext.frag_offset);
+    meta->frag_index = le16toh(ext.frag_index);
+    meta->frag_count = le16toh(ext.frag_count);
+    ext_ptr += sizeof(ext);
+    len -= sizeof(ext);
+  }
+  if (meta->flags & kDeadlineFlag) {
+    RpcDeadlineExt ext;
+    if (len < sizeof(ext)) {
+      return false;
+    }
+    memcpy(&ext, ext_ptr, sizeof(ext));
+    meta->timeout_ms = le32toh(ext.timeout_ms);
+    ext_ptr += sizeof(ext);
+    len -= sizeof(ext);
+  }
+  return true;
+}
+
+bool RpcHeaderCodec::PatchTimeout(uint8_t pkt_ver, char* buf, size_t len,
+                                  uint32_t timeout_ms)
+{
+  uint32_t value = htole32(timeout_ms);
+  if (pkt_ver == 1) {
+    if (len < 1 + sizeof(value) ||
+        static_cast<uint8_t>(buf[len - 1 - sizeof(value)]) != kV1TimeoutTag) {
+      return false;
+    }
+    memcpy(buf + len - sizeof(value), &value, sizeof(value));
+    return true;
+  }
+  RpcHeaderV2 header;
+  if (len < sizeof(header)) {
+    return false;
+  }
+  memcpy(&header, buf, sizeof(header));
+  uint16_t flags = le16toh(header.flags);
+  if (!(flags & kDeadlineFlag)) {
+    return false;
+  }
+  // skip extensions before RpcDeadlineExt
+  size_t offset = sizeof(header);
+  if (flags & kCompressedFlag) offset += sizeof(RpcCompressExt);
+  if (flags & kFragmentFlag) offset += sizeof(RpcFragmentExt);
+  if (len < offset + sizeof(RpcDeadlineExt)) {
+    return false;
+  }
+  memcpy(buf + offset + offsetof(RpcDeadlineExt, timeout_ms),
+         &value, sizeof(value));
+  return true;
+}
+
+bool RpcHeaderCodec::PatchRpcId(uint8_t pkt_ver, char* buf, size_t len,
+                                uint64_t rpc_id)
+{
+  if (pkt_ver < 2 || len < sizeof(RpcHeaderV2)) {
+    return false;
+  }
+  uint64_t value = htole64(rpc_id);
+  memcpy(buf + offsetof(RpcHeaderV2, rpc_id), &value, sizeof(value));
+  return true;
+}
+
+} // namespace hrpc
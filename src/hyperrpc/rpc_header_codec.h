@@ -0,0 +1,85 @@
+/* Copyright (c) 2016, Bin Wei <bin@vip.qq.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of of its contributors may not be used to endorse or 
+ * promote products derived from this software without specific prior 
+ * written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _HRPC_RPC_HEADER_CODEC_H
+#define _HRPC_RPC_HEADER_CODEC_H
+
+#include <string>
+#include "hyperrpc/protocol.h"
+#include "hyperrpc/constants.h"
+
+namespace hrpc {
+
+/* Decoded RpcHeader shared by all packet versions
+ */
+struct RpcMeta
+{
+  uint8_t packet_type;
+  int32_t rpc_result;
+  uint16_t flags;
+  uint32_t method_id;
+  uint64_t rpc_id;
+  // names of the method, which are sent in version 1 along with method_id
+  // for legacy peers matching methods by names, nullptr if not known
+  const std::string* service_name = nullptr;
+  const std::string* method_name = nullptr;
+  // only valid with kCompressedFlag
+  uint8_t compress_type;
+  uint32_t raw_body_len;
+  // only valid with kFragmentFlag
+  uint32_t total_body_len;
+  uint32_t frag_offset;
+  uint16_t frag_index;
+  uint16_t frag_count;
+  // only valid with kDeadlineFlag
+  uint32_t timeout_ms;
+};
+
+/* Version 1 encodes RpcHeader as protobuf message while version 2 uses
+ * the fixed layout RpcHeaderV2
+ */
+class RpcHeaderCodec
+{
+public:
+  static size_t EncodedSize(uint8_t pkt_ver, const RpcMeta& meta);
+  // buf must have EncodedSize() bytes at least
+  static size_t Encode(uint8_t pkt_ver, const RpcMeta& meta, char* buf);
+  static bool Decode(uint8_t pkt_ver, const void* buf, size_t len,
+                     RpcMeta* meta);
+  // rewrite timeout_ms of header encoded with kDeadlineFlag
+  static bool PatchTimeout(uint8_t pkt_ver, char* buf, size_t len,
+                           uint32_t timeout_ms);
+  // rewrite rpc_id, which is only possible in version 2 and above
+  static bool PatchRpcId(uint8_t pkt_ver, char* buf, size_t len,
+                         uint64_t rpc_id);
+};
+
+} // namespace hrpc
+
+#endif // _HRPC_RPC_HEADER_CODEC_H
@@ -31,11 +31,17 @@
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/message.h>
 #include "hyperrpc/rpc_session_manager.h"
+#include "hyperrpc/rpc_context.h"
 
 namespace hrpc {
 
 RpcSessionManager::RpcSessionManager(const Env& env)
   : env_(env)
+  , load_balancer_(env)
+  , timeout_queue_num_(0)
+  , retries_(0)
+  , retries_suppressed_(0)
+  , session_capacity_(0)
 {
 }
 
@@ -45,7 +51,9 @@ RpcSessionManager::~RpcSessionManager()
 
 bool RpcSessionManager::Init(size_t sess_pool_size,
                              size_t rpc_core_id,
-                             OnSendRequest on_send_req)
+                             OnEncodeRequest on_encode_req,
+                             OnSendRequest on_send_req,
+                             OnCloneRequest on_clone_req)
 {
   // align pool size to 2^pool_size_order_
   size_t pool_size_order = 0;
@@ -53,54 +61,309 @@ bool RpcSessionManager::Init(size_t sess_pool_size,
     pool_size_order++;
   }
   pool_size_order_ = std::min(pool_size_order, kRpcIdSeqPartBits);
-  pool_size_mask_ = (1UL << pool_size_order) - 1;
-  // allocate session pool
-  sess_pool_.reset(new SessionNode[1UL << pool_size_order_]);
-  // initialize RPC_ID = CORE_ID_PLUS_1(16bit) + RANDOM(32bit) + ZEROS(16bit)
-  next_rpc_id_ = ((uint64_t)(rpc_core_id + 1) << kRpcIdSeqPartBits) +
-                 ((uint64_t)env_.Rand() << (kRpcIdSeqPartBits - 32));
+  pool_size_mask_ = (1UL << pool_size_order_) - 1;
+  // huge pages are filled by the dense array of a segment
+  size_t segment_order = kSegmentOrder;
+  if (env_.opt().huge_page_pools) {
+    while ((sizeof(SessionHot) << segment_order) < PoolMemory::kHugePageSize) {
+      segment_order++;
+    }
+  }
+  segment_order_ = std::min(segment_order, pool_size_order_);
+  segment_mask_ = (1UL << segment_order_) - 1;
+  // generations start randomly, so that responses to a previous process
+  // are unlikely to be accepted
+  rpc_id_base_ = (uint64_t)(rpc_core_id + 1) << kRpcIdSeqPartBits;
+  size_t segment_num = 1UL << (pool_size_order_ - segment_order_);
+  segments_.clear();
+  segments_.resize(segment_num);
+  segment_generations_.assign(segment_num, env_.Rand());
+  free_nodes_.clear();
+  // the first segment is kept committed
+  if (!AddSegment()) {
+    return false;
+  }
+  if (env_.opt().huge_page_pools && !segments_[0]->nodes.memory().huge_page()) {
+    ILOG("no huge page reserved, session pool uses normal pages");
+  }
+  // the default timeout keeps the first queue, while others are bound to
+  // timeouts on demand and recycled once drained
+  timeout_queues_[0].timeout_ms = env_.opt().default_rpc_timeout;
+  timeout_queues_[0].head = timeout_queues_[0].tail = nullptr;
+  timeout_queue_num_ = 1;
+  env_.timerw()->AddPeriodTimer(
+       1, ccb::BindClosure(this, &RpcSessionManager::OnTimeoutTick),
+       &timeout_tick_owner_);
+  env_.timerw()->AddPeriodTimer(
+       kEndpointSetSweepMs,
+       ccb::BindClosure(&endpoint_sets_, &EndpointSetTable::Sweep),
+       &sweep_timer_owner_);
+  if (env_.opt().session_shrink_delay) {
+    env_.timerw()->AddPeriodTimer(
+         std::max<size_t>(env_.opt().session_shrink_delay / kShrinkChecks, 1),
+         ccb::BindClosure(this, &RpcSessionManager::OnShrinkCheck),
+         &shrink_timer_owner_);
+  }
   // set callback
+  on_encode_request_ = on_encode_req;
   on_send_request_ = on_send_req;
+  on_clone_request_ = on_clone_req;
   return true;
 }
 
 bool RpcSessionManager::AddSession(
-                          const ::google::protobuf::MethodDescriptor* method,
+                          MethodEntry* method,
                           const ::google::protobuf::Message* request,
                           ::google::protobuf::Message* response,
                           const EndpointList& endpoint_list,
+                          const CallOptions& call_opts,
                           ::ccb::ClosureFunc<void(Result)> done)
 {
   if (endpoint_list.size() > 65536) {
     WLOG("too large endpoint_list size!");
     return false;
   }
+  EndpointSet* endpoints = endpoint_sets_.Intern(endpoint_list);
+  bool ret = AddSession(method, request, response, endpoints, call_opts,
+                        std::move(done));
+  endpoints->Release();
+  return ret;
+}
+
+bool RpcSessionManager::AddSession(
+                          MethodEntry* method,
+                          const ::google::protobuf::Message* request,
+                          ::google::protobuf::Message* response,
+                          EndpointSet* endpoints,
+                          const CallOptions& call_opts,
+                          ::ccb::ClosureFunc<void(Result)> done)
+{
+  if (endpoints->size() > 65536) {
+    WLOG("too large endpoint_list size!");
+    return false;
+  }
   SessionNode* node = AllocSessionNode();
   if (!node) {
     WLOG("AllocSessionNode failed!");
     done(kInError);
     return false;
   }
-  node->method = method;
-  node->request = request;
-  node->response = response;
+  size_t timeout_ms = (call_opts.timeout_ms ? call_opts.timeout_ms :
+                                              env_.opt().default_rpc_timeout);
+  SessionHot& hot = Hot(node);
+  hot.method = method;
+  hot.response = response;
+  hot.start_ms = NowMs();
   node->done = std::move(done);
-  if (!node->timer_owner.has_timer()) {
+  node->parent_deadline_ms = RpcDeadlineScope::deadline_ms();
+  node->deadline_ms = hot.start_ms + timeout_ms;
+  StartSessionTimer(node, timeout_ms);
+  node->endpoint_index = 0;
+  node->endpoint_count = endpoints->size();
+  if (call_opts.max_attempts && call_opts.max_attempts < endpoints->size()) {
+    node->endpoint_count = call_opts.max_attempts;
+  }
+  endpoints->AddRef();
+  node->endpoint_set = endpoints;
+  node->endpoint_offset = 0;
+  if (!method->hash_key.empty()) {
+    node->endpoint_offset = static_cast<uint16_t>(
+        load_balancer_.PickByHash(node->endpoint_set,
+                                  RequestKey::Hash(method->hash_key,
+                                                   *request),
+                                  method->hash_load_factor));
+    node->lb_stats = load_balancer_.OnSent(Endpoint(node, 0));
+  } else if (method->lb_policy != kRoutedOrder) {
+    node->endpoint_offset = static_cast<uint16_t>(
+        load_balancer_.Pick(method->lb_policy, node->endpoint_set));
+    node->lb_stats = load_balancer_.OnSent(Endpoint(node, 0));
+  }
+  // the session may be done within sending, so arm hedging before it
+  size_t hedge_delay_ms = HedgeDelay(method, call_opts);
+  if (hedge_delay_ms && hedge_delay_ms < timeout_ms &&
+      node->endpoint_count > 1) {
+    node->hedge_pending = true;
+    if (!node->hedge_timer_owner.has_timer()) {
+      env_.timerw()->AddTimer(
+           hedge_delay_ms,
+           ccb::BindClosure(this, &RpcSessionManager::OnHedgeTimeout, node),
+           &node->hedge_timer_owner);
+    } else {
+      env_.timerw()->ResetTimer(node->hedge_timer_owner, hedge_delay_ms);
+    }
+  }
+  node->inflight_attempts = 1;
+  if (method->retry_budget) {
+    method->retry_budget->OnFirstAttempt();
+  }
+  // encode request once for all endpoints to be tried
+  Buf req_pkt = on_encode_request_(method, *request, hot.rpc_id,
+                                   timeout_ms);
+  node->req_pkt_ptr = const_cast<void*>(req_pkt.ptr());
+  node->req_pkt_len = req_pkt.len();
+  on_send_request_(req_pkt, hot.rpc_id, timeout_ms, Endpoint(node, 0));
+  return true;
+}
+
+bool RpcSessionManager::AddFanOutSession(
+                  MethodEntry* method,
+                  const std::vector<const ::google::protobuf::Message*>&
+                      requests,
+                  const std::vector<::google::protobuf::Message*>& responses,
+                  std::vector<Result>* results,
+                  const EndpointList& endpoint_list,
+                  const CallOptions& call_opts,
+                  ::ccb::ClosureFunc<void(Result)> done)
+{
+  size_t shard_num = responses.size();
+  if (shard_num == 0 || shard_num > 65536 ||
+      (requests.size() != 1 && requests.size() != shard_num)) {
+    WLOG("invalid fan-out shards!");
+    done(kInError);
+    return false;
+  }
+  size_t timeout_ms = (call_opts.timeout_ms ? call_opts.timeout_ms :
+                                              env_.opt().default_rpc_timeout);
+  FanOutNode* fanout = AllocFanOutNode();
+  fanout->finished = false;
+  fanout->dispatching = true;
+  fanout->quorum = shard_num;
+  if (call_opts.quorum && call_opts.quorum < shard_num) {
+    fanout->quorum = call_opts.quorum;
+  }
+  fanout->pending = shard_num;
+  fanout->succeeded = 0;
+  fanout->results = results;
+  fanout->results->assign(shard_num, kTimeout);
+  fanout->shards.assign(shard_num, nullptr);
+  fanout->done = std::move(done);
+  fanout->parent_deadline_ms = RpcDeadlineScope::deadline_ms();
+  if (!fanout->timer_owner.has_timer()) {
     env_.timerw()->AddTimer(
-         env_.opt().default_rpc_timeout,
-         ccb::BindClosure(this, &RpcSessionManager::OnSessionTimeout, node),
-         &node->timer_owner);
+         timeout_ms,
+         ccb::BindClosure(this, &RpcSessionManager::OnFanOutTimeout, fanout),
+         &fanout->timer_owner);
   } else {
-    env_.timerw()->ResetTimer(node->timer_owner,
-                              env_.opt().default_rpc_timeout);
+    env_.timerw()->ResetTimer(fanout->timer_owner, timeout_ms);
+  }
+  // encode all packets before sending any of them, as shards may be done
+  // and freed within sending
+  uint64_t now_ms = NowMs();
+  const SessionNode* encoded = nullptr;
+  for (size_t i = 0; i < shard_num && !fanout->finished; i++) {
+    if (i >= endpoint_list.size()) {
+      OnShardDone(fanout, i, kNoRoute);
+      continue;
+    }
+    SessionNode* node = AllocSessionNode();
+    if (!node) {
+      WLOG("AllocSessionNode failed!");
+      OnShardDone(fanout, i, kInError);
+      continue;
+    }
+    SessionHot& hot = Hot(node);
+    hot.method = method;
+    hot.response = responses[i];
+    hot.start_ms = now_ms;
+    node->deadline_ms = now_ms + timeout_ms;
+    node->endpoint_index = static_cast<uint16_t>(i);
+    node->endpoint_count = 0; // no failover
+    node->inflight_attempts = 1;
+    node->fanout = fanout;
+    node->shard_index = i;
+    fanout->shards[i] = node;
+    Buf req_pkt = (requests.size() == 1 && encoded) ?
+                  on_clone_request_({encoded->req_pkt_ptr,
+                                     encoded->req_pkt_len}, hot.rpc_id) :
+                  on_encode_request_(method, *requests[requests.size() > 1 ?
+                                                       i : 0],
+                                     hot.rpc_id, timeout_ms);
+    node->req_pkt_ptr = const_cast<void*>(req_pkt.ptr());
+    node->req_pkt_len = req_pkt.len();
+    encoded = node;
+  }
+  for (size_t i = 0; i < shard_num && !fanout->finished; i++) {
+    SessionNode* node = fanout->shards[i];
+    if (node) {
+      on_send_request_({node->req_pkt_ptr, node->req_pkt_len},
+                       Hot(node).rpc_id, timeout_ms,
+                       endpoint_list.GetEndpoint(i));
+    }
+  }
+  fanout->dispatching = false;
+  if (fanout->finished) {
+    FreeFanOutNode(fanout);
   }
-  node->endpoint_index = 0;
-  node->endpoint_list = endpoint_list;
-  on_send_request_(method, *request, node->rpc_id,
-                   node->endpoint_list.GetEndpoint(0));
   return true;
 }
 
+void RpcSessionManager::OnShardDone(FanOutNode* fanout, size_t shard_index,
+                                    Result result)
+{
+  (*fanout->results)[shard_index] = result;
+  fanout->shards[shard_index] = nullptr;
+  fanout->pending--;
+  if (result == kSuccess) {
+    fanout->succeeded++;
+  }
+  if (fanout->succeeded >= fanout->quorum) {
+    FinishFanOut(fanout, kSuccess);
+  } else if (fanout->succeeded + fanout->pending < fanout->quorum) {
+    // fails with the result making quorum unreachable
+    FinishFanOut(fanout, result);
+  }
+}
+
+void RpcSessionManager::OnFanOutTimeout(FanOutNode* fanout)
+{
+  // the node may have been freed or reused at the same tick, see
+  // OnSessionTimeout()
+  if (fanout->in_use && !fanout->finished) {
+    DLOG("fan-out timeout with %lu shards pending", fanout->pending);
+    FinishFanOut(fanout, kTimeout);
+  }
+}
+
+void RpcSessionManager::FinishFanOut(FanOutNode* fanout, Result result)
+{
+  fanout->finished = true;
+  fanout->timer_owner.Cancel();
+  // responses of shards pending are dropped later
+  for (SessionNode*& node : fanout->shards) {
+    if (node) {
+      FreeSessionNode(node);
+      node = nullptr;
+    }
+  }
+  {
+    RpcDeadlineScope deadline_scope(fanout->parent_deadline_ms);
+    fanout->done(result);
+  }
+  // otherwise freed at the end of AddFanOutSession()
+  if (!fanout->dispatching) {
+    FreeFanOutNode(fanout);
+  }
+}
+
+RpcSessionManager::FanOutNode* RpcSessionManager::AllocFanOutNode()
+{
+  if (free_fanouts_.empty()) {
+    fanout_pool_.emplace_back(new FanOutNode);
+    free_fanouts_.push_back(fanout_pool_.back().get());
+  }
+  FanOutNode* fanout = free_fanouts_.back();
+  free_fanouts_.pop_back();
+  fanout->in_use = true;
+  return fanout;
+}
+
+void RpcSessionManager::FreeFanOutNode(FanOutNode* fanout)
+{
+  fanout->in_use = false;
+  fanout->done = nullptr;
+  free_fanouts_.push_back(fanout);
+}
+
 void RpcSessionManager::OnSendRequestFailed(uint64_t rpc_id)
 {
   SessionNode* node = FindSessionNode(rpc_id);
@@ -108,21 +371,122 @@ void RpcSessionManager::OnSendRequestFailed(uint64_t rpc_id)
     ILOG("OnSentResult: cannot find session node");
     return;
   }
-  if (++node->endpoint_index < node->endpoint_list.size()) {
-    // try next endpoint
-    on_send_request_(node->method, *node->request, node->rpc_id,
-                     node->endpoint_list.GetEndpoint(node->endpoint_index));
-  } else {
-    // all endpoints failed before session timeout
-    DLOG("all endpoints timeout");
-    node->done(kTimeout);
-    node->timer_owner.Cancel();
+  if (node->fanout) {
+    // no failover for shards
+    FanOutNode* fanout = node->fanout;
+    size_t shard_index = node->shard_index;
     FreeSessionNode(node);
+    OnShardDone(fanout, shard_index, kTimeout);
+    return;
+  }
+  node->inflight_attempts--;
+  // the first failure is taken as the picked endpoint's, which is tried
+  // first unless the session was hedged
+  if (node->lb_stats) {
+    load_balancer_.OnDone(node->lb_stats, 0, true);
+    node->lb_stats = nullptr;
+  }
+  if (TryNextEndpoint(node)) {
+    return;
+  }
+  if (node->inflight_attempts > 0) {
+    // a hedged attempt is still in flight
+    DLOG("attempt of rpc_id:%lu failed, waiting for others", rpc_id);
+    return;
+  }
+  // all endpoints failed or no time left for another one
+  DLOG("all endpoints timeout");
+  {
+    RpcDeadlineScope deadline_scope(node->parent_deadline_ms);
+    node->done(kTimeout);
+  }
+  CancelSessionTimer(node);
+  FreeSessionNode(node);
+}
+
+bool RpcSessionManager::TryNextEndpoint(SessionNode* node)
+{
+  uint64_t now_ms = NowMs();
+  if (node->endpoint_index + 1UL >= node->endpoint_count ||
+      now_ms >= node->deadline_ms) {
+    return false;
+  }
+  const SessionHot& hot = Hot(node);
+  if (hot.method->retry_budget && !hot.method->retry_budget->TryRetry()) {
+    DLOG("retry of rpc_id:%lu suppressed by budget", hot.rpc_id);
+    retries_suppressed_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  retries_.fetch_add(1, std::memory_order_relaxed);
+  // try next endpoint with the time left
+  node->endpoint_index++;
+  node->inflight_attempts++;
+  on_send_request_({node->req_pkt_ptr, node->req_pkt_len}, hot.rpc_id,
+                   static_cast<uint32_t>(node->deadline_ms - now_ms),
+                   Endpoint(node, node->endpoint_index));
+  return true;
+}
+
+void RpcSessionManager::OnHedgeTimeout(SessionNode* node)
+{
+  // the node may have been freed or reused without hedging at the same
+  // tick, see OnSessionTimeout()
+  if (!Hot(node).rpc_id || !node->hedge_pending) {
+    return;
   }
+  node->hedge_pending = false;
+  DLOG("send hedged request of rpc_id:%lu", Hot(node).rpc_id);
+  TryNextEndpoint(node);
+}
+
+size_t RpcSessionManager::HedgeDelay(const MethodEntry* method,
+                                     const CallOptions& call_opts) const
+{
+  if (call_opts.hedge_delay_ms) {
+    return call_opts.hedge_delay_ms;
+  }
+  // the derived one is 0 until enough latencies observed
+  if (method->hedge_delay_ms) {
+    return method->hedge_delay_ms;
+  }
+  return env_.opt().hedge_delay_ms;
+}
+
+void RpcSessionManager::UpdateLatency(MethodEntry* method,
+                                      uint64_t latency_ms)
+{
+  method->latency_ms.Add(latency_ms);
+  size_t percentile = env_.opt().hedge_percentile;
+  size_t count = method->latency_ms.count();
+  // the percentile is refreshed periodically as it takes a full scan
+  if (percentile && count >= kMinHedgeSamples &&
+      count % kHedgeRefreshSamples == 0) {
+    method->hedge_delay_ms = std::max<uint64_t>(
+                             method->latency_ms.Percentile(percentile), 1);
+  }
+}
+
+void RpcSessionManager::MoveToLocalNode()
+{
+  for (auto& segment : segments_) {
+    if (segment && (!segment->hot.memory().MoveToLocalNode() ||
+                    !segment->nodes.memory().MoveToLocalNode())) {
+      ILOG("move session pool to local NUMA node failed");
+      return;
+    }
+  }
+}
+
+void RpcSessionManager::GetStats(RpcStats* stats) const
+{
+  stats->retries += retries_.load(std::memory_order_relaxed);
+  stats->retries_suppressed += retries_suppressed_.load(
+                               std::memory_order_relaxed);
+  stats->session_capacity += session_capacity_.load(
+                             std::memory_order_relaxed);
 }
 
-void RpcSessionManager::OnRecvResponse(const std::string& service,
-                                       const std::string& method,
+void RpcSessionManager::OnRecvResponse(uint32_t method_id,
                                        uint64_t rpc_id,
                                        Result rpc_result,
                                        const Buf& resp_body)
@@ -132,20 +496,37 @@ void RpcSessionManager::OnRecvResponse(const std::string& service,
     ILOG("OnRecvResponse: cannot find session node");
     return;
   }
-  if (node->method->service()->name() != service ||
-      node->method->name() != method) {
-    ILOG("OnRecvResponse: node found but service-method name dismatch");
+  const SessionHot& hot = Hot(node);
+  if (hot.method->method_id != method_id) {
+    ILOG("OnRecvResponse: node found but method-id dismatch");
     return;
   }
-  if (!node->response->ParseFromArray(resp_body.ptr(), resp_body.len())) {
+  if (!hot.response->ParseFromArray(resp_body.ptr(), resp_body.len())) {
     ILOG("OnRecvResponse: parse response message failed");
     return;
   }
-  // rpc done callback
+  UpdateLatency(hot.method, NowMs() - hot.start_ms);
+  if (node->fanout) {
+    FanOutNode* fanout = node->fanout;
+    size_t shard_index = node->shard_index;
+    FreeSessionNode(node);
+    OnShardDone(fanout, shard_index, rpc_result);
+    return;
+  }
+  // responses do not tell the endpoint, which is mostly the picked one
+  if (node->lb_stats) {
+    load_balancer_.OnDone(node->lb_stats, NowMs() - hot.start_ms,
+                          rpc_result == kNotImpl || rpc_result == kInError);
+    node->lb_stats = nullptr;
+  }
+  // rpc done callback, responses of other attempts are ignored later
   DLOG("rpc done with response result:%d", static_cast<int>(rpc_result));
-  node->done(rpc_result);
+  {
+    RpcDeadlineScope deadline_scope(node->parent_deadline_ms);
+    node->done(rpc_result);
+  }
   // cleanup
-  node->timer_owner.Cancel();
+  CancelSessionTimer(node);
   FreeSessionNode(node);
 }
 
@@ -155,33 +536,120 @@ void RpcSessionManager::OnSessionTimeout(SessionNode* node)
   // occur at the same time, that is, timer callbacks launched at the same 
   // ccb::TimerWheel tick and the former one calling timer_owner.Cancel() 
   // does not really cancel the latter one
-  DLOG("RPC session timeout rpc_id:%lu", node->rpc_id);
-  if (node->rpc_id) {
+  // the node may also have been reused and queued in the same tick, then
+  // it is left to its TimeoutQueue
+  DLOG("RPC session timeout rpc_id:%lu", Hot(node).rpc_id);
+  if (Hot(node).rpc_id && !node->timeout_queue) {
+    RpcDeadlineScope deadline_scope(node->parent_deadline_ms);
     node->done(kTimeout);
     FreeSessionNode(node);
   }
 }
 
-RpcSessionManager::SessionNode* RpcSessionManager::AllocSessionNode()
+void RpcSessionManager::StartSessionTimer(SessionNode* node,
+                                          size_t timeout_ms)
+{
+  TimeoutQueue* queue = nullptr;
+  for (size_t i = 0; i < timeout_queue_num_; i++) {
+    if (timeout_queues_[i].timeout_ms == timeout_ms) {
+      queue = &timeout_queues_[i];
+      break;
+    }
+  }
+  if (!queue && timeout_queue_num_ < kMaxTimeoutQueues) {
+    queue = &timeout_queues_[timeout_queue_num_++];
+    queue->timeout_ms = timeout_ms;
+    queue->head = queue->tail = nullptr;
+  }
+  for (size_t i = 1; !queue && i < timeout_queue_num_; i++) {
+    if (!timeout_queues_[i].head) {
+      queue = &timeout_queues_[i];
+      queue->timeout_ms = timeout_ms;
+    }
+  }
+  if (queue) {
+    // deadlines are in order within the queue as NowMs() never decreases
+    node->timeout_queue = queue;
+    node->timeout_prev = queue->tail;
+    node->timeout_next = nullptr;
+    if (queue->tail) {
+      queue->tail->timeout_next = node;
+    } else {
+      queue->head = node;
+    }
+    queue->tail = node;
+    return;
+  }
+  if (!node->timer_owner.has_timer()) {
+    env_.timerw()->AddTimer(
+         timeout_ms,
+         ccb::BindClosure(this, &RpcSessionManager::OnSessionTimeout, node),
+         &node->timer_owner);
+  } else {
+    env_.timerw()->ResetTimer(node->timer_owner, timeout_ms);
+  }
+}
+
+void RpcSessionManager::CancelSessionTimer(SessionNode* node)
 {
-  for (size_t i = 0; i < (1UL << pool_size_order_); i++) {
-    uint64_t rpc_id = NextRpcId();
-    SessionNode* node = &sess_pool_[rpc_id & pool_size_mask_];
-    if (node->rpc_id == 0) {
-      // got empty node
-      node->rpc_id = rpc_id;
-      return node;
+  TimeoutQueue* queue = node->timeout_queue;
+  if (!queue) {
+    node->timer_owner.Cancel();
+    return;
+  }
+  if (node->timeout_prev) {
+    node->timeout_prev->timeout_next = node->timeout_next;
+  } else {
+    queue->head = node->timeout_next;
+  }
+  if (node->timeout_next) {
+    node->timeout_next->timeout_prev = node->timeout_prev;
+  } else {
+    queue->tail = node->timeout_prev;
+  }
+  node->timeout_queue = nullptr;
+}
+
+void RpcSessionManager::OnTimeoutTick()
+{
+  uint64_t now_ms = NowMs();
+  for (size_t i = 0; i < timeout_queue_num_; i++) {
+    TimeoutQueue& queue = timeout_queues_[i];
+    while (queue.head && queue.head->deadline_ms <= now_ms) {
+      SessionNode* node = queue.head;
+      CancelSessionTimer(node);
+      OnSessionTimeout(node);
     }
   }
-  return nullptr;
+}
+
+RpcSessionManager::SessionNode* RpcSessionManager::AllocSessionNode()
+{
+  if (free_nodes_.empty() && !AddSegment()) {
+    return nullptr;
+  }
+  SessionNode* node = free_nodes_.back();
+  free_nodes_.pop_back();
+  SessionSegment* segment = Segment(node->slot);
+  segment->in_use++;
+  segment->idle_checks = 0;
+  // stale responses of previous generations mismatch the rpc_id
+  constexpr uint64_t seq_mask = (1UL << kRpcIdSeqPartBits) - 1;
+  node->generation++;
+  segment->hot[node->slot & segment_mask_].rpc_id =
+      rpc_id_base_ +
+      (((node->generation << pool_size_order_) | node->slot) & seq_mask);
+  return node;
 }
 
 RpcSessionManager::SessionNode* RpcSessionManager::FindSessionNode(
                                                    uint64_t rpc_id)
 {
-  SessionNode* node = &sess_pool_[rpc_id & pool_size_mask_];
-  if (node->rpc_id == rpc_id) {
-    return node;
+  // only the dense SessionHot is touched for stale responses
+  size_t slot = rpc_id & pool_size_mask_;
+  SessionSegment* segment = Segment(slot);
+  if (segment && segment->hot[slot & segment_mask_].rpc_id == rpc_id) {
+    return &segment->nodes[slot & segment_mask_];
   } else {
     ILOG("rpc_id dismatch when finding session node");
     return nullptr;
@@ -191,9 +659,103 @@ RpcSessionManager::SessionNode* RpcSessionManager::FindSessionNode(
 void RpcSessionManager::FreeSessionNode(SessionNode* node)
 {
   // reset to zero means node freed
-  node->rpc_id = 0;
-  // free memory of closure in time
+  Hot(node).rpc_id = 0;
+  Segment(node->slot)->in_use--;
+  free_nodes_.push_back(node);
+  node->fanout = nullptr;
+  // the picked endpoint timed out
+  if (node->lb_stats) {
+    load_balancer_.OnDone(node->lb_stats, 0, true);
+    node->lb_stats = nullptr;
+  }
+  if (node->endpoint_set) {
+    node->endpoint_set->Release();
+    node->endpoint_set = nullptr;
+  }
+  if (node->hedge_pending) {
+    node->hedge_pending = false;
+    node->hedge_timer_owner.Cancel();
+  }
+  // free memory of closure and request packet in time
   node->done = nullptr;
+  if (node->req_pkt_ptr) {
+    env_.alloc().Free(node->req_pkt_ptr, node->req_pkt_len);
+    node->req_pkt_ptr = nullptr;
+  }
+}
+
+bool RpcSessionManager::AddSegment()
+{
+  auto it = std::find(segments_.begin(), segments_.end(), nullptr);
+  if (it == segments_.end()) {
+    WRET_F("session pool of %lu nodes is exhausted", pool_size_mask_ + 1);
+  }
+  size_t index = it - segments_.begin();
+  size_t size = segment_mask_ + 1;
+  std::unique_ptr<SessionSegment> segment(new SessionSegment);
+  if (!segment->hot.Init(size, env_.opt().huge_page_pools) ||
+      !segment->nodes.Init(size, env_.opt().huge_page_pools)) {
+    ERET_F("map session segment of %lu nodes failed!", size);
+  }
+  segment->in_use = 0;
+  segment->idle_checks = 0;
+  // nodes of lower slots are allocated first
+  for (size_t i = size; i > 0; i--) {
+    SessionNode* node = &segment->nodes[i - 1];
+    node->slot = (index << segment_order_) + i - 1;
+    node->generation = segment_generations_[index];
+    free_nodes_.push_back(node);
+  }
+  segments_[index] = std::move(segment);
+  session_capacity_.fetch_add(size, std::memory_order_relaxed);
+  DLOG("session segment %lu committed", index);
+  return true;
+}
+
+void RpcSessionManager::ReleaseSegment(size_t index)
+{
+  SessionSegment* segment = segments_[index].get();
+  uint64_t generation = segment_generations_[index];
+  for (size_t i = 0; i < segment->nodes.size(); i++) {
+    generation = std::max(generation, segment->nodes[i].generation);
+  }
+  segment_generations_[index] = generation;
+  session_capacity_.fetch_sub(segment->nodes.size(),
+                              std::memory_order_relaxed);
+  segments_[index].reset();
+  DLOG("session segment %lu released", index);
+}
+
+void RpcSessionManager::OnShrinkCheck()
+{
+  // the first segment is kept
+  size_t released = 0;
+  for (size_t i = 1; i < segments_.size(); i++) {
+    SessionSegment* segment = segments_[i].get();
+    if (segment && segment->in_use == 0 &&
+        ++segment->idle_checks >= kShrinkChecks) {
+      released++;
+    }
+  }
+  if (released == 0) {
+    return;
+  }
+  // drop free nodes of segments to be released while they are mapped
+  auto releasing = [this](size_t slot) {
+    const SessionSegment* segment = Segment(slot);
+    return (slot >> segment_order_) > 0 && segment->in_use == 0 &&
+           segment->idle_checks >= kShrinkChecks;
+  };
+  free_nodes_.erase(std::remove_if(free_nodes_.begin(), free_nodes_.end(),
+                                   [&releasing](const SessionNode* node) {
+                                     return releasing(node->slot);
+                                   }),
+                    free_nodes_.end());
+  for (size_t i = 1; i < segments_.size(); i++) {
+    if (segments_[i] && releasing(i << segment_order_)) {
+      ReleaseSegment(i);
+    }
+  }
 }
 
 } // namespace hrpc
@@ -30,71 +30,259 @@
 #ifndef _HRPC_RPC_SESSION_MANAGER_H
 #define _HRPC_RPC_SESSION_MANAGER_H
 
+#include <atomic>
 #include <ccbase/timer_wheel.h>
 #include "hyperrpc/hyperrpc.h"
 #include "hyperrpc/env.h"
 #include "hyperrpc/constants.h"
 #include "hyperrpc/endpoint_list.h"
+#include "hyperrpc/endpoint_set.h"
+#include "hyperrpc/load_balancer.h"
+#include "hyperrpc/method_table.h"
+#include "hyperrpc/pool_memory.h"
 
 namespace hrpc {
 
 class RpcSessionManager
 {
 public:
+  // the packet encoded must be allocated from Env::alloc(), it is owned by
+  // the session and resent when trying next endpoints, with timeout_ms
+  // updated to the time left
+  using OnEncodeRequest = ccb::ClosureFunc<
+                             Buf(const MethodEntry*,
+                                 const google::protobuf::Message&,
+                                 uint64_t rpc_id,
+                                 uint32_t timeout_ms)>;
   using OnSendRequest = ccb::ClosureFunc<
-                             void(const google::protobuf::MethodDescriptor*,
-                                  const google::protobuf::Message&,
+                             void(const Buf& pkt,
                                   uint64_t rpc_id,
+                                  uint32_t timeout_ms,
                                   const Addr&)>;
+  // copy a packet encoded with another rpc_id, so that a request sent to
+  // many endpoints is serialized once
+  using OnCloneRequest = ccb::ClosureFunc<
+                             Buf(const Buf& pkt,
+                                 uint64_t rpc_id)>;
 
   RpcSessionManager(const Env& env);
   ~RpcSessionManager();
 
   bool Init(size_t sess_pool_size,
             size_t rpc_core_id,
-            OnSendRequest on_send_req);
-  bool AddSession(const ::google::protobuf::MethodDescriptor* method,
+            OnEncodeRequest on_encode_req,
+            OnSendRequest on_send_req,
+            OnCloneRequest on_clone_req);
+  bool AddSession(MethodEntry* method,
                   const ::google::protobuf::Message* request,
                   ::google::protobuf::Message* response,
                   const EndpointList& endpoint_list,
+                  const CallOptions& call_opts,
+                  ::ccb::ClosureFunc<void(Result)> done);
+  // @endpoints is interned by InternEndpoints() and referenced by the
+  // session as well
+  bool AddSession(MethodEntry* method,
+                  const ::google::protobuf::Message* request,
+                  ::google::protobuf::Message* response,
+                  EndpointSet* endpoints,
+                  const CallOptions& call_opts,
+                  ::ccb::ClosureFunc<void(Result)> done);
+  // the set returned is referenced once for the caller
+  EndpointSet* InternEndpoints(const EndpointList& endpoint_list) {
+    return endpoint_sets_.Intern(endpoint_list);
+  }
+  // shard i sends requests[i] (or requests[0] to all) to endpoint i and
+  // gets responses[i], the call is done when the quorum of shards succeed
+  // or it is not reachable any more, or by timeout
+  bool AddFanOutSession(
+                  MethodEntry* method,
+                  const std::vector<const ::google::protobuf::Message*>&
+                      requests,
+                  const std::vector<::google::protobuf::Message*>& responses,
+                  std::vector<Result>* results,
+                  const EndpointList& endpoint_list,
+                  const CallOptions& call_opts,
                   ::ccb::ClosureFunc<void(Result)> done);
   void OnSendRequestFailed(uint64_t rpc_id);
-  void OnRecvResponse(const std::string& service,
-                      const std::string& method,
+  void OnRecvResponse(uint32_t method_id,
                       uint64_t rpc_id,
                       Result rpc_result,
                       const Buf& resp_body);
+  // add counters to @stats, which is safe to call from any thread
+  void GetStats(RpcStats* stats) const;
+  // migrate session pool to the NUMA node of the calling thread
+  void MoveToLocalNode();
+  // whether sessions of @timeout_ms are expired by a TimeoutQueue now
+  bool IsQueuedTimeout(size_t timeout_ms) const {
+    for (size_t i = 0; i < timeout_queue_num_; i++) {
+      if (timeout_queues_[i].timeout_ms == timeout_ms) return true;
+    }
+    return false;
+  }
 
 private:
-  struct SessionNode {
-    SessionNode() : rpc_id(0) {}
+  // derive hedging delay from latencies after enough samples
+  static constexpr size_t kMinHedgeSamples = 64;
+  static constexpr size_t kHedgeRefreshSamples = 64;
+  // session pool is committed in segments of 2^kSegmentOrder nodes, and
+  // unused segments are checked kShrinkChecks times before released
+  static constexpr size_t kSegmentOrder = 12;
+  static constexpr size_t kShrinkChecks = 4;
+  // distinct session timeouts expired by TimeoutQueue at the same time,
+  // others use timers
+  static constexpr size_t kMaxTimeoutQueues = 4;
+  // endpoint sets unused for a whole period are freed
+  static constexpr size_t kEndpointSetSweepMs = 10000;
+
+  struct FanOutNode;
+
+  // fields needed to match and parse responses, kept in a dense array
+  // apart from SessionNode of the same slot
+  struct SessionHot {
+    SessionHot() : rpc_id(0) {}
     uint64_t rpc_id; // value 0 stands for empty node
-    const google::protobuf::MethodDescriptor* method;
-    const google::protobuf::Message* request;
+    MethodEntry* method;
     google::protobuf::Message* response;
+    uint64_t start_ms; // in NowMs()
+  };
+
+  struct TimeoutQueue;
+
+  struct SessionNode {
+    SessionNode() : generation(0), req_pkt_ptr(nullptr),
+                    timeout_queue(nullptr), hedge_pending(false),
+                    endpoint_set(nullptr), lb_stats(nullptr),
+                    fanout(nullptr) {}
+    size_t slot; // index in the whole pool
+    uint64_t generation; // bumped on each allocation of the node
+    void* req_pkt_ptr;
+    size_t req_pkt_len;
+    uint64_t deadline_ms; // in NowMs()
     ccb::ClosureFunc<void(Result)> done;
+    // deadline of the incoming RPC the call is issued for, restored when
+    // done is called, see RpcDeadlineScope
+    uint64_t parent_deadline_ms;
+    // linked in timeout_queue if set, otherwise timer_owner is used
+    TimeoutQueue* timeout_queue;
+    SessionNode* timeout_prev;
+    SessionNode* timeout_next;
+    ccb::TimerOwner timer_owner;
+    ccb::TimerOwner hedge_timer_owner;
+    bool hedge_pending;
+    uint16_t endpoint_index; // of attempts, see Endpoint()
+    uint16_t endpoint_offset; // of the endpoint picked by LoadBalancer
+    uint16_t inflight_attempts; // sent and not failed yet
+    size_t endpoint_count; // endpoints to be tried at most
+    EndpointSet* endpoint_set; // referenced, nullptr for fan-out shards
+    // stats of the endpoint picked, set until its attempt is done
+    LoadBalancer::EndpointStats* lb_stats;
+    // set if the node is a shard of fan-out call
+    FanOutNode* fanout;
+    size_t shard_index;
+  };
+
+  // memory of the pool is committed and released by segments, and slots
+  // of segments not committed are never matched
+  struct SessionSegment {
+    PoolArray<SessionHot> hot;
+    PoolArray<SessionNode> nodes;
+    size_t in_use;
+    size_t idle_checks; // successive checks found it unused
+  };
+
+  // sessions of the same timeout expire in the order they are added, so
+  // they are queued and expired by ticks without a timer each
+  struct TimeoutQueue {
+    size_t timeout_ms;
+    SessionNode* head;
+    SessionNode* tail;
+  };
+
+  // a fan-out call shares its timer and closure among shards
+  struct FanOutNode {
+    FanOutNode() : in_use(false) {}
+    bool in_use;
+    bool finished;    // done has been called
+    bool dispatching; // within AddFanOutSession()
+    size_t quorum;
+    size_t pending;   // shards not done yet
+    size_t succeeded;
+    std::vector<Result>* results;
+    std::vector<SessionNode*> shards; // nullptr once done
+    ccb::ClosureFunc<void(Result)> done;
+    uint64_t parent_deadline_ms; // see SessionNode
     ccb::TimerOwner timer_owner;
-    uint16_t endpoint_index;
-    EndpointList endpoint_list;
   };
 
   void OnSessionTimeout(SessionNode* node);
+  void StartSessionTimer(SessionNode* node, size_t timeout_ms);
+  void CancelSessionTimer(SessionNode* node);
+  void OnTimeoutTick();
+  void OnHedgeTimeout(SessionNode* node);
+  void OnShardDone(FanOutNode* fanout, size_t shard_index, Result result);
+  void OnFanOutTimeout(FanOutNode* fanout);
+  void FinishFanOut(FanOutNode* fanout, Result result);
+  FanOutNode* AllocFanOutNode();
+  void FreeFanOutNode(FanOutNode* fanout);
+  bool TryNextEndpoint(SessionNode* node);
+  size_t HedgeDelay(const MethodEntry* method,
+                    const CallOptions& call_opts) const;
+  void UpdateLatency(MethodEntry* method, uint64_t latency_ms);
   SessionNode* AllocSessionNode();
   SessionNode* FindSessionNode(uint64_t rpc_id);
   void FreeSessionNode(SessionNode* node);
+  bool AddSegment();
+  void ReleaseSegment(size_t index);
+  void OnShrinkCheck();
+
+  SessionSegment* Segment(size_t slot) {
+    return segments_[slot >> segment_order_].get();
+  }
+  SessionHot& Hot(const SessionNode* node) {
+    return Segment(node->slot)->hot[node->slot & segment_mask_];
+  }
+  // endpoints are tried from the one picked, in the routed order
+  Addr Endpoint(const SessionNode* node, size_t index) const {
+    size_t size = node->endpoint_set->size();
+    return node->endpoint_set->GetEndpoint(
+                               (node->endpoint_offset + index) % size);
+  }
 
-  uint64_t NextRpcId() {
-    constexpr size_t mask = (1UL << kRpcIdSeqPartBits) - 1;
-    next_rpc_id_ = (next_rpc_id_ & ~mask) + ((next_rpc_id_ + 1) & mask);
-    return next_rpc_id_;
+  // session deadlines follow timer ticks of 1ms, so that they agree with
+  // the session timer
+  uint64_t NowMs() const {
+    return env_.timerw()->GetCurrentTick();
   }
 
   const Env& env_;
+  // sessions are routed the same mostly, which share interned endpoints
+  EndpointSetTable endpoint_sets_;
+  ccb::TimerOwner sweep_timer_owner_;
+  LoadBalancer load_balancer_;
   size_t pool_size_order_;
   size_t pool_size_mask_;
-  std::unique_ptr<SessionNode[]> sess_pool_;
-  uint64_t next_rpc_id_;
+  size_t segment_order_;
+  size_t segment_mask_;
+  // nullptr if the segment is not committed
+  std::vector<std::unique_ptr<SessionSegment>> segments_;
+  // generations to resume with when segments are committed again
+  std::vector<uint64_t> segment_generations_;
+  ccb::TimerOwner shrink_timer_owner_;
+  TimeoutQueue timeout_queues_[kMaxTimeoutQueues];
+  size_t timeout_queue_num_;
+  ccb::TimerOwner timeout_tick_owner_;
+  // RPC_ID = CORE_ID_PLUS_1(16bit) + GENERATION + SLOT(pool_size_order_)
+  uint64_t rpc_id_base_;
+  std::vector<SessionNode*> free_nodes_;
+  OnEncodeRequest on_encode_request_;
   OnSendRequest on_send_request_;
+  OnCloneRequest on_clone_request_;
+  std::vector<std::unique_ptr<FanOutNode>> fanout_pool_;
+  std::vector<FanOutNode*> free_fanouts_;
+  // written by the owner thread only
+  std::atomic<uint64_t> retries_;
+  std::atomic<uint64_t> retries_suppressed_;
+  std::atomic<uint64_t> session_capacity_;
 };
 
 } // namespace hrpc
@@ -0,0 +1,68 @@
+#include <thread>
+#include <google/protobuf/arena.h>
+#include <gtestx/gtestx.h>
+#include "hyperrpc/arena_block_alloc.h"
+
+class ArenaBlockAllocTest : public testing::Test
+{
+protected:
+  virtual void SetUp() {
+    options_.start_block_size = 4096;
+    options_.max_block_size = 4096;
+    options_.block_alloc = &hrpc::ArenaBlockAlloc::Alloc;
+    options_.block_dealloc = &hrpc::ArenaBlockAlloc::Free;
+  }
+
+  google::protobuf::ArenaOptions options_;
+};
+
+TEST_F(ArenaBlockAllocTest, ReuseBlock)
+{
+  size_t cached_bytes = hrpc::ArenaBlockAlloc::CachedBytes();
+  void* block = hrpc::ArenaBlockAlloc::Alloc(3000);
+  ASSERT_TRUE(block != nullptr);
+  hrpc::ArenaBlockAlloc::Free(block, 3000);
+  ASSERT_EQ(cached_bytes + 4096, hrpc::ArenaBlockAlloc::CachedBytes());
+  // same size class
+  ASSERT_EQ(block, hrpc::ArenaBlockAlloc::Alloc(4096));
+  ASSERT_EQ(cached_bytes, hrpc::ArenaBlockAlloc::CachedBytes());
+  hrpc::ArenaBlockAlloc::Free(block, 4096);
+}
+
+TEST_F(ArenaBlockAllocTest, LargeBlock)
+{
+  size_t cached_bytes = hrpc::ArenaBlockAlloc::CachedBytes();
+  void* block = hrpc::ArenaBlockAlloc::Alloc(1024 * 1024);
+  ASSERT_TRUE(block != nullptr);
+  hrpc::ArenaBlockAlloc::Free(block, 1024 * 1024);
+  ASSERT_EQ(cached_bytes, hrpc::ArenaBlockAlloc::CachedBytes());
+}
+
+TEST_F(ArenaBlockAllocTest, CrossThreadFree)
+{
+  void* block = hrpc::ArenaBlockAlloc::Alloc(1000);
+  std::thread thread([block] {
+    hrpc::ArenaBlockAlloc::Free(block, 1000);
+    ASSERT_EQ(1024UL, hrpc::ArenaBlockAlloc::CachedBytes());
+  });
+  thread.join();
+}
+
+TEST_F(ArenaBlockAllocTest, Arena)
+{
+  google::protobuf::Arena arena(options_);
+  for (int i = 0; i < 10; i++) {
+    google::protobuf::Arena::CreateArray<char>(&arena, 1000);
+  }
+  size_t cached_bytes = hrpc::ArenaBlockAlloc::CachedBytes();
+  arena.Reset();
+  ASSERT_LT(cached_bytes, hrpc::ArenaBlockAlloc::CachedBytes());
+}
+
+PERF_TEST_F(ArenaBlockAllocTest, ArenaPerf)
+{
+  google::protobuf::Arena arena(options_);
+  for (int i = 0; i < 10; i++) {
+    google::protobuf::Arena::CreateArray<char>(&arena, 1000);
+  }
+}
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <gtestx/gtestx.h>
+#include "hyperrpc/compressor.h"
+#include "hyperrpc/hyperrpc.h"
+
+class CompressorTest : public testing::Test
+{
+protected:
+  virtual void SetUp() {
+    // profile-like text which is highly compressible
+    for (int i = 0; text_.size() < 4096; i++) {
+      text_ += "{\"uid\":" + std::to_string(10000 + i) +
+               ",\"tags\":[\"sports\",\"music\"],\"score\":0." +
+               std::to_string(i % 97) + "}";
+    }
+    ASSERT_TRUE(Compress(hrpc::kLz4, &lz4_data_));
+    ASSERT_TRUE(Compress(hrpc::kZstd, &zstd_data_));
+    raw_buf_.resize(text_.size());
+  }
+
+  bool Compress(hrpc::CompressType type, std::vector<char>* out) {
+    size_t max_len = hrpc::Compressor::MaxCompressedSize(type, text_.size());
+    out->resize(max_len);
+    size_t len = hrpc::Compressor::Compress(type, text_.data(), text_.size(),
+                                            out->data(), max_len);
+    out->resize(len);
+    return len > 0;
+  }
+
+  bool Decompress(hrpc::CompressType type, const std::vector<char>& data) {
+    return hrpc::Compressor::Decompress(type, data.data(), data.size(),
+                                        raw_buf_.data(), raw_buf_.size());
+  }
+
+  std::string text_;
+  std::vector<char> lz4_data_;
+  std::vector<char> zstd_data_;
+  std::vector<char> raw_buf_;
+};
+
+TEST_F(CompressorTest, RoundTrip)
+{
+  fprintf(stderr, "raw:%lu lz4:%lu zstd:%lu\n", text_.size(),
+          lz4_data_.size(), zstd_data_.size());
+  ASSERT_LT(lz4_data_.size(), text_.size());
+  ASSERT_LT(zstd_data_.size(), text_.size());
+  ASSERT_TRUE(Decompress(hrpc::kLz4, lz4_data_));
+  ASSERT_EQ(text_, std::string(raw_buf_.data(), raw_buf_.size()));
+  ASSERT_TRUE(Decompress(hrpc::kZstd, zstd_data_));
+  ASSERT_EQ(text_, std::string(raw_buf_.data(), raw_buf_.size()));
+}
+
+TEST_F(CompressorTest, BadInput)
+{
+  ASSERT_EQ(0UL, hrpc::Compressor::MaxCompressedSize(hrpc::kNoCompress, 10));
+  ASSERT_EQ(0UL, hrpc::Compressor::MaxDecompressedSize(hrpc::kNoCompress,
+                                                       10));
+  ASSERT_LE(text_.size(), hrpc::Compressor::MaxDecompressedSize(
+                          hrpc::kLz4, lz4_data_.size()));
+  ASSERT_LE(text_.size(), hrpc::Compressor::MaxDecompressedSize(
+                          hrpc::kZstd, zstd_data_.size()));
+  // raw length must match exactly
+  raw_buf_.resize(text_.size() + 1);
+  ASSERT_FALSE(Decompress(hrpc::kLz4, lz4_data_));
+  ASSERT_FALSE(Decompress(hrpc::kZstd, zstd_data_));
+  raw_buf_.resize(text_.size());
+  // truncated data
+  lz4_data_.resize(lz4_data_.size() / 2);
+  ASSERT_FALSE(Decompress(hrpc::kLz4, lz4_data_));
+  zstd_data_.resize(zstd_data_.size() / 2);
+  ASSERT_FALSE(Decompress(hrpc::kZstd, zstd_data_));
+}
+
+PERF_TEST_F(CompressorTest, Lz4CompressPerf)
+{
+  ASSERT_TRUE(Compress(hrpc::kLz4, &lz4_data_));
+}
+
+PERF_TEST_F(CompressorTest, Lz4DecompressPerf)
+{
+  ASSERT_TRUE(Decompress(hrpc::kLz4, lz4_data_));
+}
+
+PERF_TEST_F(CompressorTest, ZstdCompressPerf)
+{
+  ASSERT_TRUE(Compress(hrpc::kZstd, &zstd_data_));
+}
+
+PERF_TEST_F(CompressorTest, ZstdDecompressPerf)
+{
+  ASSERT_TRUE(Decompress(hrpc::kZstd, zstd_data_));
+}
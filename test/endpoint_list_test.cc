@@ -76,6 +76,23 @@ TEST_F(EndpointListTest, LongList)
   }
 }
 
+TEST_F(EndpointListTest, Reset)
+{
+  for (int i = 0; i < 10; i++) {
+    endpoint_list_.PushBack({"127.0.0.1", static_cast<uint16_t>(i)});
+  }
+  endpoint_list_.Reset();
+  ASSERT_TRUE(endpoint_list_.empty());
+  for (int i = 0; i < 20; i++) {
+    endpoint_list_.PushBack({"127.0.0.1", static_cast<uint16_t>(i + 100)});
+  }
+  ASSERT_EQ(20UL, endpoint_list_.size());
+  for (int i = 0; i < 20; i++) {
+    ASSERT_EQ(hrpc::Addr("127.0.0.1", static_cast<uint16_t>(i + 100)),
+              endpoint_list_.GetEndpoint(i));
+  }
+}
+
 TEST_F(EndpointListTest, CopyConstruct)
 {
   for (size_t i = 0; i < 1000; i++) {
@@ -0,0 +1,59 @@
+#include <gtestx/gtestx.h>
+#include "hyperrpc/endpoint_list.h"
+#include "hyperrpc/endpoint_set.h"
+
+class EndpointSetTest : public testing::Test
+{
+protected:
+  virtual void SetUp() {
+    for (int i = 0; i < 20; i++) {
+      endpoint_list_.PushBack({"127.0.0.1", static_cast<uint16_t>(i)});
+    }
+  }
+
+  virtual void TearDown() {
+  }
+
+  hrpc::EndpointList endpoint_list_;
+  hrpc::EndpointSetTable table_;
+};
+
+TEST_F(EndpointSetTest, Intern)
+{
+  hrpc::EndpointSet* set = table_.Intern(endpoint_list_);
+  ASSERT_EQ(20UL, set->size());
+  for (size_t i = 0; i < set->size(); i++) {
+    ASSERT_EQ(endpoint_list_.GetEndpoint(i), set->GetEndpoint(i));
+  }
+  ASSERT_EQ(1UL, set->refs());
+  ASSERT_EQ(set, table_.Intern(endpoint_list_));
+  ASSERT_EQ(2UL, set->refs());
+  hrpc::EndpointList other(endpoint_list_);
+  other.PushBack({"127.0.0.2", 1234});
+  hrpc::EndpointSet* other_set = table_.Intern(other);
+  ASSERT_NE(set, other_set);
+  ASSERT_EQ(21UL, other_set->size());
+  ASSERT_EQ(2UL, table_.size());
+}
+
+TEST_F(EndpointSetTest, Sweep)
+{
+  hrpc::EndpointSet* set = table_.Intern(endpoint_list_);
+  table_.Sweep();
+  table_.Sweep();
+  // still referenced
+  ASSERT_EQ(1UL, table_.size());
+  set->Release();
+  // interned again before the next sweep
+  ASSERT_EQ(set, table_.Intern(endpoint_list_));
+  set->Release();
+  table_.Sweep();
+  ASSERT_EQ(1UL, table_.size());
+  table_.Sweep();
+  ASSERT_EQ(0UL, table_.size());
+}
+
+PERF_TEST_F(EndpointSetTest, InternPerf)
+{
+  table_.Intern(endpoint_list_)->Release();
+}
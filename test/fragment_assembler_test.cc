@@ -0,0 +1,168 @@
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <gtestx/gtestx.h>
+#include <ccbase/timer_wheel.h>
+#include "hyperrpc/fragment_assembler.h"
+#include "hyperrpc/protocol.h"
+
+class FragmentAssemblerTest : public testing::Test
+{
+protected:
+  static constexpr size_t kFragSize = 100;
+
+  FragmentAssemblerTest()
+    : tw_(1000, false)
+    , env_(hrpc::OptionsBuilder().Reassembly(2, 1000).Build(), &tw_)
+    , assembler_(env_)
+    , addr_("127.0.0.1", 1234) {}
+
+  virtual void SetUp() {
+    ASSERT_TRUE(assembler_.Init());
+    for (size_t i = 0; i < 450; i++) {
+      message_.push_back('a' + i % 26);
+    }
+    meta_.packet_type = hrpc::kResponsePacket;
+    meta_.flags = hrpc::kFragmentFlag;
+    meta_.rpc_id = 1;
+    meta_.total_body_len = message_.size();
+    meta_.frag_count = (message_.size() + kFragSize - 1) / kFragSize;
+    tw_.MoveOn();
+  }
+
+  bool AddFragment(size_t index, hrpc::Buf* message) {
+    meta_.frag_index = index;
+    meta_.frag_offset = index * kFragSize;
+    size_t len = std::min(kFragSize, message_.size() - meta_.frag_offset);
+    return assembler_.Add(meta_, addr_,
+                          {message_.data() + meta_.frag_offset, len},
+                          message);
+  }
+
+  void AssertMessage(const hrpc::Buf& message) {
+    ASSERT_EQ(message_, std::string(message.char_ptr(), message.len()));
+    assembler_.FreeMessage(message);
+  }
+
+  ccb::TimerWheel tw_;
+  hrpc::Env env_;
+  hrpc::FragmentAssembler assembler_;
+  hrpc::Addr addr_;
+  hrpc::RpcMeta meta_;
+  std::string message_;
+};
+
+constexpr size_t FragmentAssemblerTest::kFragSize;
+
+TEST_F(FragmentAssemblerTest, OutOfOrder)
+{
+  hrpc::Buf message{nullptr, 0};
+  ASSERT_FALSE(AddFragment(4, &message));
+  ASSERT_FALSE(AddFragment(0, &message));
+  ASSERT_FALSE(AddFragment(2, &message));
+  // duplicated
+  ASSERT_FALSE(AddFragment(2, &message));
+  ASSERT_FALSE(AddFragment(3, &message));
+  ASSERT_EQ(1UL, assembler_.pending_messages());
+  ASSERT_EQ(message_.size(), assembler_.pending_bytes());
+  ASSERT_TRUE(AddFragment(1, &message));
+  AssertMessage(message);
+  ASSERT_EQ(0UL, assembler_.pending_messages());
+  ASSERT_EQ(0UL, assembler_.pending_bytes());
+}
+
+TEST_F(FragmentAssemblerTest, SeparateMessages)
+{
+  hrpc::Buf message{nullptr, 0};
+  for (size_t i = 0; i + 1 < meta_.frag_count; i++) {
+    ASSERT_FALSE(AddFragment(i, &message));
+  }
+  // request of the same rpc_id is another message
+  meta_.packet_type = hrpc::kRequestPacket;
+  ASSERT_FALSE(AddFragment(meta_.frag_count - 1, &message));
+  ASSERT_EQ(2UL, assembler_.pending_messages());
+  meta_.packet_type = hrpc::kResponsePacket;
+  ASSERT_TRUE(AddFragment(meta_.frag_count - 1, &message));
+  AssertMessage(message);
+  ASSERT_EQ(1UL, assembler_.pending_messages());
+}
+
+TEST_F(FragmentAssemblerTest, BadFragment)
+{
+  hrpc::Buf message{nullptr, 0};
+  meta_.frag_count = 1;
+  ASSERT_FALSE(AddFragment(0, &message));
+  meta_.frag_count = 5;
+  ASSERT_FALSE(AddFragment(5, &message));
+  meta_.total_body_len = 50;
+  ASSERT_FALSE(AddFragment(0, &message));
+  ASSERT_EQ(0UL, assembler_.pending_messages());
+}
+
+TEST_F(FragmentAssemblerTest, MisplacedFragment)
+{
+  hrpc::Buf message{nullptr, 0};
+  // offset not matching the index
+  meta_.frag_index = 1;
+  meta_.frag_offset = 150;
+  ASSERT_FALSE(assembler_.Add(meta_, addr_, {message_.data(), kFragSize},
+                              &message));
+  // too few fragments for the total length
+  meta_.frag_offset = 100;
+  meta_.total_body_len = 1000;
+  ASSERT_FALSE(assembler_.Add(meta_, addr_, {message_.data(), kFragSize},
+                              &message));
+  // last fragment not ending at the total length
+  meta_.total_body_len = message_.size();
+  meta_.frag_index = 4;
+  meta_.frag_offset = 400;
+  ASSERT_FALSE(assembler_.Add(meta_, addr_, {message_.data(), 40},
+                              &message));
+  ASSERT_EQ(0UL, assembler_.pending_messages());
+  // fragment size not matching fragments received
+  ASSERT_FALSE(AddFragment(0, &message));
+  meta_.frag_index = 2;
+  meta_.frag_offset = 180;
+  ASSERT_FALSE(assembler_.Add(meta_, addr_, {message_.data(), 90},
+                              &message));
+  for (size_t i = 1; i + 1 < meta_.frag_count; i++) {
+    ASSERT_FALSE(AddFragment(i, &message));
+  }
+  ASSERT_TRUE(AddFragment(meta_.frag_count - 1, &message));
+  AssertMessage(message);
+}
+
+TEST_F(FragmentAssemblerTest, MemoryLimit)
+{
+  hrpc::Buf message{nullptr, 0};
+  ASSERT_FALSE(AddFragment(0, &message));
+  meta_.rpc_id = 2;
+  ASSERT_FALSE(AddFragment(0, &message));
+  // exceeding 1000 bytes
+  meta_.rpc_id = 3;
+  ASSERT_FALSE(AddFragment(0, &message));
+  ASSERT_EQ(2UL, assembler_.pending_messages());
+}
+
+TEST_F(FragmentAssemblerTest, Timeout)
+{
+  hrpc::Buf message{nullptr, 0};
+  ASSERT_FALSE(AddFragment(0, &message));
+  ASSERT_EQ(1UL, assembler_.pending_messages());
+  for (int i = 0; i < 5; i++) {
+    usleep(1000);
+    tw_.MoveOn();
+  }
+  ASSERT_EQ(0UL, assembler_.pending_messages());
+  ASSERT_EQ(0UL, assembler_.pending_bytes());
+}
+
+PERF_TEST_F(FragmentAssemblerTest, AssemblePerf)
+{
+  hrpc::Buf message{nullptr, 0};
+  for (size_t i = 0; i < meta_.frag_count; i++) {
+    if (AddFragment(i, &message)) {
+      assembler_.FreeMessage(message);
+    }
+  }
+}
@@ -0,0 +1,169 @@
+#include <gtestx/gtestx.h>
+#include "hyperrpc/endpoint_list.h"
+#include "hyperrpc/endpoint_set.h"
+#include "hyperrpc/hash_routing.h"
+#include "test_message.pb.h"
+
+class HashRoutingTest : public testing::Test
+{
+protected:
+  virtual void SetUp() {
+    for (int i = 0; i < 10; i++) {
+      endpoint_list_.PushBack({"127.0.0.1", static_cast<uint16_t>(i)});
+    }
+    set_ = table_.Intern(endpoint_list_);
+    hrpc::RequestKey::Resolve(TestRequest::descriptor(), "key.name",
+                              &key_fields_);
+  }
+
+  virtual void TearDown() {
+    set_->Release();
+  }
+
+  hrpc::EndpointList endpoint_list_;
+  hrpc::EndpointSetTable table_;
+  hrpc::EndpointSet* set_;
+  std::vector<const google::protobuf::FieldDescriptor*> key_fields_;
+  TestRequest request_;
+};
+
+TEST_F(HashRoutingTest, MaglevBalance)
+{
+  hrpc::EndpointSet* set = set_;
+  const hrpc::MaglevTable& maglev = set->maglev();
+  ASSERT_EQ(&maglev, &set->maglev());
+  std::vector<size_t> slots(set->size(), 0);
+  for (size_t i = 0; i < maglev.size(); i++) {
+    slots[maglev.Lookup(i)]++;
+  }
+  size_t average = maglev.size() / set->size();
+  for (size_t n : slots) {
+    ASSERT_LE(average, n);
+    ASSERT_GE(average + 1, n);
+  }
+}
+
+TEST_F(HashRoutingTest, MaglevConsistency)
+{
+  hrpc::EndpointSet* set = set_;
+  // the same endpoints in another order
+  hrpc::EndpointList reversed;
+  for (size_t i = endpoint_list_.size(); i > 0; i--) {
+    reversed.PushBack(endpoint_list_.GetEndpoint(i - 1));
+  }
+  hrpc::EndpointSet* reversed_set = table_.Intern(reversed);
+  // the last endpoint removed
+  hrpc::EndpointList removed(endpoint_list_);
+  removed.Reset();
+  for (size_t i = 0; i + 1 < endpoint_list_.size(); i++) {
+    removed.PushBack(endpoint_list_.GetEndpoint(i));
+  }
+  hrpc::EndpointSet* removed_set = table_.Intern(removed);
+  size_t moved = 0;
+  size_t reordered = 0;
+  const size_t keys = 10000;
+  for (uint64_t key = 0; key < keys; key++) {
+    uint64_t hash = key * 0x9e3779b97f4a7c15UL;
+    hrpc::Addr addr = set->GetEndpoint(set->HashLookup(hash));
+    if (addr != reversed_set->GetEndpoint(reversed_set->HashLookup(hash))) {
+      reordered++;
+    }
+    if (addr != removed_set->GetEndpoint(removed_set->HashLookup(hash)) &&
+        addr != endpoint_list_.GetEndpoint(endpoint_list_.size() - 1)) {
+      moved++;
+    }
+  }
+  // only keys of the removed endpoint move mostly, and the order of
+  // endpoints makes no difference
+  ASSERT_GT(keys / 10, moved);
+  ASSERT_EQ(0UL, reordered);
+  ASSERT_EQ(&set->maglev(), &reversed_set->maglev());
+  ASSERT_NE(&set->maglev(), &removed_set->maglev());
+  reversed_set->Release();
+  removed_set->Release();
+}
+
+TEST_F(HashRoutingTest, MaglevGrowth)
+{
+  // the table size is kept
+  hrpc::EndpointList list;
+  for (int i = 0; i < 15; i++) {
+    list.PushBack({"127.0.0.2", static_cast<uint16_t>(i)});
+  }
+  hrpc::EndpointSet* old_set = table_.Intern(list);
+  hrpc::Addr added{"127.0.0.2", 15};
+  list.PushBack(added);
+  hrpc::EndpointSet* new_set = table_.Intern(list);
+  ASSERT_EQ(old_set->maglev().size(), new_set->maglev().size());
+  size_t moved = 0;
+  size_t to_added = 0;
+  const size_t keys = 10000;
+  for (uint64_t key = 0; key < keys; key++) {
+    uint64_t hash = key * 0x9e3779b97f4a7c15UL;
+    hrpc::Addr addr = new_set->GetEndpoint(new_set->HashLookup(hash));
+    if (addr == added) {
+      to_added++;
+    } else if (addr != old_set->GetEndpoint(old_set->HashLookup(hash))) {
+      moved++;
+    }
+  }
+  // about 1/16 of keys move to the added endpoint, and few others move
+  ASSERT_LT(keys / 32, to_added);
+  ASSERT_GT(keys / 8, to_added);
+  ASSERT_GT(keys / 20, moved);
+  old_set->Release();
+  new_set->Release();
+}
+
+TEST_F(HashRoutingTest, MaglevSize)
+{
+  // small tables for sets of few endpoints
+  ASSERT_GT(set_->size() * 1024, set_->maglev().size());
+  hrpc::EndpointList list;
+  for (int i = 0; i < 1000; i++) {
+    list.PushBack({"127.0.0.3", static_cast<uint16_t>(i)});
+  }
+  hrpc::EndpointSet* set = table_.Intern(list);
+  ASSERT_LE(set->size() * 64, set->maglev().size());
+  set->Release();
+}
+
+TEST_F(HashRoutingTest, ResolveKey)
+{
+  std::vector<const google::protobuf::FieldDescriptor*> fields;
+  auto type = TestRequest::descriptor();
+  ASSERT_TRUE(hrpc::RequestKey::Resolve(type, "id", &fields));
+  ASSERT_EQ(1UL, fields.size());
+  ASSERT_TRUE(hrpc::RequestKey::Resolve(type, "key.name", &fields));
+  ASSERT_EQ(2UL, fields.size());
+  ASSERT_FALSE(hrpc::RequestKey::Resolve(type, "key", &fields));
+  ASSERT_TRUE(fields.empty());
+  ASSERT_FALSE(hrpc::RequestKey::Resolve(type, "key.tags", &fields));
+  ASSERT_FALSE(hrpc::RequestKey::Resolve(type, "id.name", &fields));
+  ASSERT_FALSE(hrpc::RequestKey::Resolve(type, "key.none", &fields));
+  ASSERT_FALSE(hrpc::RequestKey::Resolve(type, "", &fields));
+}
+
+TEST_F(HashRoutingTest, HashKey)
+{
+  request_.set_id(1);
+  // sub-message not set
+  uint64_t empty_hash = hrpc::RequestKey::Hash(key_fields_, request_);
+  request_.mutable_key()->set_name("hello");
+  uint64_t hash = hrpc::RequestKey::Hash(key_fields_, request_);
+  ASSERT_NE(empty_hash, hash);
+  request_.set_id(2);
+  ASSERT_EQ(hash, hrpc::RequestKey::Hash(key_fields_, request_));
+  std::vector<const google::protobuf::FieldDescriptor*> id_fields;
+  ASSERT_TRUE(hrpc::RequestKey::Resolve(TestRequest::descriptor(),
+                                        "id", &id_fields));
+  hash = hrpc::RequestKey::Hash(id_fields, request_);
+  request_.set_id(3);
+  ASSERT_NE(hash, hrpc::RequestKey::Hash(id_fields, request_));
+}
+
+PERF_TEST_F(HashRoutingTest, LookupPerf)
+{
+  request_.mutable_key()->set_name("user-12345");
+  set_->HashLookup(hrpc::RequestKey::Hash(key_fields_, request_));
+}
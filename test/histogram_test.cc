@@ -0,0 +1,72 @@
+#include <gtestx/gtestx.h>
+#include "hyperrpc/histogram.h"
+
+class HistogramTest : public testing::Test
+{
+protected:
+  HistogramTest() : histogram_(1000) {}
+
+  hrpc::Histogram histogram_;
+};
+
+TEST_F(HistogramTest, Empty)
+{
+  ASSERT_EQ(0, histogram_.count());
+  ASSERT_EQ(0, histogram_.Percentile(50));
+}
+
+TEST_F(HistogramTest, SmallValues)
+{
+  for (uint64_t v = 0; v < 4; v++) {
+    histogram_.Add(v);
+  }
+  ASSERT_EQ(4, histogram_.count());
+  ASSERT_EQ(0, histogram_.Percentile(0));
+  ASSERT_EQ(2, histogram_.Percentile(50));
+  ASSERT_EQ(3, histogram_.Percentile(99));
+}
+
+TEST_F(HistogramTest, Percentile)
+{
+  for (uint64_t v = 1; v <= 100; v++) {
+    histogram_.Add(v);
+  }
+  // upper bounds are within 25% of the real values
+  uint64_t p50 = histogram_.Percentile(50);
+  ASSERT_LE(50, p50);
+  ASSERT_GE(50 * 1.25, p50);
+  uint64_t p95 = histogram_.Percentile(95);
+  ASSERT_LE(95, p95);
+  ASSERT_GE(95 * 1.25, p95);
+  ASSERT_GE(100 * 1.25, histogram_.Percentile(100));
+  histogram_.Add(~0UL);
+  ASSERT_EQ(~0UL, histogram_.Percentile(100));
+}
+
+TEST_F(HistogramTest, Decay)
+{
+  for (int i = 0; i < 999; i++) {
+    histogram_.Add(10);
+  }
+  ASSERT_EQ(999, histogram_.count());
+  histogram_.Add(10);
+  ASSERT_EQ(500, histogram_.count());
+  // recent values weigh more after decayed
+  for (int i = 0; i < 600; i++) {
+    histogram_.Add(1000);
+  }
+  ASSERT_EQ(600, histogram_.count());
+  ASSERT_LE(1000, histogram_.Percentile(50));
+}
+
+PERF_TEST_F(HistogramTest, AddPerf)
+{
+  static uint64_t value = 0;
+  histogram_.Add(value++ & 1023);
+}
+
+PERF_TEST_F(HistogramTest, PercentilePerf)
+{
+  histogram_.Add(10);
+  histogram_.Percentile(95);
+}
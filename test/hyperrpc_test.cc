@@ -72,6 +72,30 @@ TEST_F(HyperRpcTest, AsyncCall)
   ASSERT_TRUE(done);
 }
 
+TEST_F(HyperRpcTest, CallbackCall)
+{
+  struct Callback : public hrpc::RpcCallback {
+    virtual void OnDone(hrpc::Result result) override {
+      this->result = result;
+      done = true;
+    }
+    hrpc::Result result = hrpc::kInError;
+    bool done = false;
+  } callback;
+  TestRequest request;
+  request.set_id(10000);
+  request.set_param("hello");
+  TestResponse response;
+  ASSERT_EQ(hrpc::kSuccess,
+            hyper_rpc_.CallMethod(TestService::descriptor()->method(0),
+                                  &request, &response, hrpc::CallOptions(),
+                                  &callback));
+  usleep(1000*10);
+  ASSERT_TRUE(callback.done);
+  ASSERT_EQ(hrpc::kSuccess, callback.result);
+  ASSERT_EQ(request.param(), response.value());
+}
+
 TEST_F(HyperRpcTest, SyncCall)
 {
   TestService::Stub test_service(&hyper_rpc_);
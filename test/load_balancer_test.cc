@@ -0,0 +1,145 @@
+#include <gtestx/gtestx.h>
+#include "hyperrpc/endpoint_list.h"
+#include "hyperrpc/hash_routing.h"
+#include "hyperrpc/load_balancer.h"
+
+class LoadBalancerTest : public testing::Test
+{
+protected:
+  LoadBalancerTest()
+    : env_(hrpc::OptionsBuilder().Build())
+    , lb_(env_) {}
+
+  virtual void SetUp() {
+    for (int i = 0; i < 4; i++) {
+      endpoint_list_.PushBack({"127.0.0.1", static_cast<uint16_t>(i)});
+    }
+    set_ = table_.Intern(endpoint_list_);
+  }
+
+  virtual void TearDown() {
+    set_->Release();
+  }
+
+  // a call to endpoint @index done after @rtt_ms
+  void CallDone(size_t index, uint64_t rtt_ms, bool failed) {
+    lb_.OnDone(lb_.OnSent(set_->GetEndpoint(index)), rtt_ms, failed);
+  }
+
+  hrpc::Env env_;
+  hrpc::LoadBalancer lb_;
+  hrpc::EndpointList endpoint_list_;
+  hrpc::EndpointSetTable table_;
+  hrpc::EndpointSet* set_;
+};
+
+TEST_F(LoadBalancerTest, RoutedOrder)
+{
+  for (int i = 0; i < 10; i++) {
+    ASSERT_EQ(0UL, lb_.Pick(hrpc::kRoutedOrder, set_));
+  }
+}
+
+TEST_F(LoadBalancerTest, RoundRobin)
+{
+  for (size_t i = 0; i < 10; i++) {
+    ASSERT_EQ(i % 4, lb_.Pick(hrpc::kRoundRobin, set_));
+  }
+}
+
+TEST_F(LoadBalancerTest, Stats)
+{
+  ASSERT_EQ(nullptr, lb_.Find(set_->GetEndpoint(0)));
+  hrpc::LoadBalancer::EndpointStats* stats =
+      lb_.OnSent(set_->GetEndpoint(0));
+  ASSERT_EQ(1UL, stats->outstanding);
+  ASSERT_EQ(stats, lb_.Find(set_->GetEndpoint(0)));
+  lb_.OnDone(stats, 10, false);
+  ASSERT_EQ(0UL, stats->outstanding);
+  ASSERT_EQ(10, stats->rtt_ms);
+  ASSERT_EQ(0, stats->error_rate);
+  // latency is kept on failures
+  CallDone(0, 0, true);
+  ASSERT_EQ(10, stats->rtt_ms);
+  ASSERT_LT(0, stats->error_rate);
+  // moves towards the latest ones
+  for (int i = 0; i < 20; i++) {
+    CallDone(0, 20, false);
+  }
+  ASSERT_LT(19, stats->rtt_ms);
+  ASSERT_GT(0.01, stats->error_rate);
+}
+
+TEST_F(LoadBalancerTest, LeastOutstanding)
+{
+  for (size_t i = 0; i < 4; i++) {
+    if (i != 2) {
+      lb_.OnSent(set_->GetEndpoint(i));
+    }
+  }
+  for (int i = 0; i < 10; i++) {
+    ASSERT_EQ(2UL, lb_.Pick(hrpc::kLeastOutstanding, set_));
+  }
+}
+
+TEST_F(LoadBalancerTest, PowerOfTwoChoices)
+{
+  // endpoint 3 is slow, endpoint 1 fails mostly
+  for (size_t i = 0; i < 4; i++) {
+    for (int n = 0; n < 10; n++) {
+      CallDone(i, i == 3 ? 100 : 1, i == 1);
+    }
+  }
+  size_t picks[4] = {0};
+  for (int i = 0; i < 1000; i++) {
+    picks[lb_.Pick(hrpc::kPowerOfTwoChoices, set_)]++;
+  }
+  // the slow one loses to all others, the failing one wins it only
+  ASSERT_EQ(0UL, picks[3]);
+  ASSERT_LT(0UL, picks[1]);
+  ASSERT_LT(picks[1], picks[0]);
+  ASSERT_LT(picks[1], picks[2]);
+}
+
+TEST_F(LoadBalancerTest, PowerOfTwoChoicesOutstanding)
+{
+  CallDone(0, 1, false);
+  CallDone(1, 1, false);
+  for (int i = 0; i < 10; i++) {
+    lb_.OnSent(set_->GetEndpoint(0));
+  }
+  hrpc::EndpointList pair;
+  pair.PushBack(set_->GetEndpoint(0));
+  pair.PushBack(set_->GetEndpoint(1));
+  hrpc::EndpointSet* pair_set = table_.Intern(pair);
+  for (int i = 0; i < 10; i++) {
+    ASSERT_EQ(1UL, lb_.Pick(hrpc::kPowerOfTwoChoices, pair_set));
+  }
+  pair_set->Release();
+}
+
+TEST_F(LoadBalancerTest, PickByHash)
+{
+  size_t index = lb_.PickByHash(set_, 12345, 0);
+  ASSERT_EQ(set_->HashLookup(12345), index);
+  // loads are not bounded
+  for (int i = 0; i < 10; i++) {
+    lb_.OnSent(set_->GetEndpoint(index));
+  }
+  ASSERT_EQ(index, lb_.PickByHash(set_, 12345, 0));
+  // 10 of 11 calls outstanding exceed 1.5 times of the average
+  size_t next = lb_.PickByHash(set_, 12345, 1.5);
+  ASSERT_EQ((index + 1) % 4, next);
+  for (int i = 0; i < 10; i++) {
+    lb_.OnSent(set_->GetEndpoint(next));
+  }
+  ASSERT_EQ((index + 2) % 4, lb_.PickByHash(set_, 12345, 1.5));
+  // within the bound
+  ASSERT_EQ(index, lb_.PickByHash(set_, 12345, 100));
+}
+
+PERF_TEST_F(LoadBalancerTest, PowerOfTwoChoicesPerf)
+{
+  size_t index = lb_.Pick(hrpc::kPowerOfTwoChoices, set_);
+  CallDone(index, 1, false);
+}
@@ -0,0 +1,145 @@
+#include <google/protobuf/descriptor.h>
+#include <gtestx/gtestx.h>
+#include "hyperrpc/method_table.h"
+#include "test_message.hrpc.pb.h"
+
+namespace {
+
+class TestServiceImpl : public TestService
+{
+};
+
+} // namespace
+
+class MethodTableTest : public testing::Test
+{
+protected:
+  virtual void SetUp() {
+    method_ = TestService::descriptor()->method(0);
+    method_id_ = hrpc::MethodTable::MethodId(method_);
+  }
+
+  hrpc::MethodTable method_table_;
+  TestServiceImpl service_;
+  const google::protobuf::MethodDescriptor* method_;
+  uint32_t method_id_;
+};
+
+TEST_F(MethodTableTest, MethodId)
+{
+  ASSERT_EQ(hrpc::MethodTable::MethodId("TestService", "Query"), method_id_);
+  ASSERT_NE(hrpc::MethodTable::MethodId("TestService", "Query2"), method_id_);
+  ASSERT_NE(hrpc::MethodTable::MethodId("TestServic", "eQuery"), method_id_);
+}
+
+TEST_F(MethodTableTest, AddService)
+{
+  ASSERT_EQ(nullptr, method_table_.Find(method_id_));
+  ASSERT_TRUE(method_table_.AddService(&service_));
+  auto entry = method_table_.Find(method_id_);
+  ASSERT_TRUE(entry != nullptr);
+  ASSERT_EQ(entry, method_table_.Find(method_));
+  ASSERT_EQ(method_, entry->method);
+  ASSERT_EQ(&service_, entry->service);
+  ASSERT_EQ(&TestRequest::default_instance(), entry->request_prototype);
+  ASSERT_EQ(&TestResponse::default_instance(), entry->response_prototype);
+}
+
+TEST_F(MethodTableTest, FindOrAdd)
+{
+  auto entry = method_table_.FindOrAdd(method_);
+  ASSERT_TRUE(entry != nullptr);
+  ASSERT_EQ(method_id_, entry->method_id);
+  ASSERT_EQ(nullptr, entry->service);
+  ASSERT_EQ(entry, method_table_.FindOrAdd(method_));
+  ASSERT_EQ(1, method_table_.size());
+  // adding service later reuses the same entry
+  ASSERT_TRUE(method_table_.AddService(&service_));
+  ASSERT_EQ(entry, method_table_.Find(method_id_));
+  ASSERT_EQ(&service_, entry->service);
+  ASSERT_EQ(1, method_table_.size());
+}
+
+TEST_F(MethodTableTest, ResolveCompression)
+{
+  ASSERT_EQ(hrpc::kNoCompress, method_table_.FindOrAdd(method_)
+                                            ->compress_type);
+  // compression is rejected in the default packet version 1
+  ASSERT_THROW(hrpc::OptionsBuilder().Compression(hrpc::kLz4, 100).Build(),
+               std::invalid_argument);
+  ASSERT_THROW(hrpc::OptionsBuilder()
+                   .MethodCompression("TestService.Query", hrpc::kZstd, 200)
+                   .Build(), std::invalid_argument);
+  ASSERT_NO_THROW(hrpc::OptionsBuilder()
+                   .MethodCompression("TestService.Query",
+                                      hrpc::kNoCompress, 0)
+                   .Build());
+  hrpc::Options opt = hrpc::OptionsBuilder().PacketVersion(2)
+                                            .Compression(hrpc::kLz4, 100)
+                                            .Build();
+  hrpc::MethodTable default_table(&opt);
+  auto entry = default_table.FindOrAdd(method_);
+  ASSERT_EQ(hrpc::kLz4, entry->compress_type);
+  ASSERT_EQ(100UL, entry->compress_threshold);
+  opt = hrpc::OptionsBuilder().PacketVersion(2)
+                .Compression(hrpc::kLz4, 100)
+                .MethodCompression("TestService.Query", hrpc::kZstd, 200)
+                .Build();
+  hrpc::MethodTable method_table(&opt);
+  entry = method_table.FindOrAdd(method_);
+  ASSERT_EQ(hrpc::kZstd, entry->compress_type);
+  ASSERT_EQ(200UL, entry->compress_threshold);
+}
+
+TEST_F(MethodTableTest, ResolveLoadBalancing)
+{
+  ASSERT_EQ(hrpc::kRoutedOrder, method_table_.FindOrAdd(method_)
+                                             ->lb_policy);
+  hrpc::Options opt = hrpc::OptionsBuilder()
+                          .LoadBalancing(hrpc::kRoundRobin)
+                          .Build();
+  hrpc::MethodTable default_table(&opt);
+  ASSERT_EQ(hrpc::kRoundRobin, default_table.FindOrAdd(method_)->lb_policy);
+  opt = hrpc::OptionsBuilder()
+            .LoadBalancing(hrpc::kRoundRobin)
+            .ServiceLoadBalancing("TestService", hrpc::kPowerOfTwoChoices)
+            .Build();
+  hrpc::MethodTable service_table(&opt);
+  ASSERT_EQ(hrpc::kPowerOfTwoChoices,
+            service_table.FindOrAdd(method_)->lb_policy);
+}
+
+TEST_F(MethodTableTest, ResolveHashRouting)
+{
+  ASSERT_TRUE(method_table_.FindOrAdd(method_)->hash_key.empty());
+  hrpc::Options opt = hrpc::OptionsBuilder()
+                          .MethodHashRouting("TestService.Query", "key.name",
+                                             1.25)
+                          .Build();
+  hrpc::MethodTable method_table(&opt);
+  auto entry = method_table.FindOrAdd(method_);
+  ASSERT_EQ(2UL, entry->hash_key.size());
+  ASSERT_EQ(1.25, entry->hash_load_factor);
+  ASSERT_THROW(hrpc::OptionsBuilder().MethodHashRouting("TestService.None",
+                                                        "id", 0),
+               std::invalid_argument);
+  ASSERT_THROW(hrpc::OptionsBuilder().MethodHashRouting("TestService.Query",
+                                                        "key", 0),
+               std::invalid_argument);
+  ASSERT_THROW(hrpc::OptionsBuilder().MethodHashRouting("TestService.Query",
+                                                        "id", 0.5),
+               std::invalid_argument);
+}
+
+PERF_TEST_F(MethodTableTest, FindByIdPerf)
+{
+  if (!method_table_.Find(method_id_)) {
+    ASSERT_TRUE(method_table_.AddService(&service_));
+  }
+  ASSERT_TRUE(method_table_.Find(method_id_) != nullptr);
+}
+
+PERF_TEST_F(MethodTableTest, FindByDescriptorPerf)
+{
+  ASSERT_TRUE(method_table_.FindOrAdd(method_) != nullptr);
+}
@@ -0,0 +1,183 @@
+#include <string.h>
+#include <vector>
+#include <gtestx/gtestx.h>
+#include <ccbase/timer_wheel.h>
+#include "hyperrpc/packet_batcher.h"
+
+class PacketBatcherTest : public testing::Test
+{
+protected:
+  PacketBatcherTest()
+    : PacketBatcherTest(hrpc::OptionsBuilder().PacketBatching(100, 0)
+                                              .Build()) {}
+
+  PacketBatcherTest(const hrpc::Options& opt)
+    : tw_(1000, false)
+    , env_(opt, &tw_)
+    , batcher_(env_)
+    , addr1_("127.0.0.1", 1234)
+    , addr2_("127.0.0.1", 1235) {}
+
+  virtual void SetUp() {
+    ASSERT_TRUE(batcher_.Init(
+                0, ccb::BindClosure(this, &PacketBatcherTest::OnFlush)));
+    memset(pkt_buf_, 'x', sizeof(pkt_buf_));
+    tw_.MoveOn();
+  }
+
+  struct Datagram {
+    size_t len;
+    hrpc::Addr addr;
+    void* ctx;
+  };
+
+  void OnFlush(const hrpc::Buf& buf, const hrpc::Addr& addr, void* ctx) {
+    datagrams_.push_back({buf.len(), addr, ctx});
+  }
+
+  void AddRequest(size_t len, uint64_t rpc_id, const hrpc::Addr& addr) {
+    batcher_.Add({pkt_buf_, len}, addr, reinterpret_cast<void*>(rpc_id), 0);
+  }
+
+  ccb::TimerWheel tw_;
+  hrpc::Env env_;
+  hrpc::PacketBatcher batcher_;
+  hrpc::Addr addr1_;
+  hrpc::Addr addr2_;
+  char pkt_buf_[200];
+  std::vector<Datagram> datagrams_;
+};
+
+TEST_F(PacketBatcherTest, FlushAtTaskEnd)
+{
+  AddRequest(20, 1, addr1_);
+  AddRequest(20, 2, addr1_);
+  AddRequest(20, 3, addr1_);
+  ASSERT_EQ(0UL, datagrams_.size());
+  batcher_.Flush();
+  ASSERT_EQ(1UL, datagrams_.size());
+  ASSERT_EQ(60UL, datagrams_[0].len);
+  ASSERT_TRUE(addr1_ == datagrams_[0].addr);
+  void* batch_ctx = datagrams_[0].ctx;
+  ASSERT_TRUE(hrpc::PacketBatcher::IsBatchContext(batch_ctx));
+  ASSERT_EQ(std::vector<uint64_t>({1, 2, 3}), batcher_.TakeBatch(batch_ctx));
+  ASSERT_TRUE(batcher_.TakeBatch(batch_ctx).empty());
+  batcher_.Flush();
+  ASSERT_EQ(1UL, datagrams_.size());
+}
+
+TEST_F(PacketBatcherTest, FlushBySize)
+{
+  for (uint64_t rpc_id = 1; rpc_id <= 6; rpc_id++) {
+    AddRequest(20, rpc_id, addr1_);
+  }
+  ASSERT_EQ(1UL, datagrams_.size());
+  ASSERT_EQ(100UL, datagrams_[0].len);
+  batcher_.Flush();
+  ASSERT_EQ(2UL, datagrams_.size());
+  // single packet is sent with its own context
+  ASSERT_EQ(20UL, datagrams_[1].len);
+  ASSERT_EQ(reinterpret_cast<void*>(6), datagrams_[1].ctx);
+  // too large to be batched
+  AddRequest(150, 7, addr1_);
+  ASSERT_EQ(3UL, datagrams_.size());
+  ASSERT_EQ(150UL, datagrams_[2].len);
+  ASSERT_EQ(reinterpret_cast<void*>(7), datagrams_[2].ctx);
+}
+
+TEST_F(PacketBatcherTest, SeparateDestinations)
+{
+  AddRequest(20, 1, addr1_);
+  AddRequest(20, 2, addr2_);
+  // responses to rpc_core 0 and 1 of addr1_
+  batcher_.Add({pkt_buf_, 20}, addr1_, nullptr, 1);
+  batcher_.Add({pkt_buf_, 20}, addr1_, nullptr, 1);
+  batcher_.Add({pkt_buf_, 20}, addr1_, nullptr, 2);
+  batcher_.Flush();
+  ASSERT_EQ(4UL, datagrams_.size());
+  size_t total_len = 0;
+  for (auto& datagram : datagrams_) {
+    ASSERT_FALSE(hrpc::PacketBatcher::IsBatchContext(datagram.ctx));
+    total_len += datagram.len;
+  }
+  ASSERT_EQ(100UL, total_len);
+}
+
+TEST_F(PacketBatcherTest, SweepIdleBatches)
+{
+  AddRequest(20, 1, addr1_);
+  AddRequest(20, 2, addr2_);
+  batcher_.Flush();
+  AddRequest(20, 3, addr1_);
+  ASSERT_EQ(2UL, batcher_.batch_num());
+  // sweeps once per second
+  for (int i = 0; i < 11; i++) {
+    usleep(100*1000);
+    tw_.MoveOn();
+  }
+  // the batch not flushed is kept
+  ASSERT_EQ(1UL, batcher_.batch_num());
+  batcher_.Flush();
+  ASSERT_EQ(3UL, datagrams_.size());
+  for (int i = 0; i < 11; i++) {
+    usleep(100*1000);
+    tw_.MoveOn();
+  }
+  ASSERT_EQ(0UL, batcher_.batch_num());
+}
+
+class DelayPacketBatcherTest : public PacketBatcherTest
+{
+protected:
+  DelayPacketBatcherTest()
+    : PacketBatcherTest(hrpc::OptionsBuilder().PacketBatching(100, 1500)
+                                              .Build()) {}
+};
+
+TEST_F(DelayPacketBatcherTest, FlushByDelay)
+{
+  AddRequest(20, 1, addr1_);
+  AddRequest(20, 2, addr1_);
+  // not flushed at the end of task
+  batcher_.Flush();
+  ASSERT_EQ(0UL, datagrams_.size());
+  for (int i = 0; i < 5; i++) {
+    usleep(1000);
+    tw_.MoveOn();
+  }
+  ASSERT_EQ(1UL, datagrams_.size());
+  ASSERT_EQ(40UL, datagrams_[0].len);
+  ASSERT_EQ(2UL, batcher_.TakeBatch(datagrams_[0].ctx).size());
+}
+
+class LongDelayPacketBatcherTest : public PacketBatcherTest
+{
+protected:
+  LongDelayPacketBatcherTest()
+    : PacketBatcherTest(hrpc::OptionsBuilder().PacketBatching(100, 20000)
+                                              .Build()) {}
+};
+
+TEST_F(LongDelayPacketBatcherTest, DelayAfterSizeFlush)
+{
+  for (uint64_t rpc_id = 1; rpc_id <= 5; rpc_id++) {
+    AddRequest(20, rpc_id, addr1_);
+  }
+  usleep(10*1000);
+  tw_.MoveOn();
+  // flushed by size, and the next batch is delayed from now
+  AddRequest(20, 6, addr1_);
+  ASSERT_EQ(1UL, datagrams_.size());
+  usleep(15*1000);
+  tw_.MoveOn();
+  ASSERT_EQ(1UL, datagrams_.size());
+  usleep(10*1000);
+  tw_.MoveOn();
+  ASSERT_EQ(2UL, datagrams_.size());
+  ASSERT_EQ(20UL, datagrams_[1].len);
+}
+
+PERF_TEST_F(PacketBatcherTest, AddPerf)
+{
+  AddRequest(60, 1, addr1_);
+}
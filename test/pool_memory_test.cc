@@ -0,0 +1,54 @@
+#include <string.h>
+#include <gtestx/gtestx.h>
+#include "hyperrpc/pool_memory.h"
+
+class PoolMemoryTest : public testing::Test
+{
+protected:
+  hrpc::PoolMemory mem_;
+};
+
+TEST_F(PoolMemoryTest, Map)
+{
+  ASSERT_TRUE(mem_.Map(10000, false));
+  ASSERT_NE(nullptr, mem_.ptr());
+  ASSERT_EQ(10000, mem_.len());
+  ASSERT_FALSE(mem_.huge_page());
+  memset(mem_.ptr(), 1, mem_.len());
+  mem_.MoveToLocalNode();
+  mem_.Unmap();
+  ASSERT_EQ(nullptr, mem_.ptr());
+}
+
+TEST_F(PoolMemoryTest, MapHugePage)
+{
+  // falls back to normal pages if no huge page is reserved
+  ASSERT_TRUE(mem_.Map(3 * hrpc::PoolMemory::kHugePageSize + 1, true));
+  ASSERT_NE(nullptr, mem_.ptr());
+  memset(mem_.ptr(), 1, mem_.len());
+  ASSERT_EQ(0, reinterpret_cast<uintptr_t>(mem_.ptr()) % 4096);
+}
+
+struct Counted
+{
+  Counted() : value(42) { count++; }
+  ~Counted() { count--; }
+  int value;
+  static int count;
+};
+
+int Counted::count = 0;
+
+TEST_F(PoolMemoryTest, PoolArray)
+{
+  {
+    hrpc::PoolArray<Counted> array;
+    ASSERT_TRUE(array.Init(1000, true));
+    ASSERT_EQ(1000, array.size());
+    ASSERT_EQ(1000, Counted::count);
+    ASSERT_EQ(42, array[999].value);
+    ASSERT_TRUE(array.Init(10, false));
+    ASSERT_EQ(10, Counted::count);
+  }
+  ASSERT_EQ(0, Counted::count);
+}
@@ -0,0 +1,49 @@
+#include <gtestx/gtestx.h>
+#include "hyperrpc/retry_budget.h"
+
+class RetryBudgetTest : public testing::Test
+{
+protected:
+  RetryBudgetTest() : budget_(10, 100) {}
+
+  hrpc::RetryBudget budget_;
+};
+
+TEST_F(RetryBudgetTest, Burst)
+{
+  hrpc::RetryBudget budget(10, 3);
+  for (int i = 0; i < 3; i++) {
+    ASSERT_TRUE(budget.TryRetry());
+  }
+  ASSERT_FALSE(budget.TryRetry());
+}
+
+TEST_F(RetryBudgetTest, Percent)
+{
+  hrpc::RetryBudget budget(20, 1);
+  ASSERT_TRUE(budget.TryRetry());
+  for (int i = 0; i < 4; i++) {
+    budget.OnFirstAttempt();
+    ASSERT_FALSE(budget.TryRetry());
+  }
+  budget.OnFirstAttempt();
+  ASSERT_TRUE(budget.TryRetry());
+  ASSERT_FALSE(budget.TryRetry());
+}
+
+TEST_F(RetryBudgetTest, Capped)
+{
+  hrpc::RetryBudget budget(50, 2);
+  for (int i = 0; i < 100; i++) {
+    budget.OnFirstAttempt();
+  }
+  ASSERT_TRUE(budget.TryRetry());
+  ASSERT_TRUE(budget.TryRetry());
+  ASSERT_FALSE(budget.TryRetry());
+}
+
+PERF_TEST_F(RetryBudgetTest, PerfRetry)
+{
+  budget_.OnFirstAttempt();
+  budget_.TryRetry();
+}
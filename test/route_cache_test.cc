@@ -0,0 +1,86 @@
+#include <gtestx/gtestx.h>
+#include "hyperrpc/endpoint_list.h"
+#include "hyperrpc/route_cache.h"
+#include "test_message.hrpc.pb.h"
+
+class RouteCacheTest : public testing::Test
+{
+protected:
+  virtual void SetUp() {
+    method_ = TestService::descriptor()->method(0);
+    hrpc::EndpointList endpoints;
+    endpoints.PushBack({"127.0.0.1", 1234});
+    endpoints.PushBack({"127.0.0.2", 1234});
+    endpoints_ = sets_.Intern(endpoints);
+  }
+
+  virtual void TearDown() {
+    endpoints_->Release();
+  }
+
+  const google::protobuf::MethodDescriptor* method_;
+  hrpc::EndpointSetTable sets_;
+  hrpc::EndpointSet* endpoints_;
+  hrpc::RouteCache cache_;
+};
+
+TEST_F(RouteCacheTest, FindAndExpire)
+{
+  hrpc::EndpointSet* cached = nullptr;
+  ASSERT_FALSE(cache_.Find(method_, 0, 0, &cached));
+  cache_.Add(method_, 0, endpoints_, 100, 0);
+  ASSERT_TRUE(cache_.Find(method_, 0, 99, &cached));
+  ASSERT_EQ(endpoints_, cached);
+  ASSERT_FALSE(cache_.Find(method_, 0, 100, &cached));
+  // keyed by request key as well
+  ASSERT_FALSE(cache_.Find(method_, 1, 0, &cached));
+}
+
+TEST_F(RouteCacheTest, NegativeEntry)
+{
+  cache_.Add(method_, 0, nullptr, 100, 0);
+  hrpc::EndpointSet* cached = endpoints_;
+  ASSERT_TRUE(cache_.Find(method_, 0, 0, &cached));
+  ASSERT_EQ(nullptr, cached);
+}
+
+TEST_F(RouteCacheTest, Reference)
+{
+  ASSERT_EQ(1UL, endpoints_->refs());
+  cache_.Add(method_, 0, endpoints_, 100, 0);
+  cache_.Add(method_, 1, endpoints_, 100, 0);
+  ASSERT_EQ(3UL, endpoints_->refs());
+  // replaced
+  cache_.Add(method_, 1, nullptr, 100, 0);
+  ASSERT_EQ(2UL, endpoints_->refs());
+  cache_.Invalidate("");
+  ASSERT_EQ(1UL, endpoints_->refs());
+  {
+    hrpc::RouteCache cache;
+    cache.Add(method_, 0, endpoints_, 100, 0);
+    ASSERT_EQ(2UL, endpoints_->refs());
+  }
+  ASSERT_EQ(1UL, endpoints_->refs());
+}
+
+TEST_F(RouteCacheTest, Invalidate)
+{
+  cache_.Add(method_, 0, endpoints_, 100, 0);
+  cache_.Add(method_, 1, endpoints_, 100, 0);
+  cache_.Invalidate("OtherService");
+  ASSERT_EQ(2UL, cache_.size());
+  cache_.Invalidate(method_->service()->full_name());
+  ASSERT_EQ(0UL, cache_.size());
+  cache_.Add(method_, 0, endpoints_, 100, 0);
+  cache_.Invalidate("");
+  ASSERT_EQ(0UL, cache_.size());
+}
+
+PERF_TEST_F(RouteCacheTest, FindPerf)
+{
+  if (cache_.size() == 0) {
+    cache_.Add(method_, 0, endpoints_, UINT64_MAX, 0);
+  }
+  hrpc::EndpointSet* cached;
+  cache_.Find(method_, 0, 0, &cached);
+}
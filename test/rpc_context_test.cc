@@ -1,3 +1,4 @@
+#include <memory>
 #include <google/protobuf/descriptor.h>
 #include <gtestx/gtestx.h>
 #include <ccbase/timer_wheel.h>
@@ -13,6 +14,14 @@ protected:
     request.set_param("hello");
     request.SerializeToArray(request_buf_, sizeof(request_buf_));
     request_buf_len_ = request.ByteSizeLong();
+    method_ = method_table_.FindOrAdd(TestService::descriptor()->method(0));
+    const hrpc::Addr addr{"127.0.0.1", 1234};
+    ctx_.reset(new hrpc::IncomingRpcContext(method_, 1000UL, addr));
+    ctx_->Init(TestRequest::default_instance(),
+               TestResponse::default_instance());
+    arena_ctx_.reset(new hrpc::ArenaIncomingRpcContext(method_, 1000UL, addr));
+    arena_ctx_->Init(TestRequest::default_instance(),
+                     TestResponse::default_instance());
   }
 
   virtual void TearDown() {
@@ -20,15 +29,17 @@ protected:
 
   char request_buf_[1024];
   size_t request_buf_len_;
+  hrpc::MethodTable method_table_;
+  hrpc::MethodEntry* method_;
+  std::unique_ptr<hrpc::IncomingRpcContext> ctx_;
+  std::unique_ptr<hrpc::ArenaIncomingRpcContext> arena_ctx_;
 };
 
 TEST_F(RpcContextTest, IncomingRpcContext)
 {
   constexpr uint64_t kRpcId = 1000UL;
   const hrpc::Addr addr{"127.0.0.1", 1234};
-  auto ctx = new hrpc::IncomingRpcContext(
-                            TestService::descriptor()->method(0),
-                            kRpcId, addr);
+  auto ctx = new hrpc::IncomingRpcContext(method_, kRpcId, addr);
   ctx->Init(TestRequest::default_instance(),
             TestResponse::default_instance());
   ASSERT_EQ(TestService::descriptor()->method(0), ctx->method());
@@ -42,9 +53,7 @@ TEST_F(RpcContextTest, ArenaIncomingRpcContext)
 {
   constexpr uint64_t kRpcId = 1000UL;
   const hrpc::Addr addr{"127.0.0.1", 1234};
-  auto ctx = new hrpc::ArenaIncomingRpcContext(
-                            TestService::descriptor()->method(0),
-                            kRpcId, addr);
+  auto ctx = new hrpc::ArenaIncomingRpcContext(method_, kRpcId, addr);
   ctx->Init(TestRequest::default_instance(),
             TestResponse::default_instance());
   ASSERT_EQ(TestService::descriptor()->method(0), ctx->method());
@@ -58,9 +67,7 @@ PERF_TEST_F(RpcContextTest, IncomingRpcContextPerf)
 {
   static constexpr uint64_t kRpcId = 1000UL;
   static const hrpc::Addr addr{"127.0.0.1", 1234};
-  hrpc::IncomingRpcContext ctx {
-    TestService::descriptor()->method(0), kRpcId, addr
-  };
+  hrpc::IncomingRpcContext ctx {method_, kRpcId, addr};
   ctx.Init(TestRequest::default_instance(),
            TestResponse::default_instance());
   ctx.request()->ParseFromArray(request_buf_, request_buf_len_);
@@ -74,9 +81,7 @@ PERF_TEST_F(RpcContextTest, ArenaIncomingRpcContextPerf)
 {
   static constexpr uint64_t kRpcId = 1000UL;
   static const hrpc::Addr addr{"127.0.0.1", 1234};
-  hrpc::ArenaIncomingRpcContext ctx {
-    TestService::descriptor()->method(0), kRpcId, addr
-  };
+  hrpc::ArenaIncomingRpcContext ctx {method_, kRpcId, addr};
   ctx.Init(TestRequest::default_instance(),
            TestResponse::default_instance());
   ctx.request()->ParseFromArray(request_buf_, request_buf_len_);
@@ -85,3 +90,82 @@ PERF_TEST_F(RpcContextTest, ArenaIncomingRpcContextPerf)
   static_cast<TestResponse*>(ctx.response())->set_value(
                       static_cast<TestRequest*>(ctx.request())->param());
 }
+
+TEST_F(RpcContextTest, ReuseIncomingRpcContext)
+{
+  const hrpc::Addr addr{"127.0.0.1", 1234};
+  const hrpc::Addr addr2{"127.0.0.1", 4321};
+  hrpc::IncomingRpcContext ctx {method_, 1000UL, addr};
+  ctx.Init(TestRequest::default_instance(),
+           TestResponse::default_instance());
+  ASSERT_TRUE(ctx.request()->ParseFromArray(request_buf_, request_buf_len_));
+  auto request = ctx.request();
+  ctx.Recycle();
+  ASSERT_EQ(request, ctx.request());
+  ASSERT_EQ(0, static_cast<TestRequest*>(ctx.request())->id());
+  ctx.Reuse(1001UL, addr2, 1);
+  ASSERT_EQ(request, ctx.request());
+  ASSERT_EQ(1001UL, ctx.rpc_id());
+  ASSERT_EQ(addr2, ctx.addr());
+  ASSERT_EQ(1, ctx.pkt_ver());
+}
+
+TEST_F(RpcContextTest, ReuseArenaIncomingRpcContext)
+{
+  const hrpc::Addr addr{"127.0.0.1", 1234};
+  const hrpc::Addr addr2{"127.0.0.1", 4321};
+  hrpc::ArenaIncomingRpcContext ctx {method_, 1000UL, addr};
+  ctx.Init(TestRequest::default_instance(),
+           TestResponse::default_instance());
+  ASSERT_TRUE(ctx.request()->ParseFromArray(request_buf_, request_buf_len_));
+  ctx.Recycle();
+  ASSERT_EQ(0, static_cast<TestRequest*>(ctx.request())->id());
+  ctx.Reuse(1001UL, addr2, 1);
+  ASSERT_EQ(TestRequest::descriptor(), ctx.request()->GetDescriptor());
+  ASSERT_EQ(TestResponse::descriptor(), ctx.response()->GetDescriptor());
+  ASSERT_EQ(0, static_cast<TestRequest*>(ctx.request())->id());
+  ASSERT_EQ(1001UL, ctx.rpc_id());
+  ASSERT_EQ(addr2, ctx.addr());
+  ASSERT_EQ(1, ctx.pkt_ver());
+}
+
+TEST_F(RpcContextTest, ArenaSpaceUsed)
+{
+  const hrpc::Addr addr{"127.0.0.1", 1234};
+  hrpc::ArenaIncomingRpcContext ctx {method_, 1000UL, addr,
+                                     hrpc::kHyperRpcPacketVer, 4096};
+  ctx.Init(TestRequest::default_instance(),
+           TestResponse::default_instance());
+  ASSERT_EQ(4096UL, ctx.ArenaBlockSize());
+  size_t space_used = ctx.ArenaSpaceUsed();
+  ASSERT_LT(0UL, space_used);
+  static_cast<TestResponse*>(ctx.response())->set_value("hello");
+  ASSERT_LT(space_used, ctx.ArenaSpaceUsed());
+  ctx.Recycle();
+  ASSERT_EQ(space_used, ctx.ArenaSpaceUsed());
+  ASSERT_EQ(0UL, ctx_->ArenaSpaceUsed());
+  ASSERT_EQ(0UL, ctx_->ArenaBlockSize());
+}
+
+PERF_TEST_F(RpcContextTest, ReuseIncomingRpcContextPerf)
+{
+  static constexpr uint64_t kRpcId = 1000UL;
+  static const hrpc::Addr addr{"127.0.0.1", 1234};
+  ctx_->Recycle();
+  ctx_->Reuse(kRpcId, addr, hrpc::kHyperRpcPacketVer);
+  ctx_->request()->ParseFromArray(request_buf_, request_buf_len_);
+  static_cast<TestResponse*>(ctx_->response())->set_value(
+                      static_cast<TestRequest*>(ctx_->request())->param());
+}
+
+PERF_TEST_F(RpcContextTest, ReuseArenaIncomingRpcContextPerf)
+{
+  static constexpr uint64_t kRpcId = 1000UL;
+  static const hrpc::Addr addr{"127.0.0.1", 1234};
+  arena_ctx_->Recycle();
+  arena_ctx_->Reuse(kRpcId, addr, hrpc::kHyperRpcPacketVer);
+  auto request = static_cast<TestRequest*>(arena_ctx_->request());
+  request->ParseFromArray(request_buf_, request_buf_len_);
+  static_cast<TestResponse*>(arena_ctx_->response())->set_value(
+                      request->param());
+}
@@ -1,20 +1,64 @@
+#include <stdlib.h>
+#include <new>
+#include <string>
 #include <google/protobuf/descriptor.h>
 #include <gtestx/gtestx.h>
 #include <ccbase/timer_wheel.h>
 #include "hyperrpc/rpc_core.h"
+#include "hyperrpc/compressor.h"
+#include "hyperrpc/protocol.h"
+#include "hyperrpc/rpc_context.h"
 #include "test_message.hrpc.pb.h"
 
+// heap allocations of the thread are counted, so that tests can tell the
+// RPC path free of them
+static thread_local size_t tls_alloc_count = 0;
+
+void* operator new(size_t size)
+{
+  tls_alloc_count++;
+  void* ptr = malloc(size ? size : 1);
+  if (!ptr) throw std::bad_alloc();
+  return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+  free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+  free(ptr);
+}
+
 namespace {
 
 class TestServiceImpl : public TestService
 {
+public:
+  TestServiceImpl() : remaining_ms_(-1), calls_(0) {}
+
+  int64_t remaining_ms() const {
+    return remaining_ms_;
+  }
+  size_t calls() const {
+    return calls_;
+  }
+
 protected:
   virtual void Query(const TestRequest* request, TestResponse* response,
                      hrpc::DoneFunc done) override {
+    remaining_ms_ = hrpc::RemainingRpcTime();
+    calls_++;
     response->set_id(request->id());
     response->set_value(request->param());
     done(hrpc::kSuccess);
   }
+
+private:
+  int64_t remaining_ms_;
+  size_t calls_;
 };
 
 } // namespace
@@ -25,20 +69,29 @@ protected:
   static constexpr size_t kRpcCoreId = 0;
 
   RpcCoreTest()
+    : RpcCoreTest(hrpc::OptionsBuilder().DefaultRpcTimeout(10)
+                                        .PacketVersion(2)
+                                        .LogHandler(hrpc::kError,
+                                           [](hrpc::LogLevel, const char* s) {
+                                             printf("%s\n", s);
+                                           }).Build()) {}
+
+  RpcCoreTest(const hrpc::Options& opt)
     : tw_(1000, false)
-    , env_(hrpc::OptionsBuilder().DefaultRpcTimeout(10)
-                                 .LogHandler(hrpc::kError,
-                                    [](hrpc::LogLevel, const char* s) {
-                                      printf("%s\n", s);
-                                    }).Build(), &tw_)
+    , env_(opt, &tw_)
     , rpc_core_(env_)
     , enable_send_packet_(true)
-    , send_packet_timeout_(1) {}
+    , send_packet_timeout_(1)
+    , bytes_sent_(0)
+    , packets_sent_(0)
+    , recv_delay_ms_(0)
+    , routing_calls_(0)
+    , no_route_(false) {}
 
   virtual void SetUp() {
     ASSERT_TRUE(rpc_core_.Init(kRpcCoreId,
         ccb::BindClosure(this, &RpcCoreTest::OnSendPacket),
-        ccb::BindClosure(this, &RpcCoreTest::OnFindService),
+        {&service_},
         ccb::BindClosure(this, &RpcCoreTest::OnServiceRouting)));
 
     request_.set_id(10000);
@@ -56,22 +109,56 @@ protected:
       });
       return;
     }
-    rpc_core_.OnRecvPacket(buf, addr);
-  }
-
-  hrpc::Service* OnFindService(const std::string& service_name) {
-    return &service_;
+    bytes_sent_ += buf.len();
+    packets_sent_++;
+    // as if waiting in worker-queue for recv_delay_ms_
+    rpc_core_.OnRecvPacket(buf, addr, recv_delay_ms_ ?
+                           hrpc::Env::NowMs() - recv_delay_ms_ : 0);
   }
 
   bool OnServiceRouting(const std::string& service, const std::string& method,
                         const google::protobuf::Message& request,
                         hrpc::RouteInfoBuilder* out) {
     static hrpc::Addr addr{"127.0.0.1", 1234};
+    routing_calls_++;
+    if (no_route_) {
+      return false;
+    }
     out->AddEndpoint(addr);
     out->AddEndpoint(addr);
     return true;
   }
 
+  hrpc::RpcMeta RequestMeta() {
+    hrpc::RpcMeta meta;
+    meta.packet_type = hrpc::kRequestPacket;
+    meta.rpc_result = 0;
+    meta.flags = 0;
+    meta.method_id = hrpc::MethodTable::MethodId(
+                     TestService::descriptor()->method(0));
+    meta.rpc_id = 1;
+    return meta;
+  }
+
+  // as if a request packet built by a peer is received
+  void RecvRequest(uint8_t pkt_ver, const hrpc::RpcMeta& meta,
+                   const std::string& body) {
+    size_t header_len = hrpc::RpcHeaderCodec::EncodedSize(pkt_ver, meta);
+    std::vector<char> pkt(sizeof(hrpc::RpcPacketHeader) + header_len
+                          + body.size());
+    auto pkt_header = reinterpret_cast<hrpc::RpcPacketHeader*>(pkt.data());
+    pkt_header->hrpc_pkt_tag = hrpc::kHyperRpcPacketTag;
+    pkt_header->hrpc_pkt_ver = pkt_ver;
+    pkt_header->rpc_header_len = htons(header_len);
+    pkt_header->rpc_body_len = htonl(body.size());
+    hrpc::RpcHeaderCodec::Encode(pkt_ver, meta,
+                                 pkt.data() + sizeof(hrpc::RpcPacketHeader));
+    memcpy(pkt.data() + sizeof(hrpc::RpcPacketHeader) + header_len,
+           body.data(), body.size());
+    rpc_core_.OnRecvPacket({pkt.data(), pkt.size()},
+                           {"127.0.0.1", 1234}, 0);
+  }
+
   void EnableSendPacket(bool enable) {
     enable_send_packet_ = enable;
   }
@@ -81,6 +168,11 @@ protected:
   hrpc::RpcCore rpc_core_;
   bool enable_send_packet_;
   size_t send_packet_timeout_;
+  size_t bytes_sent_;
+  size_t packets_sent_;
+  uint64_t recv_delay_ms_;
+  size_t routing_calls_;
+  bool no_route_;
 
   TestRequest request_;
   TestResponse response_;
@@ -97,6 +189,49 @@ TEST_F(RpcCoreTest, LoopCall)
                        });
 }
 
+TEST_F(RpcCoreTest, InlineDoneFunc)
+{
+  // closures of the RPC path capture two pointers at most, see
+  // RpcCore::OnRecvRequestMessage() and HyperRpc::CallMethod()
+  bool done = false;
+  bool* done_ptr = &done;
+  size_t alloc_count = tls_alloc_count;
+  hrpc::DoneFunc func = [this, done_ptr](hrpc::Result result) {
+    *done_ptr = (result == hrpc::kSuccess);
+  };
+  hrpc::DoneFunc moved = std::move(func);
+  moved(hrpc::kSuccess);
+  ASSERT_EQ(alloc_count, tls_alloc_count);
+  ASSERT_TRUE(done);
+}
+
+TEST_F(RpcCoreTest, LoopCallAllocation)
+{
+  static constexpr size_t kCalls = 100;
+  size_t done_count = 0;
+  auto loop_call = [this, &done_count] {
+    size_t* done_count_ptr = &done_count;
+    rpc_core_.CallMethod(TestService::descriptor()->method(0),
+                         &request_, &response_,
+                         [done_count_ptr](hrpc::Result result) {
+                           if (result == hrpc::kSuccess) (*done_count_ptr)++;
+                         });
+  };
+  // warm up contexts, sessions and buffers kept for reuse
+  for (size_t i = 0; i < 10; i++) {
+    loop_call();
+  }
+  size_t alloc_count = tls_alloc_count;
+  for (size_t i = 0; i < kCalls; i++) {
+    loop_call();
+  }
+  alloc_count = tls_alloc_count - alloc_count;
+  fprintf(stderr, "heap allocations per RPC (client and server): %.2f\n",
+          static_cast<double>(alloc_count) / kCalls);
+  ASSERT_EQ(10 + kCalls, done_count);
+  ASSERT_EQ(0UL, alloc_count);
+}
+
 PERF_TEST_F(RpcCoreTest, LoopCallPerf)
 {
   rpc_core_.CallMethod(TestService::descriptor()->method(0),
@@ -158,3 +293,501 @@ TEST_F(RpcCoreTest, RetrySuccess)
   ASSERT_TRUE(done);
 }
 
+TEST_F(RpcCoreTest, CallOptionsTimeout)
+{
+  bool done = false;
+  hrpc::CallOptions call_opts;
+  call_opts.timeout_ms = 3;
+  call_opts.max_attempts = 1;
+  EnableSendPacket(false);
+  send_packet_timeout_ = 50; // larger than rpc-timeout
+  rpc_core_.CallMethod(TestService::descriptor()->method(0),
+                       &request_, &response_, call_opts,
+                       [&done](hrpc::Result result) {
+                         ASSERT_EQ(hrpc::kTimeout, result);
+                         done = true;
+                       });
+  for (int i = 0; i < 6; i++) {
+    usleep(1000);
+    tw_.MoveOn();
+  }
+  ASSERT_TRUE(done);
+}
+
+TEST_F(RpcCoreTest, DeadlinePropagated)
+{
+  bool done = false;
+  ASSERT_EQ(-1, hrpc::RemainingRpcTime());
+  rpc_core_.CallMethod(TestService::descriptor()->method(0),
+                       &request_, &response_, [&done](hrpc::Result result) {
+                         ASSERT_EQ(hrpc::kSuccess, result);
+                         done = true;
+                       });
+  ASSERT_TRUE(done);
+  ASSERT_GE(service_.remaining_ms(), 0);
+  ASSERT_LE(service_.remaining_ms(), 10);
+  ASSERT_EQ(-1, hrpc::RemainingRpcTime());
+}
+
+TEST_F(RpcCoreTest, DeadlineKeptInDone)
+{
+  bool done = false;
+  int64_t remaining_ms = -1;
+  {
+    // as if called by an asynchronous service method
+    hrpc::RpcDeadlineScope deadline_scope(hrpc::Env::NowMs() + 50);
+    EnableSendPacket(false);
+    rpc_core_.CallMethod(TestService::descriptor()->method(0),
+                         &request_, &response_, [&](hrpc::Result result) {
+      ASSERT_EQ(hrpc::kTimeout, result);
+      remaining_ms = hrpc::RemainingRpcTime();
+      // calls issued in done callback inherit the deadline as well
+      EnableSendPacket(true);
+      hrpc::CallOptions call_opts;
+      call_opts.timeout_ms = 1000;
+      rpc_core_.CallMethod(TestService::descriptor()->method(0),
+                           &request_, &response_, call_opts,
+                           [&done](hrpc::Result result) {
+                             ASSERT_EQ(hrpc::kSuccess, result);
+                             done = true;
+                           });
+    });
+  }
+  ASSERT_EQ(-1, hrpc::RemainingRpcTime());
+  for (int i = 0; i < 5 && !done; i++) {
+    usleep(1000);
+    tw_.MoveOn();
+  }
+  ASSERT_TRUE(done);
+  ASSERT_GT(remaining_ms, 0);
+  ASSERT_LE(remaining_ms, 50);
+  ASSERT_GT(service_.remaining_ms(), 0);
+  ASSERT_LE(service_.remaining_ms(), 50);
+  ASSERT_EQ(-1, hrpc::RemainingRpcTime());
+}
+
+TEST_F(RpcCoreTest, ExpiredRequestDropped)
+{
+  bool done = false;
+  recv_delay_ms_ = 20; // larger than rpc-timeout
+  rpc_core_.CallMethod(TestService::descriptor()->method(0),
+                       &request_, &response_, [&done](hrpc::Result result) {
+                         ASSERT_EQ(hrpc::kTimeout, result);
+                         done = true;
+                       });
+  ASSERT_FALSE(done);
+  ASSERT_EQ(1, packets_sent_);
+  for (int i = 0; i < 20; i++) {
+    usleep(1000);
+    tw_.MoveOn();
+  }
+  ASSERT_TRUE(done);
+  ASSERT_EQ(-1, service_.remaining_ms());
+}
+
+TEST_F(RpcCoreTest, FanOutCall)
+{
+  bool done = false;
+  TestResponse responses[2];
+  std::vector<hrpc::Result> results;
+  rpc_core_.FanOutCall(TestService::descriptor()->method(0),
+                       {&request_}, {&responses[0], &responses[1]},
+                       &results, hrpc::CallOptions(),
+                       [&done](hrpc::Result result) {
+                         ASSERT_EQ(hrpc::kSuccess, result);
+                         done = true;
+                       });
+  ASSERT_TRUE(done);
+  ASSERT_EQ(4, packets_sent_);
+  for (size_t i = 0; i < 2; i++) {
+    ASSERT_EQ(hrpc::kSuccess, results[i]);
+    ASSERT_EQ(request_.id(), responses[i].id());
+    ASSERT_EQ(request_.param(), responses[i].value());
+  }
+}
+
+PERF_TEST_F(RpcCoreTest, FanOutCallPerf)
+{
+  static TestResponse responses[2];
+  static std::vector<hrpc::Result> results;
+  rpc_core_.FanOutCall(TestService::descriptor()->method(0),
+                       {&request_}, {&responses[0], &responses[1]},
+                       &results, hrpc::CallOptions(),
+                       [](hrpc::Result result) {
+                         ASSERT_EQ(hrpc::kSuccess, result);
+                       });
+}
+
+class V1RpcCoreTest : public RpcCoreTest
+{
+protected:
+  V1RpcCoreTest()
+    : RpcCoreTest(hrpc::OptionsBuilder().DefaultRpcTimeout(10)
+                                        .PacketVersion(1)
+                                        .Build()) {}
+};
+
+TEST_F(V1RpcCoreTest, DefaultVersion)
+{
+  // version 2 is opt-in until all peers upgraded
+  ASSERT_EQ(1UL, hrpc::OptionsBuilder().Build().packet_version);
+}
+
+TEST_F(V1RpcCoreTest, MethodIdCollision)
+{
+  // another method whose method-id happens to be the same
+  const std::string other_service = "OtherService";
+  const std::string other_method = "Other";
+  hrpc::RpcMeta meta = RequestMeta();
+  meta.service_name = &other_service;
+  meta.method_name = &other_method;
+  RecvRequest(1, meta, request_.SerializeAsString());
+  ASSERT_EQ(0UL, service_.calls());
+  meta.service_name = &TestService::descriptor()->name();
+  meta.method_name = &TestService::descriptor()->method(0)->name();
+  RecvRequest(1, meta, request_.SerializeAsString());
+  ASSERT_EQ(1UL, service_.calls());
+  // names are not carried by version 2
+  RecvRequest(2, RequestMeta(), request_.SerializeAsString());
+  ASSERT_EQ(2UL, service_.calls());
+}
+
+TEST_F(V1RpcCoreTest, FanOutCall)
+{
+  bool done = false;
+  TestResponse responses[2];
+  std::vector<hrpc::Result> results;
+  rpc_core_.FanOutCall(TestService::descriptor()->method(0),
+                       {&request_}, {&responses[0], &responses[1]},
+                       &results, hrpc::CallOptions(),
+                       [&done](hrpc::Result result) {
+                         ASSERT_EQ(hrpc::kSuccess, result);
+                         done = true;
+                       });
+  ASSERT_TRUE(done);
+  for (size_t i = 0; i < 2; i++) {
+    ASSERT_EQ(hrpc::kSuccess, results[i]);
+    ASSERT_EQ(request_.param(), responses[i].value());
+  }
+}
+
+
+// calls with profile-like text which is highly compressible
+class TextRpcCoreTest : public RpcCoreTest
+{
+protected:
+  TextRpcCoreTest()
+    : TextRpcCoreTest(hrpc::OptionsBuilder().DefaultRpcTimeout(10)
+                                            .PacketVersion(2).Build()) {}
+
+  TextRpcCoreTest(const hrpc::Options& opt) : RpcCoreTest(opt) {}
+
+  virtual void SetUp() {
+    RpcCoreTest::SetUp();
+    std::string param;
+    for (int i = 0; param.size() < 4096; i++) {
+      param += "{\"uid\":" + std::to_string(10000 + i) +
+               ",\"tags\":[\"sports\",\"music\"]}";
+    }
+    request_.set_param(param);
+  }
+};
+
+PERF_TEST_F(TextRpcCoreTest, LoopCallPerf)
+{
+  rpc_core_.CallMethod(TestService::descriptor()->method(0),
+                       &request_, &response_, [this](hrpc::Result result) {
+                         ASSERT_EQ(hrpc::kSuccess, result);
+                       });
+}
+
+class RouteCacheRpcCoreTest : public RpcCoreTest
+{
+protected:
+  RouteCacheRpcCoreTest()
+    : RpcCoreTest(hrpc::OptionsBuilder().DefaultRpcTimeout(10)
+                                        .PacketVersion(2)
+                                        .RouteCache(1000, 1000)
+                                        .Build()) {}
+};
+
+TEST_F(RouteCacheRpcCoreTest, LoopCall)
+{
+  size_t done_count = 0;
+  for (int i = 0; i < 3; i++) {
+    rpc_core_.CallMethod(TestService::descriptor()->method(0),
+                         &request_, &response_,
+                         [&done_count](hrpc::Result result) {
+                           ASSERT_EQ(hrpc::kSuccess, result);
+                           done_count++;
+                         });
+  }
+  ASSERT_EQ(3UL, done_count);
+  ASSERT_EQ(1UL, routing_calls_);
+  hrpc::RpcStats stats;
+  rpc_core_.GetStats(&stats);
+  ASSERT_EQ(2UL, stats.route_cache_hits);
+  ASSERT_EQ(1UL, stats.route_cache_misses);
+  rpc_core_.InvalidateRoutes(TestService::descriptor()->full_name());
+  rpc_core_.CallMethod(TestService::descriptor()->method(0),
+                       &request_, &response_, [](hrpc::Result result) {
+                         ASSERT_EQ(hrpc::kSuccess, result);
+                       });
+  ASSERT_EQ(2UL, routing_calls_);
+}
+
+TEST_F(RouteCacheRpcCoreTest, NoRoute)
+{
+  no_route_ = true;
+  for (int i = 0; i < 3; i++) {
+    rpc_core_.CallMethod(TestService::descriptor()->method(0),
+                         &request_, &response_, [](hrpc::Result result) {
+                           ASSERT_EQ(hrpc::kNoRoute, result);
+                         });
+  }
+  ASSERT_EQ(1UL, routing_calls_);
+}
+
+PERF_TEST_F(RouteCacheRpcCoreTest, LoopCallPerf)
+{
+  rpc_core_.CallMethod(TestService::descriptor()->method(0),
+                       &request_, &response_, [this](hrpc::Result result) {
+                         ASSERT_EQ(hrpc::kSuccess, result);
+                       });
+}
+
+class CompressRpcCoreTest : public TextRpcCoreTest
+{
+protected:
+  CompressRpcCoreTest()
+    : TextRpcCoreTest(hrpc::OptionsBuilder().DefaultRpcTimeout(10)
+                                            .PacketVersion(2)
+                                            .Compression(hrpc::kLz4, 64)
+                                            .Build()) {}
+};
+
+TEST_F(CompressRpcCoreTest, LoopCall)
+{
+  bool done = false;
+  rpc_core_.CallMethod(TestService::descriptor()->method(0),
+                &request_, &response_, [this, &done](hrpc::Result result) {
+                  ASSERT_EQ(hrpc::kSuccess, result);
+                  ASSERT_EQ(request_.id(), response_.id());
+                  ASSERT_EQ(request_.param(), response_.value());
+                  done = true;
+                });
+  ASSERT_TRUE(done);
+  size_t raw_size = request_.ByteSizeLong() + response_.ByteSizeLong();
+  fprintf(stderr, "raw body bytes:%lu, bytes sent:%lu\n",
+          raw_size, bytes_sent_);
+  ASSERT_LT(bytes_sent_, raw_size);
+}
+
+TEST_F(CompressRpcCoreTest, RawBodyLenBound)
+{
+  auto recv_request = [this](uint32_t raw_body_len) {
+    std::string raw = request_.SerializeAsString();
+    std::string body(hrpc::Compressor::MaxCompressedSize(hrpc::kLz4,
+                                                         raw.size()), 0);
+    body.resize(hrpc::Compressor::Compress(hrpc::kLz4, raw.data(),
+                                           raw.size(), &body[0],
+                                           body.size()));
+    hrpc::RpcMeta meta = RequestMeta();
+    meta.flags = hrpc::kCompressedFlag;
+    meta.compress_type = hrpc::kLz4;
+    meta.raw_body_len = raw_body_len;
+    RecvRequest(2, meta, body);
+  };
+  request_.set_param(std::string(1000, 'x'));
+  // beyond the max ratio of LZ4 to the small body
+  recv_request(1024 * 1024);
+  ASSERT_EQ(0UL, service_.calls());
+  recv_request(request_.ByteSizeLong());
+  ASSERT_EQ(1UL, service_.calls());
+}
+
+TEST_F(CompressRpcCoreTest, BelowThreshold)
+{
+  request_.set_param("hello");
+  rpc_core_.CallMethod(TestService::descriptor()->method(0),
+                       &request_, &response_, [this](hrpc::Result result) {
+                         ASSERT_EQ(hrpc::kSuccess, result);
+                         ASSERT_EQ(request_.param(), response_.value());
+                       });
+  ASSERT_GT(bytes_sent_, request_.ByteSizeLong() + response_.ByteSizeLong());
+}
+
+PERF_TEST_F(CompressRpcCoreTest, LoopCallPerf)
+{
+  rpc_core_.CallMethod(TestService::descriptor()->method(0),
+                       &request_, &response_, [this](hrpc::Result result) {
+                         ASSERT_EQ(hrpc::kSuccess, result);
+                       });
+}
+
+class BatchRpcCoreTest : public RpcCoreTest
+{
+protected:
+  BatchRpcCoreTest()
+    : RpcCoreTest(hrpc::OptionsBuilder().DefaultRpcTimeout(10)
+                                        .PacketVersion(2)
+                                        .PacketBatching(1400, 1000)
+                                        .Build()) {}
+};
+
+TEST_F(BatchRpcCoreTest, LoopCall)
+{
+  size_t done_count = 0;
+  for (int i = 0; i < 3; i++) {
+    rpc_core_.CallMethod(TestService::descriptor()->method(0),
+                  &request_, &response_, [this, &done_count](hrpc::Result r) {
+                    ASSERT_EQ(hrpc::kSuccess, r);
+                    ASSERT_EQ(request_.param(), response_.value());
+                    done_count++;
+                  });
+  }
+  ASSERT_EQ(0UL, packets_sent_);
+  for (int i = 0; i < 5 && done_count < 3; i++) {
+    usleep(1000);
+    tw_.MoveOn();
+  }
+  ASSERT_EQ(3UL, done_count);
+  // one datagram of requests and one of responses
+  ASSERT_EQ(2UL, packets_sent_);
+}
+
+TEST_F(BatchRpcCoreTest, TryAllFailed)
+{
+  size_t done_count = 0;
+  EnableSendPacket(false);
+  for (int i = 0; i < 3; i++) {
+    rpc_core_.CallMethod(TestService::descriptor()->method(0),
+                  &request_, &response_, [&done_count](hrpc::Result r) {
+                    ASSERT_EQ(hrpc::kTimeout, r);
+                    done_count++;
+                  });
+  }
+  for (int i = 0; i < 10 && done_count < 3; i++) {
+    usleep(1000);
+    tw_.MoveOn();
+  }
+  ASSERT_EQ(3UL, done_count);
+}
+
+class TaskBatchRpcCoreTest : public RpcCoreTest
+{
+protected:
+  TaskBatchRpcCoreTest()
+    : RpcCoreTest(hrpc::OptionsBuilder().DefaultRpcTimeout(10)
+                                        .PacketVersion(2)
+                                        .PacketBatching(1400, 0)
+                                        .Build()) {}
+};
+
+TEST_F(TaskBatchRpcCoreTest, LoopCall)
+{
+  bool done = false;
+  rpc_core_.CallMethod(TestService::descriptor()->method(0),
+                &request_, &response_, [this, &done](hrpc::Result result) {
+                  ASSERT_EQ(hrpc::kSuccess, result);
+                  ASSERT_EQ(request_.param(), response_.value());
+                  done = true;
+                });
+  ASSERT_TRUE(done);
+  ASSERT_EQ(2UL, packets_sent_);
+}
+
+PERF_TEST_F(TaskBatchRpcCoreTest, LoopCallPerf)
+{
+  rpc_core_.CallMethod(TestService::descriptor()->method(0),
+                       &request_, &response_, [this](hrpc::Result result) {
+                         ASSERT_EQ(hrpc::kSuccess, result);
+                       });
+}
+
+class FragmentRpcCoreTest : public RpcCoreTest
+{
+protected:
+  FragmentRpcCoreTest()
+    : RpcCoreTest(hrpc::OptionsBuilder().DefaultRpcTimeout(10)
+                                        .PacketVersion(2)
+                                        .FragmentSize(1024)
+                                        .Build()) {}
+
+  virtual void SetUp() {
+    RpcCoreTest::SetUp();
+    std::string param;
+    for (size_t i = 0; i < 200 * 1024; i++) {
+      param.push_back(static_cast<char>(i * 7 % 251));
+    }
+    request_.set_param(param);
+  }
+};
+
+TEST_F(FragmentRpcCoreTest, LoopCall)
+{
+  bool done = false;
+  rpc_core_.CallMethod(TestService::descriptor()->method(0),
+                &request_, &response_, [this, &done](hrpc::Result result) {
+                  ASSERT_EQ(hrpc::kSuccess, result);
+                  ASSERT_EQ(request_.id(), response_.id());
+                  ASSERT_EQ(request_.param(), response_.value());
+                  done = true;
+                });
+  ASSERT_TRUE(done);
+  // 200 fragments of both request and response
+  ASSERT_EQ(2 * ((request_.ByteSizeLong() + 1023) / 1024), packets_sent_);
+}
+
+TEST_F(FragmentRpcCoreTest, FanOutCall)
+{
+  bool done = false;
+  TestResponse responses[2];
+  std::vector<hrpc::Result> results;
+  rpc_core_.FanOutCall(TestService::descriptor()->method(0),
+                       {&request_}, {&responses[0], &responses[1]},
+                       &results, hrpc::CallOptions(),
+                       [&done](hrpc::Result result) {
+                         ASSERT_EQ(hrpc::kSuccess, result);
+                         done = true;
+                       });
+  ASSERT_TRUE(done);
+  for (size_t i = 0; i < 2; i++) {
+    ASSERT_EQ(hrpc::kSuccess, results[i]);
+    ASSERT_EQ(request_.param(), responses[i].value());
+  }
+}
+
+TEST_F(FragmentRpcCoreTest, TryAllFailed)
+{
+  bool done = false;
+  EnableSendPacket(false);
+  rpc_core_.CallMethod(TestService::descriptor()->method(0),
+                       &request_, &response_, [&done](hrpc::Result result) {
+                         ASSERT_EQ(hrpc::kTimeout, result);
+                         done = true;
+                       });
+  for (int i = 0; i < 5; i++) {
+    usleep(1000);
+    tw_.MoveOn();
+  }
+  ASSERT_TRUE(done);
+}
+
+TEST_F(FragmentRpcCoreTest, RejectedInV1)
+{
+  // fragments are not known to the default packet version 1
+  ASSERT_THROW(hrpc::OptionsBuilder().FragmentSize(1024).Build(),
+               std::invalid_argument);
+  ASSERT_THROW(hrpc::OptionsBuilder().FragmentSize(1024).PacketVersion(1)
+                                     .Build(), std::invalid_argument);
+  ASSERT_NO_THROW(hrpc::OptionsBuilder().FragmentSize(0).Build());
+}
+
+PERF_TEST_F(FragmentRpcCoreTest, LoopCallPerf)
+{
+  rpc_core_.CallMethod(TestService::descriptor()->method(0),
+                       &request_, &response_, [this](hrpc::Result result) {
+                         ASSERT_EQ(hrpc::kSuccess, result);
+                       });
+}
@@ -0,0 +1,214 @@
+#include <gtestx/gtestx.h>
+#include "hyperrpc/rpc_header_codec.h"
+#include "hyperrpc/method_table.h"
+#include "hyperrpc/rpc_message.pb.h"
+
+class RpcHeaderCodecTest : public testing::Test
+{
+protected:
+  virtual void SetUp() {
+    meta_.packet_type = hrpc::kResponsePacket;
+    meta_.rpc_result = hrpc::kNotImpl;
+    meta_.flags = 0;
+    meta_.method_id = 0x12345678;
+    meta_.rpc_id = 0x0001deadbeef0001UL;
+    v1_len_ = hrpc::RpcHeaderCodec::Encode(1, meta_, v1_buf_);
+    v2_len_ = hrpc::RpcHeaderCodec::Encode(2, meta_, v2_buf_);
+  }
+
+  void AssertMetaEqual(const hrpc::RpcMeta& meta) {
+    ASSERT_EQ(meta_.packet_type, meta.packet_type);
+    ASSERT_EQ(meta_.rpc_result, meta.rpc_result);
+    ASSERT_EQ(meta_.flags, meta.flags);
+    ASSERT_EQ(meta_.method_id, meta.method_id);
+    ASSERT_EQ(meta_.rpc_id, meta.rpc_id);
+  }
+
+  hrpc::RpcMeta meta_;
+  char v1_buf_[1024];
+  size_t v1_len_;
+  char v2_buf_[1024];
+  size_t v2_len_;
+};
+
+TEST_F(RpcHeaderCodecTest, EncodeDecodeV1)
+{
+  ASSERT_EQ(hrpc::RpcHeaderCodec::EncodedSize(1, meta_), v1_len_);
+  hrpc::RpcMeta meta;
+  ASSERT_TRUE(hrpc::RpcHeaderCodec::Decode(1, v1_buf_, v1_len_, &meta));
+  AssertMetaEqual(meta);
+}
+
+TEST_F(RpcHeaderCodecTest, EncodeDecodeV2)
+{
+  ASSERT_EQ(sizeof(hrpc::RpcHeaderV2), v2_len_);
+  ASSERT_EQ(hrpc::RpcHeaderCodec::EncodedSize(2, meta_), v2_len_);
+  hrpc::RpcMeta meta;
+  ASSERT_TRUE(hrpc::RpcHeaderCodec::Decode(2, v2_buf_, v2_len_, &meta));
+  AssertMetaEqual(meta);
+  // unknown extension bytes are ignored
+  ASSERT_TRUE(hrpc::RpcHeaderCodec::Decode(2, v2_buf_, v2_len_ + 4, &meta));
+  AssertMetaEqual(meta);
+  // truncated header
+  ASSERT_FALSE(hrpc::RpcHeaderCodec::Decode(2, v2_buf_, v2_len_ - 1, &meta));
+}
+
+TEST_F(RpcHeaderCodecTest, DecodeLegacyV1)
+{
+  hrpc::RpcHeader rpc_header;
+  rpc_header.set_packet_type(hrpc::RpcHeader::REQUEST);
+  rpc_header.set_service_name("TestService");
+  rpc_header.set_method_name("Query");
+  rpc_header.set_rpc_id(1);
+  char buf[1024];
+  ASSERT_TRUE(rpc_header.SerializeToArray(buf, sizeof(buf)));
+  hrpc::RpcMeta meta;
+  ASSERT_TRUE(hrpc::RpcHeaderCodec::Decode(1, buf, rpc_header.ByteSizeLong(),
+                                           &meta));
+  ASSERT_EQ(hrpc::kRequestPacket, meta.packet_type);
+  ASSERT_EQ(hrpc::MethodTable::MethodId("TestService", "Query"),
+            meta.method_id);
+  ASSERT_EQ(1UL, meta.rpc_id);
+}
+
+TEST_F(RpcHeaderCodecTest, EncodeV1ForLegacy)
+{
+  // legacy peers parse RpcHeader and match methods by names
+  const std::string service_name = "TestService";
+  const std::string method_name = "Query";
+  meta_.service_name = &service_name;
+  meta_.method_name = &method_name;
+  size_t len = hrpc::RpcHeaderCodec::Encode(1, meta_, v1_buf_);
+  ASSERT_EQ(hrpc::RpcHeaderCodec::EncodedSize(1, meta_), len);
+  hrpc::RpcHeader rpc_header;
+  ASSERT_TRUE(rpc_header.ParseFromArray(v1_buf_, len));
+  ASSERT_EQ(hrpc::RpcHeader::RESPONSE, rpc_header.packet_type());
+  ASSERT_EQ(service_name, rpc_header.service_name());
+  ASSERT_EQ(method_name, rpc_header.method_name());
+  ASSERT_EQ(meta_.rpc_id, rpc_header.rpc_id());
+  ASSERT_EQ(meta_.rpc_result, rpc_header.rpc_result());
+  hrpc::RpcMeta meta;
+  ASSERT_TRUE(hrpc::RpcHeaderCodec::Decode(1, v1_buf_, len, &meta));
+  AssertMetaEqual(meta);
+  ASSERT_EQ(service_name, *meta.service_name);
+  ASSERT_EQ(method_name, *meta.method_name);
+  // names are not sent in version 2
+  len = hrpc::RpcHeaderCodec::Encode(2, meta_, v2_buf_);
+  ASSERT_TRUE(hrpc::RpcHeaderCodec::Decode(2, v2_buf_, len, &meta));
+  ASSERT_EQ(nullptr, meta.service_name);
+}
+
+TEST_F(RpcHeaderCodecTest, CompressExtV2)
+{
+  meta_.flags = hrpc::kCompressedFlag;
+  meta_.compress_type = hrpc::kZstd;
+  meta_.raw_body_len = 100000;
+  size_t len = hrpc::RpcHeaderCodec::Encode(2, meta_, v2_buf_);
+  ASSERT_EQ(sizeof(hrpc::RpcHeaderV2) + sizeof(hrpc::RpcCompressExt), len);
+  ASSERT_EQ(hrpc::RpcHeaderCodec::EncodedSize(2, meta_), len);
+  hrpc::RpcMeta meta;
+  ASSERT_TRUE(hrpc::RpcHeaderCodec::Decode(2, v2_buf_, len, &meta));
+  AssertMetaEqual(meta);
+  ASSERT_EQ(meta_.compress_type, meta.compress_type);
+  ASSERT_EQ(meta_.raw_body_len, meta.raw_body_len);
+  // truncated extension
+  ASSERT_FALSE(hrpc::RpcHeaderCodec::Decode(2, v2_buf_, len - 1, &meta));
+}
+
+TEST_F(RpcHeaderCodecTest, FragmentExtV2)
+{
+  meta_.flags = hrpc::kCompressedFlag | hrpc::kFragmentFlag;
+  meta_.compress_type = hrpc::kLz4;
+  meta_.raw_body_len = 100000;
+  meta_.total_body_len = 50000;
+  meta_.frag_offset = 20000;
+  meta_.frag_index = 2;
+  meta_.frag_count = 5;
+  size_t len = hrpc::RpcHeaderCodec::Encode(2, meta_, v2_buf_);
+  ASSERT_EQ(sizeof(hrpc::RpcHeaderV2) + sizeof(hrpc::RpcCompressExt)
+            + sizeof(hrpc::RpcFragmentExt), len);
+  ASSERT_EQ(hrpc::RpcHeaderCodec::EncodedSize(2, meta_), len);
+  hrpc::RpcMeta meta;
+  ASSERT_TRUE(hrpc::RpcHeaderCodec::Decode(2, v2_buf_, len, &meta));
+  AssertMetaEqual(meta);
+  ASSERT_EQ(meta_.raw_body_len, meta.raw_body_len);
+  ASSERT_EQ(meta_.total_body_len, meta.total_body_len);
+  ASSERT_EQ(meta_.frag_offset, meta.frag_offset);
+  ASSERT_EQ(meta_.frag_index, meta.frag_index);
+  ASSERT_EQ(meta_.frag_count, meta.frag_count);
+  ASSERT_FALSE(hrpc::RpcHeaderCodec::Decode(2, v2_buf_, len - 1, &meta));
+}
+
+TEST_F(RpcHeaderCodecTest, DeadlineExt)
+{
+  meta_.packet_type = hrpc::kRequestPacket;
+  meta_.rpc_result = 0;
+  meta_.flags = hrpc::kFragmentFlag | hrpc::kDeadlineFlag;
+  meta_.total_body_len = 50000;
+  meta_.frag_offset = 0;
+  meta_.frag_index = 0;
+  meta_.frag_count = 5;
+  meta_.timeout_ms = 300;
+  size_t len = hrpc::RpcHeaderCodec::Encode(2, meta_, v2_buf_);
+  ASSERT_EQ(hrpc::RpcHeaderCodec::EncodedSize(2, meta_), len);
+  ASSERT_TRUE(hrpc::RpcHeaderCodec::PatchTimeout(2, v2_buf_, len, 120));
+  hrpc::RpcMeta meta;
+  ASSERT_TRUE(hrpc::RpcHeaderCodec::Decode(2, v2_buf_, len, &meta));
+  AssertMetaEqual(meta);
+  ASSERT_EQ(meta_.frag_count, meta.frag_count);
+  ASSERT_EQ(120U, meta.timeout_ms);
+  ASSERT_FALSE(hrpc::RpcHeaderCodec::Decode(2, v2_buf_, len - 1, &meta));
+  // version 1 keeps deadline only
+  meta_.flags = hrpc::kDeadlineFlag;
+  len = hrpc::RpcHeaderCodec::Encode(1, meta_, v1_buf_);
+  ASSERT_TRUE(hrpc::RpcHeaderCodec::PatchTimeout(1, v1_buf_, len, 120));
+  ASSERT_TRUE(hrpc::RpcHeaderCodec::Decode(1, v1_buf_, len, &meta));
+  AssertMetaEqual(meta);
+  ASSERT_EQ(120U, meta.timeout_ms);
+  // nothing to patch without deadline
+  meta_.flags = 0;
+  len = hrpc::RpcHeaderCodec::Encode(1, meta_, v1_buf_);
+  ASSERT_FALSE(hrpc::RpcHeaderCodec::PatchTimeout(1, v1_buf_, len, 120));
+  len = hrpc::RpcHeaderCodec::Encode(2, meta_, v2_buf_);
+  ASSERT_FALSE(hrpc::RpcHeaderCodec::PatchTimeout(2, v2_buf_, len, 120));
+}
+
+TEST_F(RpcHeaderCodecTest, PatchRpcId)
+{
+  ASSERT_FALSE(hrpc::RpcHeaderCodec::PatchRpcId(1, v1_buf_, v1_len_, 2));
+  ASSERT_TRUE(hrpc::RpcHeaderCodec::PatchRpcId(2, v2_buf_, v2_len_, 2));
+  hrpc::RpcMeta meta;
+  ASSERT_TRUE(hrpc::RpcHeaderCodec::Decode(2, v2_buf_, v2_len_, &meta));
+  ASSERT_EQ(2UL, meta.rpc_id);
+  ASSERT_EQ(meta_.method_id, meta.method_id);
+}
+
+// version 1 header of method-id only
+PERF_TEST_F(RpcHeaderCodecTest, EncodeV1Perf)
+{
+  hrpc::RpcHeaderCodec::Encode(1, meta_, v1_buf_);
+}
+
+PERF_TEST_F(RpcHeaderCodecTest, DecodeV1Perf)
+{
+  hrpc::RpcMeta meta;
+  hrpc::RpcHeaderCodec::Decode(1, v1_buf_, v1_len_, &meta);
+}
+
+// version 1 header of method-id only, as the protobuf message
+PERF_TEST_F(RpcHeaderCodecTest, DecodeV1MessagePerf)
+{
+  hrpc::RpcHeader rpc_header;
+  rpc_header.ParseFromArray(v1_buf_, v1_len_);
+}
+
+PERF_TEST_F(RpcHeaderCodecTest, EncodeV2Perf)
+{
+  hrpc::RpcHeaderCodec::Encode(2, meta_, v2_buf_);
+}
+
+PERF_TEST_F(RpcHeaderCodecTest, DecodeV2Perf)
+{
+  hrpc::RpcMeta meta;
+  hrpc::RpcHeaderCodec::Decode(2, v2_buf_, v2_len_, &meta);
+}
@@ -1,3 +1,5 @@
+#include <string.h>
+#include <algorithm>
 #include <google/protobuf/descriptor.h>
 #include <gtestx/gtestx.h>
 #include <ccbase/timer_wheel.h>
@@ -9,27 +11,41 @@ class RpcSessionManagerTest : public testing::Test
 protected:
   static constexpr size_t kMaxRpcSessions = 128;
   static constexpr size_t kRpcCoreId = 0;
+  static constexpr size_t kRpcTimeout = 5;
 
   RpcSessionManagerTest()
-    : enable_send_request_(true)
+    : RpcSessionManagerTest(hrpc::OptionsBuilder()
+                                .DefaultRpcTimeout(kRpcTimeout)
+                                .LogHandler(hrpc::kError,
+                                   [](hrpc::LogLevel, const char* s) {
+                                     printf("%s\n", s);
+                                   }).Build()) {}
+
+  RpcSessionManagerTest(const hrpc::Options& opt)
+    : max_rpc_sessions_(kMaxRpcSessions)
+    , enable_send_request_(true)
     , hudp_send_timeout_(1)
     , tw_(1000, false)
-    , env_(hrpc::OptionsBuilder().DefaultRpcTimeout(5)
-                                 .LogHandler(hrpc::kError,
-                                    [](hrpc::LogLevel, const char* s) {
-                                      printf("%s\n", s);
-                                    }).Build(), &tw_)
-    , sess_mgr_(env_) {}
+    , env_(opt, &tw_)
+    , sess_mgr_(env_)
+    , method_table_(&env_.opt()) {}
 
   virtual void SetUp() {
-    ASSERT_TRUE(sess_mgr_.Init(kMaxRpcSessions, kRpcCoreId,
-        ccb::BindClosure(this, &RpcSessionManagerTest::OnSendRequest)));
+    ASSERT_TRUE(sess_mgr_.Init(max_rpc_sessions_, kRpcCoreId,
+        ccb::BindClosure(this, &RpcSessionManagerTest::OnEncodeRequest),
+        ccb::BindClosure(this, &RpcSessionManagerTest::OnSendRequest),
+        ccb::BindClosure(this, &RpcSessionManagerTest::OnCloneRequest)));
+    method_ = method_table_.FindOrAdd(TestService::descriptor()->method(0));
     request_.set_id(10000);
     request_.set_param("hello");
     endpoints_.PushBack({"127.0.0.1", 1234});
     endpoints_.PushBack({"127.0.0.2", 1234});
     endpoints_.PushBack({"127.0.0.3", 1234});
+    encode_request_count_ = 0;
     send_request_count_ = 0;
+    drop_request_count_ = 0;
+    clone_request_count_ = 0;
+    sent_endpoints_.clear();
     tw_.MoveOn();
   }
 
@@ -40,11 +56,34 @@ protected:
     enable_send_request_ = enable;
   }
 
-  void OnSendRequest(const google::protobuf::MethodDescriptor* method,
-                     const google::protobuf::Message& request,
-                     uint64_t rpc_id,
-                     const hrpc::Addr&) {
+  hrpc::Buf OnEncodeRequest(const hrpc::MethodEntry* method,
+                            const google::protobuf::Message& request,
+                            uint64_t rpc_id, uint32_t timeout_ms) {
+    encode_request_count_++;
+    size_t len = request.ByteSizeLong();
+    void* ptr = env_.alloc().Alloc(len);
+    request.SerializeToArray(ptr, len);
+    return {ptr, len};
+  }
+
+  hrpc::Buf OnCloneRequest(const hrpc::Buf& pkt, uint64_t rpc_id) {
+    clone_request_count_++;
+    void* ptr = env_.alloc().Alloc(pkt.len());
+    memcpy(ptr, pkt.ptr(), pkt.len());
+    return {ptr, pkt.len()};
+  }
+
+  void OnSendRequest(const hrpc::Buf& pkt, uint64_t rpc_id,
+                     uint32_t timeout_ms, const hrpc::Addr& endpoint) {
     send_request_count_++;
+    sent_endpoints_.push_back(endpoint);
+    last_timeout_ms_ = timeout_ms;
+    last_rpc_id_ = rpc_id;
+    if (drop_request_count_ > 0) {
+      // as if lost or the server is slow
+      drop_request_count_--;
+      return;
+    }
     if (!enable_send_request_) {
       tw_.AddTimer(hudp_send_timeout_, [this, rpc_id] {
           sess_mgr_.OnSendRequestFailed(rpc_id);
@@ -52,28 +91,35 @@ protected:
       return;
     }
     // TestRequest and TestResponse are binary compatible
-    char resp_buf[1024];
-    size_t resp_len = request.ByteSizeLong();
-    ASSERT_TRUE(request.SerializeToArray(resp_buf, sizeof(resp_buf)));
-    sess_mgr_.OnRecvResponse(method->service()->name(), method->name(),
-                             rpc_id, hrpc::kSuccess, {resp_buf, resp_len});
+    sess_mgr_.OnRecvResponse(method_->method_id, rpc_id,
+                             hrpc::kSuccess, pkt);
   }
 
+  size_t max_rpc_sessions_;
   bool enable_send_request_;
   size_t hudp_send_timeout_;
   ccb::TimerWheel tw_;
   hrpc::Env env_;
   hrpc::RpcSessionManager sess_mgr_;
+  hrpc::MethodTable method_table_;
+  hrpc::MethodEntry* method_;
   TestRequest request_;
   TestResponse response_;
   hrpc::EndpointList endpoints_;
+  size_t encode_request_count_;
   size_t send_request_count_;
+  uint32_t last_timeout_ms_;
+  uint64_t last_rpc_id_;
+  size_t drop_request_count_;
+  size_t clone_request_count_;
+  std::vector<hrpc::Addr> sent_endpoints_;
+  hrpc::CallOptions call_opts_;
 };
 
 TEST_F(RpcSessionManagerTest, SimpleCall)
 {
-  ASSERT_TRUE(sess_mgr_.AddSession(TestService::descriptor()->method(0),
-                           &request_, &response_, endpoints_,
+  ASSERT_TRUE(sess_mgr_.AddSession(method_,
+                           &request_, &response_, endpoints_, call_opts_,
                            [this](hrpc::Result result) {
                              ASSERT_EQ(hrpc::kSuccess, result);
                              ASSERT_EQ(request_.id(), response_.id());
@@ -83,8 +129,8 @@ TEST_F(RpcSessionManagerTest, SimpleCall)
 
 PERF_TEST_F(RpcSessionManagerTest, SimpleCallPerf)
 {
-  ASSERT_TRUE(sess_mgr_.AddSession(TestService::descriptor()->method(0),
-                           &request_, &response_, endpoints_,
+  ASSERT_TRUE(sess_mgr_.AddSession(method_,
+                           &request_, &response_, endpoints_, call_opts_,
                            [](hrpc::Result result) {}));
 }
 
@@ -92,25 +138,63 @@ TEST_F(RpcSessionManagerTest, SessionPoolOverflow)
 {
   EnableSendRequest(false);
   for (size_t i = 0; i < kMaxRpcSessions; i++) {
-    ASSERT_TRUE(sess_mgr_.AddSession(TestService::descriptor()->method(0),
-                             &request_, &response_, endpoints_,
+    ASSERT_TRUE(sess_mgr_.AddSession(method_,
+                             &request_, &response_, endpoints_, call_opts_,
                              [](hrpc::Result result) {
                                ASSERT_TRUE(false);
                              }));
   }
-  ASSERT_FALSE(sess_mgr_.AddSession(TestService::descriptor()->method(0),
-                             &request_, &response_, endpoints_,
+  ASSERT_FALSE(sess_mgr_.AddSession(method_,
+                             &request_, &response_, endpoints_, call_opts_,
                              [](hrpc::Result result) {
                                ASSERT_EQ(hrpc::kInError, result);
                              }));
 }
 
+TEST_F(RpcSessionManagerTest, StaleResponseDropped)
+{
+  bool done = false;
+  drop_request_count_ = 1;
+  call_opts_.max_attempts = 1;
+  ASSERT_TRUE(sess_mgr_.AddSession(method_,
+                           &request_, &response_, endpoints_, call_opts_,
+                           [&done](hrpc::Result result) {
+                             ASSERT_EQ(hrpc::kTimeout, result);
+                             done = true;
+                           }));
+  uint64_t stale_rpc_id = last_rpc_id_;
+  for (int i = 0; i < 10 && !done; i++) {
+    usleep(1000);
+    tw_.MoveOn();
+  }
+  ASSERT_TRUE(done);
+  // the node freed is reused with another generation
+  done = false;
+  drop_request_count_ = 1;
+  ASSERT_TRUE(sess_mgr_.AddSession(method_,
+                           &request_, &response_, endpoints_, call_opts_,
+                           [&done](hrpc::Result result) {
+                             ASSERT_EQ(hrpc::kSuccess, result);
+                             done = true;
+                           }));
+  ASSERT_NE(stale_rpc_id, last_rpc_id_);
+  ASSERT_EQ(stale_rpc_id % kMaxRpcSessions, last_rpc_id_ % kMaxRpcSessions);
+  TestResponse resp;
+  std::string resp_body = resp.SerializeAsString();
+  sess_mgr_.OnRecvResponse(method_->method_id, stale_rpc_id, hrpc::kSuccess,
+                           {resp_body.data(), resp_body.size()});
+  ASSERT_FALSE(done);
+  sess_mgr_.OnRecvResponse(method_->method_id, last_rpc_id_, hrpc::kSuccess,
+                           {resp_body.data(), resp_body.size()});
+  ASSERT_TRUE(done);
+}
+
 TEST_F(RpcSessionManagerTest, TryAllFailed)
 {
   bool done = false;
   EnableSendRequest(false);
-  ASSERT_TRUE(sess_mgr_.AddSession(TestService::descriptor()->method(0),
-                           &request_, &response_, endpoints_,
+  ASSERT_TRUE(sess_mgr_.AddSession(method_,
+                           &request_, &response_, endpoints_, call_opts_,
                            [&done](hrpc::Result result) {
                              ASSERT_EQ(hrpc::kTimeout, result);
                              done = true;
@@ -119,6 +203,7 @@ TEST_F(RpcSessionManagerTest, TryAllFailed)
     usleep(1000);
     tw_.MoveOn();
   }
+  ASSERT_EQ(1, encode_request_count_);
   ASSERT_EQ(3, send_request_count_);
   ASSERT_TRUE(done);
 }
@@ -128,8 +213,8 @@ TEST_F(RpcSessionManagerTest, TimeoutFailed)
   bool done = false;
   EnableSendRequest(false);
   hudp_send_timeout_ = 3;
-  ASSERT_TRUE(sess_mgr_.AddSession(TestService::descriptor()->method(0),
-                           &request_, &response_, endpoints_,
+  ASSERT_TRUE(sess_mgr_.AddSession(method_,
+                           &request_, &response_, endpoints_, call_opts_,
                            [&done](hrpc::Result result) {
                              ASSERT_EQ(hrpc::kTimeout, result);
                              done = true;
@@ -147,8 +232,8 @@ TEST_F(RpcSessionManagerTest, RetrySuccess)
   bool done = false;
   EnableSendRequest(false);
   hudp_send_timeout_ = 3;
-  ASSERT_TRUE(sess_mgr_.AddSession(TestService::descriptor()->method(0),
-                           &request_, &response_, endpoints_,
+  ASSERT_TRUE(sess_mgr_.AddSession(method_,
+                           &request_, &response_, endpoints_, call_opts_,
                            [&done](hrpc::Result result) {
                              ASSERT_EQ(hrpc::kSuccess, result);
                              done = true;
@@ -163,3 +248,717 @@ TEST_F(RpcSessionManagerTest, RetrySuccess)
   ASSERT_TRUE(done);
 }
 
+
+TEST_F(RpcSessionManagerTest, RetryWithTimeLeft)
+{
+  bool done = false;
+  EnableSendRequest(false);
+  hudp_send_timeout_ = 2;
+  ASSERT_TRUE(sess_mgr_.AddSession(method_,
+                           &request_, &response_, endpoints_, call_opts_,
+                           [&done](hrpc::Result result) {
+                             ASSERT_EQ(hrpc::kTimeout, result);
+                             done = true;
+                           }));
+  ASSERT_EQ(kRpcTimeout, last_timeout_ms_);
+  for (int i = 0; i < 10 && send_request_count_ < 2; i++) {
+    usleep(1000);
+    tw_.MoveOn();
+  }
+  // more retries may be sent if ticks are skipped
+  ASSERT_LE(2, send_request_count_);
+  ASSERT_GT(kRpcTimeout, last_timeout_ms_);
+  for (int i = 0; i < 10; i++) {
+    usleep(1000);
+    tw_.MoveOn();
+  }
+  ASSERT_TRUE(done);
+}
+
+TEST_F(RpcSessionManagerTest, ShortTimeout)
+{
+  bool done = false;
+  EnableSendRequest(false);
+  hudp_send_timeout_ = 3;
+  call_opts_.timeout_ms = 2;
+  ASSERT_TRUE(sess_mgr_.AddSession(method_,
+                           &request_, &response_, endpoints_, call_opts_,
+                           [&done](hrpc::Result result) {
+                             ASSERT_EQ(hrpc::kTimeout, result);
+                             done = true;
+                           }));
+  for (int i = 0; i < 10; i++) {
+    usleep(1000);
+    tw_.MoveOn();
+  }
+  ASSERT_EQ(1, send_request_count_);
+  ASSERT_TRUE(done);
+}
+
+TEST_F(RpcSessionManagerTest, MaxAttempts)
+{
+  bool done = false;
+  EnableSendRequest(false);
+  call_opts_.max_attempts = 2;
+  ASSERT_TRUE(sess_mgr_.AddSession(method_,
+                           &request_, &response_, endpoints_, call_opts_,
+                           [&done](hrpc::Result result) {
+                             ASSERT_EQ(hrpc::kTimeout, result);
+                             done = true;
+                           }));
+  for (int i = 0; i < 10; i++) {
+    usleep(1000);
+    tw_.MoveOn();
+  }
+  ASSERT_EQ(2, send_request_count_);
+  ASSERT_TRUE(done);
+}
+
+TEST_F(RpcSessionManagerTest, HedgeSuccess)
+{
+  bool done = false;
+  drop_request_count_ = 1;
+  call_opts_.hedge_delay_ms = 2;
+  ASSERT_TRUE(sess_mgr_.AddSession(method_,
+                           &request_, &response_, endpoints_, call_opts_,
+                           [this, &done](hrpc::Result result) {
+                             ASSERT_EQ(hrpc::kSuccess, result);
+                             ASSERT_EQ(request_.id(), response_.id());
+                             done = true;
+                           }));
+  ASSERT_EQ(1, send_request_count_);
+  for (int i = 0; i < 4 && !done; i++) {
+    usleep(1000);
+    tw_.MoveOn();
+  }
+  ASSERT_TRUE(done);
+  ASSERT_EQ(2, send_request_count_);
+}
+
+TEST_F(RpcSessionManagerTest, HedgeAllFailed)
+{
+  bool done = false;
+  EnableSendRequest(false);
+  hudp_send_timeout_ = 3;
+  call_opts_.hedge_delay_ms = 1;
+  call_opts_.max_attempts = 2;
+  ASSERT_TRUE(sess_mgr_.AddSession(method_,
+                           &request_, &response_, endpoints_, call_opts_,
+                           [&done](hrpc::Result result) {
+                             ASSERT_EQ(hrpc::kTimeout, result);
+                             done = true;
+                           }));
+  // the first failure waits for the hedged attempt
+  for (int i = 0; i < 10 && !done; i++) {
+    usleep(1000);
+    tw_.MoveOn();
+  }
+  ASSERT_TRUE(done);
+  ASSERT_EQ(2, send_request_count_);
+}
+
+TEST_F(RpcSessionManagerTest, FanOutAll)
+{
+  bool done = false;
+  TestResponse responses[3];
+  std::vector<hrpc::Result> results;
+  ASSERT_TRUE(sess_mgr_.AddFanOutSession(method_,
+                           {&request_},
+                           {&responses[0], &responses[1], &responses[2]},
+                           &results, endpoints_, call_opts_,
+                           [&done](hrpc::Result result) {
+                             ASSERT_EQ(hrpc::kSuccess, result);
+                             done = true;
+                           }));
+  ASSERT_TRUE(done);
+  // serialized once for all shards
+  ASSERT_EQ(1, encode_request_count_);
+  ASSERT_EQ(2, clone_request_count_);
+  ASSERT_EQ(3, send_request_count_);
+  ASSERT_EQ(3, results.size());
+  for (size_t i = 0; i < 3; i++) {
+    ASSERT_EQ(hrpc::kSuccess, results[i]);
+    ASSERT_EQ(request_.id(), responses[i].id());
+  }
+}
+
+TEST_F(RpcSessionManagerTest, FanOutShards)
+{
+  bool done = false;
+  TestRequest requests[2];
+  TestResponse responses[2];
+  std::vector<hrpc::Result> results;
+  requests[0].set_id(1);
+  requests[1].set_id(2);
+  ASSERT_TRUE(sess_mgr_.AddFanOutSession(method_,
+                           {&requests[0], &requests[1]},
+                           {&responses[0], &responses[1]},
+                           &results, endpoints_, call_opts_,
+                           [&done](hrpc::Result result) {
+                             ASSERT_EQ(hrpc::kSuccess, result);
+                             done = true;
+                           }));
+  ASSERT_TRUE(done);
+  ASSERT_EQ(2, encode_request_count_);
+  ASSERT_EQ(0, clone_request_count_);
+  ASSERT_EQ(1, responses[0].id());
+  ASSERT_EQ(2, responses[1].id());
+}
+
+TEST_F(RpcSessionManagerTest, FanOutQuorum)
+{
+  bool done = false;
+  TestResponse responses[4];
+  std::vector<hrpc::Result> results;
+  drop_request_count_ = 1;
+  call_opts_.quorum = 2;
+  ASSERT_TRUE(sess_mgr_.AddFanOutSession(method_,
+                           {&request_},
+                           {&responses[0], &responses[1], &responses[2],
+                            &responses[3]},
+                           &results, endpoints_, call_opts_,
+                           [&done](hrpc::Result result) {
+                             ASSERT_EQ(hrpc::kSuccess, result);
+                             done = true;
+                           }));
+  // done by shard 1 and 2 with shard 0 pending, and shard 3 not routed
+  ASSERT_TRUE(done);
+  ASSERT_EQ(3, send_request_count_);
+  ASSERT_EQ(hrpc::kTimeout, results[0]);
+  ASSERT_EQ(hrpc::kSuccess, results[1]);
+  ASSERT_EQ(hrpc::kSuccess, results[2]);
+  ASSERT_EQ(hrpc::kNoRoute, results[3]);
+}
+
+TEST_F(RpcSessionManagerTest, FanOutTimeout)
+{
+  bool done = false;
+  TestResponse responses[3];
+  std::vector<hrpc::Result> results;
+  drop_request_count_ = 2;
+  ASSERT_TRUE(sess_mgr_.AddFanOutSession(method_,
+                           {&request_},
+                           {&responses[0], &responses[1], &responses[2]},
+                           &results, endpoints_, call_opts_,
+                           [&done](hrpc::Result result) {
+                             ASSERT_EQ(hrpc::kTimeout, result);
+                             done = true;
+                           }));
+  ASSERT_FALSE(done);
+  for (int i = 0; i < 10 && !done; i++) {
+    usleep(1000);
+    tw_.MoveOn();
+  }
+  // partial results are kept
+  ASSERT_TRUE(done);
+  ASSERT_EQ(hrpc::kTimeout, results[0]);
+  ASSERT_EQ(hrpc::kTimeout, results[1]);
+  ASSERT_EQ(hrpc::kSuccess, results[2]);
+  ASSERT_EQ(request_.id(), responses[2].id());
+}
+
+TEST_F(RpcSessionManagerTest, FanOutQuorumUnreachable)
+{
+  bool done = false;
+  TestResponse responses[3];
+  std::vector<hrpc::Result> results;
+  EnableSendRequest(false);
+  call_opts_.quorum = 2;
+  ASSERT_TRUE(sess_mgr_.AddFanOutSession(method_,
+                           {&request_},
+                           {&responses[0], &responses[1], &responses[2]},
+                           &results, endpoints_, call_opts_,
+                           [&done](hrpc::Result result) {
+                             ASSERT_EQ(hrpc::kTimeout, result);
+                             done = true;
+                           }));
+  for (int i = 0; i < 3 && !done; i++) {
+    usleep(1000);
+    tw_.MoveOn();
+  }
+  // done by send failures before session timeout
+  ASSERT_TRUE(done);
+  ASSERT_EQ(3, send_request_count_);
+}
+
+PERF_TEST_F(RpcSessionManagerTest, FanOutPerf)
+{
+  static TestResponse responses[3];
+  static std::vector<hrpc::Result> results;
+  ASSERT_TRUE(sess_mgr_.AddFanOutSession(method_,
+                           {&request_},
+                           {&responses[0], &responses[1], &responses[2]},
+                           &results, endpoints_, call_opts_,
+                           [](hrpc::Result result) {}));
+}
+
+class AdaptiveHedgeTest : public RpcSessionManagerTest
+{
+protected:
+  AdaptiveHedgeTest()
+    : RpcSessionManagerTest(hrpc::OptionsBuilder()
+                                .DefaultRpcTimeout(kRpcTimeout)
+                                .Hedging(0, 95).Build()) {}
+};
+
+TEST_F(AdaptiveHedgeTest, HedgeAfterWarmup)
+{
+  bool done = false;
+  drop_request_count_ = 1;
+  ASSERT_TRUE(sess_mgr_.AddSession(method_,
+                           &request_, &response_, endpoints_, call_opts_,
+                           [&done](hrpc::Result result) {
+                             ASSERT_EQ(hrpc::kTimeout, result);
+                             done = true;
+                           }));
+  for (int i = 0; i < 10 && !done; i++) {
+    usleep(1000);
+    tw_.MoveOn();
+  }
+  // not hedged without latencies observed
+  ASSERT_TRUE(done);
+  ASSERT_EQ(1, send_request_count_);
+  for (int i = 0; i < 64; i++) {
+    ASSERT_TRUE(sess_mgr_.AddSession(method_,
+                             &request_, &response_, endpoints_, call_opts_,
+                             [](hrpc::Result result) {
+                               ASSERT_EQ(hrpc::kSuccess, result);
+                             }));
+  }
+  done = false;
+  drop_request_count_ = 1;
+  send_request_count_ = 0;
+  ASSERT_TRUE(sess_mgr_.AddSession(method_,
+                           &request_, &response_, endpoints_, call_opts_,
+                           [&done](hrpc::Result result) {
+                             ASSERT_EQ(hrpc::kSuccess, result);
+                             done = true;
+                           }));
+  for (int i = 0; i < 4 && !done; i++) {
+    usleep(1000);
+    tw_.MoveOn();
+  }
+  ASSERT_TRUE(done);
+  ASSERT_EQ(2, send_request_count_);
+}
+
+class RetryBudgetCallTest : public RpcSessionManagerTest
+{
+protected:
+  RetryBudgetCallTest()
+    : RpcSessionManagerTest(hrpc::OptionsBuilder()
+                                .DefaultRpcTimeout(kRpcTimeout)
+                                .RetryBudget(50, 1).Build()) {}
+
+  void CallAndWait(hrpc::Result expected) {
+    bool done = false;
+    ASSERT_TRUE(sess_mgr_.AddSession(method_,
+                             &request_, &response_, endpoints_, call_opts_,
+                             [&done, expected](hrpc::Result result) {
+                               ASSERT_EQ(expected, result);
+                               done = true;
+                             }));
+    for (int i = 0; i < 10 && !done; i++) {
+      usleep(1000);
+      tw_.MoveOn();
+    }
+    ASSERT_TRUE(done);
+  }
+};
+
+TEST_F(RetryBudgetCallTest, Suppressed)
+{
+  EnableSendRequest(false);
+  // one retry in burst, then fail fast
+  CallAndWait(hrpc::kTimeout);
+  ASSERT_EQ(2, send_request_count_);
+  hrpc::RpcStats stats;
+  sess_mgr_.GetStats(&stats);
+  ASSERT_EQ(1, stats.retries);
+  ASSERT_EQ(1, stats.retries_suppressed);
+  // half a token earned by the first attempt
+  send_request_count_ = 0;
+  CallAndWait(hrpc::kTimeout);
+  ASSERT_EQ(1, send_request_count_);
+  send_request_count_ = 0;
+  CallAndWait(hrpc::kTimeout);
+  ASSERT_EQ(2, send_request_count_);
+  stats = hrpc::RpcStats();
+  sess_mgr_.GetStats(&stats);
+  ASSERT_EQ(2, stats.retries);
+  ASSERT_EQ(3, stats.retries_suppressed);
+}
+
+TEST_F(RetryBudgetCallTest, SuccessNotCharged)
+{
+  for (int i = 0; i < 10; i++) {
+    CallAndWait(hrpc::kSuccess);
+  }
+  hrpc::RpcStats stats;
+  sess_mgr_.GetStats(&stats);
+  ASSERT_EQ(0, stats.retries);
+  ASSERT_EQ(0, stats.retries_suppressed);
+}
+
+class LoadBalancingTest : public RpcSessionManagerTest
+{
+protected:
+  LoadBalancingTest()
+    : LoadBalancingTest(hrpc::kRoundRobin) {}
+
+  LoadBalancingTest(hrpc::LbPolicy policy)
+    : RpcSessionManagerTest(hrpc::OptionsBuilder()
+                                .DefaultRpcTimeout(kRpcTimeout)
+                                .LoadBalancing(policy).Build()) {}
+
+  LoadBalancingTest(const hrpc::Options& opt)
+    : RpcSessionManagerTest(opt) {}
+
+  bool Call(hrpc::Result* result) {
+    return sess_mgr_.AddSession(method_,
+                                &request_, &response_, endpoints_, call_opts_,
+                                [result](hrpc::Result r) { *result = r; });
+  }
+};
+
+TEST_F(LoadBalancingTest, RoundRobin)
+{
+  for (size_t i = 0; i < 6; i++) {
+    hrpc::Result result = hrpc::kInError;
+    ASSERT_TRUE(Call(&result));
+    ASSERT_EQ(hrpc::kSuccess, result);
+    ASSERT_EQ(endpoints_.GetEndpoint(i % 3), sent_endpoints_[i]);
+  }
+}
+
+TEST_F(LoadBalancingTest, FailoverInRoutedOrder)
+{
+  hrpc::Result result = hrpc::kInError;
+  ASSERT_TRUE(Call(&result));
+  EnableSendRequest(false);
+  sent_endpoints_.clear();
+  result = hrpc::kInError;
+  ASSERT_TRUE(Call(&result));
+  for (int i = 0; i < 10 && result == hrpc::kInError; i++) {
+    usleep(1000);
+    tw_.MoveOn();
+  }
+  ASSERT_EQ(hrpc::kTimeout, result);
+  ASSERT_EQ(3UL, sent_endpoints_.size());
+  ASSERT_EQ(endpoints_.GetEndpoint(1), sent_endpoints_[0]);
+  ASSERT_EQ(endpoints_.GetEndpoint(2), sent_endpoints_[1]);
+  ASSERT_EQ(endpoints_.GetEndpoint(0), sent_endpoints_[2]);
+}
+
+class LeastOutstandingTest : public LoadBalancingTest
+{
+protected:
+  LeastOutstandingTest() : LoadBalancingTest(hrpc::kLeastOutstanding) {}
+};
+
+TEST_F(LeastOutstandingTest, AvoidPending)
+{
+  hrpc::Result results[3];
+  // two calls pending on distinct endpoints
+  drop_request_count_ = 2;
+  ASSERT_TRUE(Call(&results[0]));
+  ASSERT_TRUE(Call(&results[1]));
+  ASSERT_NE(sent_endpoints_[0], sent_endpoints_[1]);
+  results[2] = hrpc::kInError;
+  ASSERT_TRUE(Call(&results[2]));
+  ASSERT_EQ(hrpc::kSuccess, results[2]);
+  ASSERT_NE(sent_endpoints_[0], sent_endpoints_[2]);
+  ASSERT_NE(sent_endpoints_[1], sent_endpoints_[2]);
+}
+
+PERF_TEST_F(LeastOutstandingTest, CallPerf)
+{
+  hrpc::Result result;
+  ASSERT_TRUE(Call(&result));
+}
+
+class HashRoutingCallTest : public LoadBalancingTest
+{
+protected:
+  HashRoutingCallTest()
+    : LoadBalancingTest(hrpc::OptionsBuilder()
+                            .DefaultRpcTimeout(kRpcTimeout)
+                            .LoadBalancing(hrpc::kRoundRobin)
+                            .MethodHashRouting("TestService.Query", "id", 0)
+                            .Build()) {}
+};
+
+TEST_F(HashRoutingCallTest, SameKeySameEndpoint)
+{
+  for (uint64_t id = 0; id < 20; id++) {
+    request_.set_id(id);
+    hrpc::Result result = hrpc::kInError;
+    ASSERT_TRUE(Call(&result));
+    ASSERT_EQ(hrpc::kSuccess, result);
+    ASSERT_TRUE(Call(&result));
+    ASSERT_EQ(sent_endpoints_[id * 2], sent_endpoints_[id * 2 + 1]);
+  }
+  // keys are spread over endpoints
+  std::sort(sent_endpoints_.begin(), sent_endpoints_.end(),
+            [](const hrpc::Addr& a, const hrpc::Addr& b) {
+              return a.ip() < b.ip();
+            });
+  ASSERT_EQ(3, std::unique(sent_endpoints_.begin(), sent_endpoints_.end())
+               - sent_endpoints_.begin());
+}
+
+class SessionOccupancyTest : public RpcSessionManagerTest
+{
+protected:
+  static constexpr size_t kPoolSize = 65536;
+
+  SessionOccupancyTest() : occupied_(false), rand_(1) {
+    max_rpc_sessions_ = kPoolSize;
+  }
+
+  // occupy the pool with sessions pending for long
+  void Occupy(size_t percent) {
+    if (occupied_) return;
+    occupied_ = true;
+    size_t num = kPoolSize * percent / 100;
+    while (pending_rpc_ids_.size() < num) {
+      AddPendingSession();
+    }
+  }
+
+  void AddPendingSession() {
+    hrpc::CallOptions call_opts;
+    call_opts.timeout_ms = 1000000;
+    drop_request_count_ = 1;
+    ASSERT_TRUE(sess_mgr_.AddSession(method_,
+                             &request_, &response_, endpoints_, call_opts,
+                             [](hrpc::Result result) {}));
+    pending_rpc_ids_.push_back(last_rpc_id_);
+  }
+
+  // complete a random pending session and replace it with a new one
+  void RecvRandomResponse() {
+    rand_ = rand_ * 6364136223846793005UL + 1442695040888963407UL;
+    size_t i = (rand_ >> 33) % pending_rpc_ids_.size();
+    sess_mgr_.OnRecvResponse(method_->method_id, pending_rpc_ids_[i],
+                             hrpc::kSuccess,
+                             {resp_body_.data(), resp_body_.size()});
+    std::swap(pending_rpc_ids_[i], pending_rpc_ids_.back());
+    pending_rpc_ids_.pop_back();
+    AddPendingSession();
+  }
+
+  void CallOnce() {
+    ASSERT_TRUE(sess_mgr_.AddSession(method_,
+                             &request_, &response_, endpoints_, call_opts_,
+                             [](hrpc::Result result) {
+                               ASSERT_EQ(hrpc::kSuccess, result);
+                             }));
+  }
+
+  bool occupied_;
+  uint64_t rand_;
+  std::vector<uint64_t> pending_rpc_ids_;
+  std::string resp_body_;
+};
+
+PERF_TEST_F(SessionOccupancyTest, CallAt10PercentPerf)
+{
+  Occupy(10);
+  CallOnce();
+}
+
+PERF_TEST_F(SessionOccupancyTest, CallAt50PercentPerf)
+{
+  Occupy(50);
+  CallOnce();
+}
+
+PERF_TEST_F(SessionOccupancyTest, CallAt90PercentPerf)
+{
+  Occupy(90);
+  CallOnce();
+}
+
+PERF_TEST_F(SessionOccupancyTest, CallAt99PercentPerf)
+{
+  Occupy(99);
+  CallOnce();
+}
+
+PERF_TEST_F(SessionOccupancyTest, RecvResponsePerf)
+{
+  Occupy(90);
+  RecvRandomResponse();
+}
+
+class ElasticPoolTest : public RpcSessionManagerTest
+{
+protected:
+  static constexpr size_t kSegmentSize = 4096;
+
+  ElasticPoolTest()
+    : RpcSessionManagerTest(hrpc::OptionsBuilder()
+                                .DefaultRpcTimeout(kRpcTimeout)
+                                .SessionShrinkDelay(4).Build()) {
+    max_rpc_sessions_ = 4 * kSegmentSize;
+  }
+
+  uint64_t SessionCapacity() {
+    hrpc::RpcStats stats;
+    sess_mgr_.GetStats(&stats);
+    return stats.session_capacity;
+  }
+
+  void AddPendingSessions(size_t num) {
+    hrpc::CallOptions call_opts;
+    call_opts.timeout_ms = 1000000;
+    for (size_t i = 0; i < num; i++) {
+      drop_request_count_ = 1;
+      ASSERT_TRUE(sess_mgr_.AddSession(method_,
+                               &request_, &response_, endpoints_, call_opts,
+                               [](hrpc::Result result) {
+                                 ASSERT_EQ(hrpc::kSuccess, result);
+                               }));
+      pending_rpc_ids_.push_back(last_rpc_id_);
+    }
+  }
+
+  void RecvResponses(const std::vector<uint64_t>& rpc_ids) {
+    std::string resp_body = TestResponse().SerializeAsString();
+    for (uint64_t rpc_id : rpc_ids) {
+      sess_mgr_.OnRecvResponse(method_->method_id, rpc_id, hrpc::kSuccess,
+                               {resp_body.data(), resp_body.size()});
+    }
+  }
+
+  void WaitTicks(size_t ticks) {
+    uint64_t until = tw_.GetCurrentTick() + ticks;
+    while (tw_.GetCurrentTick() < until) {
+      usleep(1000);
+      tw_.MoveOn();
+    }
+  }
+
+  std::vector<uint64_t> pending_rpc_ids_;
+};
+
+TEST_F(ElasticPoolTest, GrowAndShrink)
+{
+  ASSERT_EQ(kSegmentSize, SessionCapacity());
+  AddPendingSessions(kSegmentSize + 1);
+  ASSERT_EQ(2 * kSegmentSize, SessionCapacity());
+  // not released while in use
+  WaitTicks(8);
+  ASSERT_EQ(2 * kSegmentSize, SessionCapacity());
+  std::vector<uint64_t> stale_rpc_ids;
+  stale_rpc_ids.swap(pending_rpc_ids_);
+  RecvResponses(stale_rpc_ids);
+  WaitTicks(8);
+  ASSERT_EQ(kSegmentSize, SessionCapacity());
+  // responses to slots released are dropped
+  RecvResponses(stale_rpc_ids);
+  // committed again without reusing rpc_ids
+  AddPendingSessions(kSegmentSize + 1);
+  ASSERT_EQ(2 * kSegmentSize, SessionCapacity());
+  std::sort(stale_rpc_ids.begin(), stale_rpc_ids.end());
+  for (uint64_t rpc_id : pending_rpc_ids_) {
+    ASSERT_FALSE(std::binary_search(stale_rpc_ids.begin(),
+                                    stale_rpc_ids.end(), rpc_id));
+  }
+  RecvResponses(pending_rpc_ids_);
+}
+
+TEST_F(ElasticPoolTest, HardCap)
+{
+  AddPendingSessions(4 * kSegmentSize);
+  ASSERT_EQ(4 * kSegmentSize, SessionCapacity());
+  ASSERT_FALSE(sess_mgr_.AddSession(method_,
+                           &request_, &response_, endpoints_, call_opts_,
+                           [](hrpc::Result result) {
+                             ASSERT_EQ(hrpc::kInError, result);
+                           }));
+  RecvResponses(pending_rpc_ids_);
+}
+
+TEST_F(RpcSessionManagerTest, TimeoutQueues)
+{
+  // the last timeout falls back to timer
+  const size_t timeouts[] = {1, 2, 3, 4, 5, 2, 1, 6};
+  size_t done_count = 0;
+  EnableSendRequest(false);
+  hudp_send_timeout_ = 100;
+  for (size_t timeout_ms : timeouts) {
+    call_opts_.timeout_ms = timeout_ms;
+    ASSERT_TRUE(sess_mgr_.AddSession(method_,
+                             &request_, &response_, endpoints_, call_opts_,
+                             [&done_count](hrpc::Result result) {
+                               ASSERT_EQ(hrpc::kTimeout, result);
+                               done_count++;
+                             }));
+  }
+  for (int i = 0; i < 20 && done_count < 8; i++) {
+    usleep(1000);
+    tw_.MoveOn();
+  }
+  ASSERT_EQ(8, done_count);
+}
+
+TEST_F(RpcSessionManagerTest, TimeoutQueueCancel)
+{
+  size_t done_count = 0;
+  std::vector<uint64_t> rpc_ids;
+  for (int i = 0; i < 3; i++) {
+    drop_request_count_ = 1;
+    ASSERT_TRUE(sess_mgr_.AddSession(method_,
+                             &request_, &response_, endpoints_, call_opts_,
+                             [&done_count, i](hrpc::Result result) {
+                               ASSERT_EQ(i == 1 ? hrpc::kSuccess :
+                                                  hrpc::kTimeout, result);
+                               done_count++;
+                             }));
+    rpc_ids.push_back(last_rpc_id_);
+  }
+  // unlink from the middle of the queue
+  std::string resp_body = TestResponse().SerializeAsString();
+  sess_mgr_.OnRecvResponse(method_->method_id, rpc_ids[1], hrpc::kSuccess,
+                           {resp_body.data(), resp_body.size()});
+  ASSERT_EQ(1, done_count);
+  for (int i = 0; i < 20 && done_count < 3; i++) {
+    usleep(1000);
+    tw_.MoveOn();
+  }
+  ASSERT_EQ(3, done_count);
+}
+
+TEST_F(RpcSessionManagerTest, TimeoutQueueRecycle)
+{
+  size_t done_count = 0;
+  auto done = [&done_count](hrpc::Result result) { done_count++; };
+  // queues of one-off timeouts are recycled once drained
+  for (size_t timeout_ms = 100; timeout_ms < 110; timeout_ms++) {
+    call_opts_.timeout_ms = timeout_ms;
+    ASSERT_TRUE(sess_mgr_.AddSession(method_, &request_, &response_,
+                                     endpoints_, call_opts_, done));
+    ASSERT_TRUE(sess_mgr_.IsQueuedTimeout(timeout_ms));
+  }
+  ASSERT_EQ(10, done_count);
+  // one-off timeouts pending take the other queues, but the default one
+  for (size_t timeout_ms = 10; timeout_ms < 20; timeout_ms++) {
+    drop_request_count_ = 1;
+    call_opts_.timeout_ms = timeout_ms;
+    ASSERT_TRUE(sess_mgr_.AddSession(method_, &request_, &response_,
+                                     endpoints_, call_opts_, done));
+  }
+  ASSERT_FALSE(sess_mgr_.IsQueuedTimeout(19));
+  ASSERT_TRUE(sess_mgr_.IsQueuedTimeout(kRpcTimeout));
+  call_opts_.timeout_ms = 0;
+  drop_request_count_ = 1;
+  ASSERT_TRUE(sess_mgr_.AddSession(method_, &request_, &response_,
+                                   endpoints_, call_opts_, done));
+  for (int i = 0; i < 40 && done_count < 21; i++) {
+    usleep(1000);
+    tw_.MoveOn();
+  }
+  ASSERT_EQ(21, done_count);
+}